@@ -0,0 +1,164 @@
+/*
+ *  blitbench - how many map tiles per second image_bitblt or image_blend
+ *  draws.
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+#include "image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the tiles are drawn the way crimage lays out a map, row after row of
+ * hexes, and the rows wrap around the image, so some of them are cut off
+ * at the edges. the checksum of the result is printed as well: it has to
+ * be the same for CRTOOLS_SIMD=none, sse2 and avx2.
+ */
+
+/* a hexagon the size of the tile, with transparent corners like the
+ * terrain tiles of crimage, and a soft edge of partly transparent pixels
+ * for image_blend */
+static void
+make_tile(image * tile, int width, int height)
+{
+  int x, y;
+  image_create(tile, width, height);
+  for (y=0;y!=height;++y) {
+    pixel * row = image_row(tile, y);
+    int dy = y<height/2 ? height/2-y : y-height/2;
+    int inset = dy*width/(2*height);
+    for (x=0;x!=width;++x) {
+      pixel * p = row+x;
+      int edge = min(x-inset, width-inset-1-x);
+      p->r = (unsigned char)(x*4);
+      p->g = (unsigned char)(y*4);
+      p->b = (unsigned char)(x+y);
+      p->alpha = (unsigned char)(edge<0 ? 0 : edge<4 ? 48+edge*48 : 255);
+    }
+  }
+}
+
+static unsigned long
+checksum(const image * img)
+{
+  unsigned long hash = 2166136261UL;
+  int x, y;
+  for (y=0;y!=img->height;++y) {
+    const unsigned char * cp = (const unsigned char *)image_row(img, y);
+    for (x=0;x!=img->width*(int)sizeof(pixel);++x) {
+      hash = ((hash ^ cp[x]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+  }
+  return hash;
+}
+
+int
+usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [options]\n", name);
+  fprintf(stderr, "options:\n"
+    " -h       display this information\n"
+    " -b       draw with image_blend instead of image_bitblt\n"
+    " -t file  draw this png instead of a generated tile\n"
+    " -s w h   size of the generated tile (default: 60 67)\n"
+    " -d w h   size of the image drawn on (default: 1024 1024)\n"
+    " -n count number of tiles to draw (default: 200000)\n"
+    "the vector instructions used are chosen by CRTOOLS_SIMD=none, sse2 or avx2\n");
+  return -1;
+}
+
+int
+main(int argc, char ** argv)
+{
+  image tile, dest;
+  int i, count = 200000;
+  int tilew = 60, tileh = 67, destw = 1024, desth = 1024;
+  const char * tilefile = NULL;
+  void (*draw)(image *, const image *, int, int) = image_bitblt;
+  int x = 0, y = 0, row = 0;
+  clock_t start;
+  double seconds;
+
+  for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
+    switch(argv[i][1]) {
+      case 'h' :
+        return usage(argv[0]);
+      case 'b' :
+        draw = image_blend;
+        break;
+      case 't' :
+        tilefile = argv[++i];
+        break;
+      case 's' :
+        tilew = atoi(argv[++i]);
+        tileh = atoi(argv[++i]);
+        break;
+      case 'd' :
+        destw = atoi(argv[++i]);
+        desth = atoi(argv[++i]);
+        break;
+      case 'n' :
+        count = atoi(argv[++i]);
+        break;
+      default :
+        fprintf(stderr, "Ignoring unknown option.");
+        break;
+    }
+  }
+
+  if (tilefile) {
+    FILE * f = fopen(tilefile, "rb");
+    if (!f) {
+      perror(tilefile);
+      return -1;
+    }
+    if (image_read(&tile, f)!=0) {
+      fprintf(stderr, "%s: not a png\n", tilefile);
+      return -1;
+    }
+  }
+  else make_tile(&tile, tilew, tileh);
+  if (image_create(&dest, destw, desth)!=0) return -1;
+  memset(dest.data, 0, (size_t)dest.stride*dest.height*sizeof(pixel));
+
+  start = clock();
+  for (i=0;i!=count;++i) {
+    draw(&dest, &tile, x, y);
+    x += tile.width;
+    if (x>=destw) {
+      /* every other row is shifted by half a tile, like the hexes */
+      ++row;
+      x = (row & 1) ? -tile.width/2 : 0;
+      y += tile.height*3/4;
+      if (y>=desth) {
+        y = -tile.height/2;
+        row = 0;
+      }
+    }
+  }
+  seconds = (double)(clock()-start)/CLOCKS_PER_SEC;
+
+  printf("%s %s: %d tiles of %dx%d on %dx%d in %.2f s, %.0f tiles/s, checksum %08lx\n",
+    draw==image_blend ? "blend" : "bitblt", image_simd(), count, tile.width, tile.height, destw, desth, seconds,
+    seconds>0 ? count/seconds : 0.0, checksum(&dest));
+  image_free(&tile);
+  image_free(&dest);
+  return 0;
+}
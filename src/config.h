@@ -62,6 +62,7 @@ typedef struct _iobuf FILE;
 # define stricmp(s1, s2) strcasecmp(s1, s2)
 # define strnicmp(s1, s2, n) strncasecmp(s1, s2, n)
 # define CONFIG_HAVE_STRDUP
+# define HAVE_MMAP 1
 #elif defined  __MINGW32__ || defined __CYGWIN32__
 # define HAVE_SNPRINTF 1
 # include <string.h>
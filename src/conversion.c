@@ -36,3 +36,26 @@ atoi36(const char * s)
 {
   return (int)(strtol(s, NULL, 36));
 }
+
+/* a string from a CR as UTF-8. the strings of a CR are latin-1, unless
+ * its VERSION block says otherwise (see crdata_utf8), and a quote or
+ * backslash in them has a backslash in front, which is removed here.
+ * dst must have room for 2*strlen(src)+1 bytes. returns the length of
+ * the result.
+ */
+size_t
+cr_utf8(char * dst, const char * src, int utf8)
+{
+  const unsigned char * cp = (const unsigned char *)src;
+  char * p = dst;
+  for (;*cp;++cp) {
+    if (*cp=='\\' && (cp[1]=='"' || cp[1]=='\\')) ++cp;
+    if (*cp<0x80 || utf8) *p++ = (char)*cp;
+    else {
+      *p++ = (char)(0xC0 | (*cp >> 6));
+      *p++ = (char)(0x80 | (*cp & 0x3F));
+    }
+  }
+  *p = 0;
+  return p-dst;
+}
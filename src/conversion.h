@@ -1,9 +1,12 @@
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern const char* itoa36(int i);
 extern int atoi36(const char * str);
+extern size_t cr_utf8(char * dst, const char * src, int utf8);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,834 @@
+/*
+ *  cr2arrow - export the blocks of Eressea CR files as Arrow tables.
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+#include "crdata.h"
+#include "crparse.h"
+#include "hierarchy.h"
+#include "conversion.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* every block type is written to its own file in the Arrow IPC file format
+ * (https://arrow.apache.org/docs/format/Columnar.html), one row per block.
+ * the metadata of that format are flatbuffers, which are built by hand
+ * here, front to back: an offset always points forward, so everything that
+ * is referenced is written after the table that references it.
+ */
+
+#define MAXTYPES 16
+#define BATCHSIZE 65536 /* rows per record batch */
+#define CMAXHASH 251
+
+static int utf8; /* the strings of the report are UTF-8, not latin-1 */
+
+typedef struct fbuilder {
+  unsigned char * data;
+  size_t size, maxsize;
+} fbuilder;
+
+static void
+put16(unsigned char * p, unsigned int v)
+{
+  p[0] = (unsigned char)(v & 0xFF);
+  p[1] = (unsigned char)((v >> 8) & 0xFF);
+}
+
+static void
+put32(unsigned char * p, unsigned long v)
+{
+  p[0] = (unsigned char)(v & 0xFF);
+  p[1] = (unsigned char)((v >> 8) & 0xFF);
+  p[2] = (unsigned char)((v >> 16) & 0xFF);
+  p[3] = (unsigned char)((v >> 24) & 0xFF);
+}
+
+static void
+put64(unsigned char * p, size_t v)
+{
+  put32(p, (unsigned long)(v & 0xFFFFFFFF));
+  put32(p+4, (unsigned long)(((v >> 16) >> 16) & 0xFFFFFFFF));
+}
+
+static unsigned int
+get16(const unsigned char * p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned long
+get32(const unsigned char * p)
+{
+  return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* appends size bytes at the next multiple of align, zeroed */
+static size_t
+fb_alloc(fbuilder * fb, size_t size, size_t align)
+{
+  size_t pos = (fb->size + align - 1) / align * align;
+  if (pos+size > fb->maxsize) {
+    while (pos+size > fb->maxsize) fb->maxsize = fb->maxsize ? fb->maxsize*2 : 1024;
+    fb->data = realloc(fb->data, fb->maxsize);
+  }
+  memset(fb->data+fb->size, 0, pos+size-fb->size);
+  fb->size = pos+size;
+  return pos;
+}
+
+/** a table with one field for every non-zero entry in sizes. the fields
+ * are laid out largest first, so they are aligned, and the vtable goes
+ * right before the table.
+ */
+static size_t
+fb_table(fbuilder * fb, const int * sizes, int nfields)
+{
+  int offsets[8];
+  int i, size, offset = 4, align = 4;
+  size_t vt, table;
+
+  assert(nfields<=8);
+  for (size=8;size;size/=2) {
+    for (i=0;i!=nfields;++i) if (sizes[i]==size) {
+      if (size>align) align = size;
+      offset = (offset + size - 1) / size * size;
+      offsets[i] = offset;
+      offset += size;
+    }
+  }
+  vt = fb_alloc(fb, 4+2*nfields, 2);
+  put16(fb->data+vt, 4+2*nfields);
+  put16(fb->data+vt+2, offset);
+  for (i=0;i!=nfields;++i) {
+    put16(fb->data+vt+4+2*i, sizes[i] ? offsets[i] : 0);
+  }
+  table = fb_alloc(fb, offset, align);
+  put32(fb->data+table, (unsigned long)(table - vt));
+  return table;
+}
+
+/* position of a field in a table made by fb_table */
+static size_t
+fb_field(const fbuilder * fb, size_t table, int field)
+{
+  size_t vt = table - get32(fb->data+table);
+  return table + get16(fb->data+vt+4+2*field);
+}
+
+static void
+fb_offset(fbuilder * fb, size_t pos, size_t target)
+{
+  put32(fb->data+pos, (unsigned long)(target - pos));
+}
+
+/* a vector of count elements, which start at the returned position + 4 */
+static size_t
+fb_vector(fbuilder * fb, size_t count, size_t elemsize, size_t align)
+{
+  size_t pos;
+  fb_alloc(fb, 0, align);
+  if (align>4) fb_alloc(fb, align-4, 1);
+  pos = fb_alloc(fb, 4+count*elemsize, 4);
+  put32(fb->data+pos, (unsigned long)count);
+  return pos;
+}
+
+static size_t
+fb_string(fbuilder * fb, const char * str)
+{
+  size_t len = strlen(str);
+  size_t pos = fb_alloc(fb, 4+len+1, 4);
+  put32(fb->data+pos, (unsigned long)len);
+  memcpy(fb->data+pos+4, str, len);
+  return pos;
+}
+
+/* from the Arrow flatbuffer schemas: */
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORDBATCH 3
+#define TYPE_INT 2
+#define TYPE_UTF8 5
+#define TYPE_LIST 12
+
+enum { COL_INT, COL_STRING, COL_LIST };
+enum { SRC_ID, SRC_PARENT, SRC_TURN, SRC_ENTRY };
+
+typedef struct column {
+  char * name;          /* utf-8 */
+  int kind;
+  int source, index;    /* for SRC_ID and SRC_PARENT, the index of the id */
+  const property * tag; /* for SRC_ENTRY */
+  int nexthash;
+
+  /* the builder for the current batch: */
+  unsigned char * valid;
+  int nulls;
+  int * values;         /* the ints, or the offsets for strings and lists */
+  unsigned char * heap; /* the characters of strings, the ints of lists */
+  size_t heapsize, maxheap;
+} column;
+
+typedef struct table {
+  const blocktype * type;
+  block ** blocks;
+  int nblocks;
+  column * columns;
+  int ncolumns, maxcolumns;
+  int colhash[CMAXHASH];
+} table;
+
+static void
+heap_reserve(column * c, size_t size)
+{
+  if (c->heapsize+size > c->maxheap) {
+    while (c->heapsize+size > c->maxheap) c->maxheap = c->maxheap ? c->maxheap*2 : 4096;
+    c->heap = realloc(c->heap, c->maxheap);
+  }
+}
+
+static void
+heap_add(column * c, const void * data, size_t size)
+{
+  heap_reserve(c, size);
+  memcpy(c->heap+c->heapsize, data, size);
+  c->heapsize += size;
+}
+
+/* arrow strings are utf-8, cr_utf8 converts the ones from the CR */
+static void
+heap_add_string(column * c, const char * str)
+{
+  heap_reserve(c, 2*strlen(str)+1);
+  c->heapsize += cr_utf8((char *)c->heap+c->heapsize, str, utf8);
+}
+
+static char *
+utf8_name(const char * name)
+{
+  column c;
+  memset(&c, 0, sizeof(c));
+  heap_add_string(&c, name);
+  heap_add(&c, "", 1);
+  return (char*)c.heap;
+}
+
+static column *
+add_column(table * t, const char * name, int kind, int source, int index)
+{
+  column * c;
+  if (t->ncolumns==t->maxcolumns) {
+    t->maxcolumns = t->maxcolumns ? t->maxcolumns*2 : 32;
+    t->columns = realloc(t->columns, t->maxcolumns*sizeof(column));
+  }
+  c = t->columns + t->ncolumns++;
+  memset(c, 0, sizeof(column));
+  c->name = utf8_name(name);
+  c->kind = kind;
+  c->source = source;
+  c->index = index;
+  c->nexthash = -1;
+  return c;
+}
+
+static int
+find_column(const table * t, const property * tag)
+{
+  int i = t->colhash[(size_t)tag % CMAXHASH];
+  while (i>=0 && t->columns[i].tag!=tag) i = t->columns[i].nexthash;
+  return i;
+}
+
+static void
+add_id_columns(table * t, const char * prefix, int source, size_t size)
+{
+  char name[64];
+  size_t i;
+  for (i=0;i!=size;++i) {
+    if (size==1) sprintf(name, "%.60s", prefix);
+    else sprintf(name, "%.50s%u", prefix, (unsigned int)(i+1));
+    add_column(t, name, COL_INT, source, (int)i);
+  }
+}
+
+/** the columns are the ids of the block and its parent, the turn, and
+ * every property that any of the blocks has. a property that is not
+ * always of the same kind becomes a string.
+ */
+static void
+make_columns(table * t)
+{
+  size_t ids = 0, pids = 0;
+  const blocktype * parent = NULL;
+  int i;
+  char name[64];
+
+  for (i=0;i!=CMAXHASH;++i) t->colhash[i] = -1;
+  for (i=0;i!=t->nblocks;++i) {
+    const block * b = t->blocks[i];
+    if (b->size>ids) ids = b->size;
+    /* the ids of a top-level block's parent are just the version */
+    if (b->parent && b->parent->parent && b->parent->size>pids) {
+      pids = b->parent->size;
+      parent = b->parent->type;
+    }
+  }
+  add_id_columns(t, "id", SRC_ID, ids);
+  if (parent) {
+    char * c;
+    sprintf(name, "%.60s", parent->name);
+    for (c=name;*c;++c) *c = (char)tolower((unsigned char)*c);
+    add_id_columns(t, name, SRC_PARENT, pids);
+  }
+  add_column(t, "turn", COL_INT, SRC_TURN, 0);
+
+  for (i=0;i!=t->nblocks;++i) {
+    const entry * e;
+    for (e=t->blocks[i]->entries;e;e=e->next) {
+      int kind, n;
+      if (!e->tag) continue; /* messages have no name */
+      switch (e->type) {
+      case INT: kind = COL_INT; break;
+      case INTS: kind = COL_LIST; break;
+      case STRING: kind = COL_STRING; break;
+      default: continue;
+      }
+      n = find_column(t, e->tag);
+      if (n<0) {
+        column * c = add_column(t, e->tag->name, kind, SRC_ENTRY, 0);
+        unsigned int key = (unsigned int)((size_t)e->tag % CMAXHASH);
+        c->tag = e->tag;
+        c->nexthash = t->colhash[key];
+        t->colhash[key] = t->ncolumns-1;
+      }
+      else if (t->columns[n].kind!=kind) {
+        t->columns[n].kind = COL_STRING;
+      }
+    }
+  }
+}
+
+static void
+begin_batch(table * t)
+{
+  int i;
+  for (i=0;i!=t->ncolumns;++i) {
+    column * c = t->columns+i;
+    if (!c->values) {
+      c->valid = malloc(BATCHSIZE/8);
+      c->values = malloc((BATCHSIZE+1)*sizeof(int));
+    }
+    memset(c->valid, 0, BATCHSIZE/8);
+    c->nulls = 0;
+    c->values[0] = 0;
+    c->heapsize = 0;
+  }
+}
+
+static void
+append_value(column * c, int row, const entry * e, const int * value)
+{
+  int i;
+
+  if (e==NULL && value==NULL) {
+    ++c->nulls;
+    if (c->kind!=COL_INT) c->values[row+1] = c->values[row];
+    else c->values[row] = 0;
+    return;
+  }
+  c->valid[row/8] |= (unsigned char)(1 << (row%8));
+  switch (c->kind) {
+  case COL_INT:
+    c->values[row] = value ? *value : e->data.i;
+    break;
+  case COL_LIST:
+    heap_add(c, e->data.ip+1, e->data.ip[0]*sizeof(int));
+    c->values[row+1] = (int)(c->heapsize/sizeof(int));
+    break;
+  case COL_STRING:
+    if (value || e->type==INT) {
+      char buffer[12];
+      sprintf(buffer, "%d", value ? *value : e->data.i);
+      heap_add(c, buffer, strlen(buffer));
+    }
+    else if (e->type==INTS) {
+      for (i=1;i<=e->data.ip[0];++i) {
+        char buffer[13];
+        sprintf(buffer, i>1 ? " %d" : "%d", e->data.ip[i]);
+        heap_add(c, buffer, strlen(buffer));
+      }
+    }
+    else heap_add_string(c, e->data.cp);
+    c->values[row+1] = (int)c->heapsize;
+    break;
+  }
+}
+
+static void
+append_row(table * t, int row, const block * b, const entry ** entries)
+{
+  const entry * e;
+  int i;
+
+  for (i=0;i!=t->ncolumns;++i) entries[i] = NULL;
+  for (e=b->entries;e;e=e->next) if (e->tag) {
+    int n = find_column(t, e->tag);
+    if (n>=0) entries[n] = e;
+  }
+  for (i=0;i!=t->ncolumns;++i) {
+    column * c = t->columns+i;
+    switch (c->source) {
+    case SRC_ID:
+      append_value(c, row, NULL, c->index<(int)b->size ? b->ids+c->index : NULL);
+      break;
+    case SRC_PARENT:
+      if (b->parent && c->index<(int)b->parent->size) {
+        append_value(c, row, NULL, b->parent->ids+c->index);
+      }
+      else append_value(c, row, NULL, NULL);
+      break;
+    case SRC_TURN:
+      append_value(c, row, NULL, &b->turn);
+      break;
+    default:
+      append_value(c, row, entries[i], NULL);
+      break;
+    }
+  }
+}
+
+static size_t
+build_field(fbuilder * fb, const char * name, int kind)
+{
+  static const int sizes[] = { 4, 1, 1, 4, 0, 4 };
+  size_t field = fb_table(fb, sizes, 6);
+  size_t type, children;
+
+  fb->data[fb_field(fb, field, 1)] = 1; /* nullable */
+  fb_offset(fb, fb_field(fb, field, 0), fb_string(fb, name));
+  if (kind==COL_INT) {
+    static const int isizes[] = { 4, 1 };
+    fb->data[fb_field(fb, field, 2)] = TYPE_INT;
+    type = fb_table(fb, isizes, 2);
+    put32(fb->data+fb_field(fb, type, 0), 32);
+    fb->data[fb_field(fb, type, 1)] = 1;
+  } else {
+    fb->data[fb_field(fb, field, 2)] = (unsigned char)(kind==COL_LIST ? TYPE_LIST : TYPE_UTF8);
+    type = fb_table(fb, NULL, 0);
+  }
+  fb_offset(fb, fb_field(fb, field, 3), type);
+  children = fb_vector(fb, kind==COL_LIST ? 1 : 0, 4, 4);
+  fb_offset(fb, fb_field(fb, field, 5), children);
+  if (kind==COL_LIST) {
+    fb_offset(fb, children+4, build_field(fb, "item", COL_INT));
+  }
+  return field;
+}
+
+static size_t
+build_schema(fbuilder * fb, const table * t)
+{
+  static const int sizes[] = { 2, 4 };
+  size_t schema = fb_table(fb, sizes, 2);
+  size_t fields = fb_vector(fb, t->ncolumns, 4, 4);
+  int i, one = 1;
+
+  /* the buffers are written as they are in memory */
+  put16(fb->data+fb_field(fb, schema, 0), *(char*)&one ? 0 : 1);
+  fb_offset(fb, fb_field(fb, schema, 1), fields);
+  for (i=0;i!=t->ncolumns;++i) {
+    const column * c = t->columns+i;
+    fb_offset(fb, fields+4+4*i, build_field(fb, c->name, c->kind));
+  }
+  return schema;
+}
+
+/* the start of a message: the root offset and the Message table */
+static size_t
+build_message(fbuilder * fb, int header, size_t bodysize)
+{
+  static const int sizes[] = { 2, 1, 4, 8 };
+  size_t message;
+
+  fb->size = 0;
+  fb_alloc(fb, 4, 4);
+  message = fb_table(fb, sizes, 4);
+  fb_offset(fb, 0, message);
+  put16(fb->data+fb_field(fb, message, 0), METADATA_V5);
+  fb->data[fb_field(fb, message, 1)] = (unsigned char)header;
+  put64(fb->data+fb_field(fb, message, 3), bodysize);
+  return message;
+}
+
+typedef struct arrow_file {
+  FILE * out;
+  size_t offset;
+  fbuilder fb;
+  /* the record batches, for the footer: */
+  size_t * blocks; /* offset, metadata size and body size of each */
+  int nblocks, maxblocks;
+} arrow_file;
+
+static void
+write_padded(arrow_file * af, const void * data, size_t size)
+{
+  static const char zero[8] = { 0 };
+  size_t pad = (8 - size % 8) % 8;
+  if (size) fwrite(data, 1, size, af->out);
+  if (pad) fwrite(zero, 1, pad, af->out);
+  af->offset += size + pad;
+}
+
+/* writes the flatbuffer as an encapsulated message, returns its size */
+static size_t
+write_metadata(arrow_file * af)
+{
+  unsigned char prefix[8];
+  size_t size = (af->fb.size + 7) / 8 * 8;
+
+  put32(prefix, 0xFFFFFFFF);
+  put32(prefix+4, (unsigned long)size);
+  write_padded(af, prefix, 8);
+  write_padded(af, af->fb.data, af->fb.size);
+  return size + 8;
+}
+
+static size_t
+pad8(size_t size)
+{
+  return (size + 7) / 8 * 8;
+}
+
+/** one record batch from the columns. each column has a node and its
+ * buffers, a list column also the node and buffers of its items.
+ */
+static void
+write_batch(arrow_file * af, const table * t, int rows)
+{
+  static const int sizes[] = { 8, 4, 4 };
+  fbuilder * fb = &af->fb;
+  size_t message, batch, nodes, buffers, body = 0, metasize;
+  int i, nnodes = 0, nbuffers = 0, node = 0, buffer = 0;
+
+  for (i=0;i!=t->ncolumns;++i) {
+    const column * c = t->columns+i;
+    nnodes += (c->kind==COL_LIST) ? 2 : 1;
+    nbuffers += (c->kind==COL_INT) ? 2 : (c->kind==COL_LIST) ? 5 : 3;
+  }
+  message = build_message(fb, HEADER_RECORDBATCH, 0);
+  batch = fb_table(fb, sizes, 3);
+  fb_offset(fb, fb_field(fb, message, 2), batch);
+  put64(fb->data+fb_field(fb, batch, 0), rows);
+  nodes = fb_vector(fb, nnodes, 16, 8);
+  fb_offset(fb, fb_field(fb, batch, 1), nodes);
+  buffers = fb_vector(fb, nbuffers, 16, 8);
+  fb_offset(fb, fb_field(fb, batch, 2), buffers);
+
+#define ADD_NODE(length, nulls) \
+  put64(fb->data+nodes+4+16*node, (length)); \
+  put64(fb->data+nodes+12+16*node, (nulls)); \
+  ++node
+#define ADD_BUFFER(size) \
+  put64(fb->data+buffers+4+16*buffer, body); \
+  put64(fb->data+buffers+12+16*buffer, (size)); \
+  body += pad8(size); \
+  ++buffer
+
+  for (i=0;i!=t->ncolumns;++i) {
+    const column * c = t->columns+i;
+    ADD_NODE(rows, c->nulls);
+    ADD_BUFFER(c->nulls ? (size_t)(rows+7)/8 : 0);
+    if (c->kind==COL_INT) {
+      ADD_BUFFER(rows*sizeof(int));
+    } else {
+      ADD_BUFFER((rows+1)*sizeof(int));
+      if (c->kind==COL_LIST) {
+        ADD_NODE(c->heapsize/sizeof(int), 0);
+        ADD_BUFFER(0);
+      }
+      ADD_BUFFER(c->heapsize);
+    }
+  }
+#undef ADD_NODE
+#undef ADD_BUFFER
+  put64(fb->data+fb_field(fb, message, 3), body);
+
+  if (af->nblocks==af->maxblocks) {
+    af->maxblocks = af->maxblocks ? af->maxblocks*2 : 16;
+    af->blocks = realloc(af->blocks, 3*af->maxblocks*sizeof(size_t));
+  }
+  af->blocks[3*af->nblocks] = af->offset;
+  metasize = write_metadata(af);
+  af->blocks[3*af->nblocks+1] = metasize;
+  af->blocks[3*af->nblocks+2] = body;
+  ++af->nblocks;
+
+  for (i=0;i!=t->ncolumns;++i) {
+    const column * c = t->columns+i;
+    if (c->nulls) write_padded(af, c->valid, (rows+7)/8);
+    if (c->kind==COL_INT) {
+      write_padded(af, c->values, rows*sizeof(int));
+    } else {
+      write_padded(af, c->values, (rows+1)*sizeof(int));
+      write_padded(af, c->heap, c->heapsize);
+    }
+  }
+}
+
+static void
+write_footer(arrow_file * af, const table * t)
+{
+  static const int sizes[] = { 2, 4, 4, 4 };
+  fbuilder * fb = &af->fb;
+  size_t footer, batches;
+  unsigned char tail[4];
+  int i;
+
+  fb->size = 0;
+  fb_alloc(fb, 4, 4);
+  footer = fb_table(fb, sizes, 4);
+  fb_offset(fb, 0, footer);
+  put16(fb->data+fb_field(fb, footer, 0), METADATA_V5);
+  fb_offset(fb, fb_field(fb, footer, 2), fb_vector(fb, 0, 24, 8));
+  batches = fb_vector(fb, af->nblocks, 24, 8);
+  fb_offset(fb, fb_field(fb, footer, 3), batches);
+  for (i=0;i!=af->nblocks;++i) {
+    unsigned char * p = fb->data+batches+4+24*i;
+    put64(p, af->blocks[3*i]);
+    put32(p+8, (unsigned long)af->blocks[3*i+1]);
+    put64(p+16, af->blocks[3*i+2]);
+  }
+  fb_offset(fb, fb_field(fb, footer, 1), build_schema(fb, t));
+
+  fwrite(fb->data, 1, fb->size, af->out);
+  put32(tail, (unsigned long)fb->size);
+  fwrite(tail, 1, 4, af->out);
+  fwrite("ARROW1", 1, 6, af->out);
+}
+
+static int
+write_table(const char * filename, table * t)
+{
+  static const unsigned char eos[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0 };
+  arrow_file af;
+  const entry ** entries;
+  size_t message;
+  int row, first;
+
+  memset(&af, 0, sizeof(af));
+  af.out = fopen(filename, "wb");
+  if (!af.out) {
+    perror(filename);
+    return -1;
+  }
+  write_padded(&af, "ARROW1", 6);
+
+  message = build_message(&af.fb, HEADER_SCHEMA, 0);
+  fb_offset(&af.fb, fb_field(&af.fb, message, 2), build_schema(&af.fb, t));
+  write_metadata(&af);
+
+  entries = malloc(t->ncolumns*sizeof(entry*));
+  for (first=0;first<t->nblocks;first+=BATCHSIZE) {
+    int rows = min(BATCHSIZE, t->nblocks-first);
+    begin_batch(t);
+    for (row=0;row!=rows;++row) {
+      append_row(t, row, t->blocks[first+row], entries);
+    }
+    write_batch(&af, t, rows);
+  }
+  free(entries);
+
+  fwrite(eos, 1, 8, af.out);
+  write_footer(&af, t);
+  fclose(af.out);
+  free(af.fb.data);
+  free(af.blocks);
+  if (verbose) fprintf(stderr, "wrote %d %s blocks to %s\n", t->nblocks, t->type->name, filename);
+  return 0;
+}
+
+/* the blocks of a type, in the order of the report. crdata keeps them in
+ * a list per type, the newest first.
+ */
+static void
+collect_blocks(table * t)
+{
+  block * b;
+  int i = 0;
+  t->nblocks = 0;
+  for (b=t->type->blocks;b;b=b->nexttype) ++t->nblocks;
+  t->blocks = malloc(t->nblocks*sizeof(block*));
+  for (b=t->type->blocks;b;b=b->nexttype) t->blocks[t->nblocks-1-i++] = b;
+}
+
+static void
+free_table(table * t)
+{
+  int i;
+  for (i=0;i!=t->ncolumns;++i) {
+    column * c = t->columns+i;
+    free(c->name);
+    free(c->valid);
+    free(c->values);
+    free(c->heap);
+  }
+  free(t->columns);
+  free(t->blocks);
+}
+
+/* replaces %s in the pattern with the name of the type, in lowercase */
+static void
+output_name(char * buffer, size_t size, const char * pattern, const char * type)
+{
+  const char * p = strstr(pattern, "%s");
+  char name[64], * c;
+
+  sprintf(name, "%.60s", type);
+  for (c=name;*c;++c) *c = (char)tolower((unsigned char)*c);
+  if (p) snprintf(buffer, size, "%.*s%s%s", (int)(p-pattern), pattern, name, p+2);
+  else snprintf(buffer, size, "%s", pattern);
+}
+
+void
+read_cr(parse_info * parser, const char * filename)
+{
+  FILE * in = fopen(filename, "rt+");
+  if (!in) {
+    perror(filename);
+    return;
+  }
+  if (verbose) fprintf(stderr, "reading %s\n", filename);
+
+  cr_parse(parser, in);
+}
+
+int
+usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [options] [infiles]\n", name);
+  fprintf(stderr, "options:\n"
+    " -h       display this information\n"
+    " -H file  read cr-hierarchy from file\n"
+    " -t type  export blocks of this type (default: REGION, EINHEIT, PARTEI)\n"
+    " -o name  output files, %%s is replaced by the type (default: %%s.arrow)\n"
+    " -V       print version information\n"
+    " -v       verbose\n"
+    "infiles:\n"
+    " one or more cr-files. if none specified, read from stdin\n");
+  return -1;
+}
+
+int
+main(int argc, char ** argv)
+{
+  FILE * f;
+  FILE * hierarchy = NULL;
+  const char * types[MAXTYPES];
+  const char * pattern = "%s.arrow";
+  int i, ntypes = 0, files = 0;
+  crdata * data = NULL;
+  parse_info * parser = (parse_info*)calloc(1, sizeof(parse_info));
+
+  for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
+    switch(argv[i][1]) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'V' :
+        fprintf(stderr, "cr2arrow\nCopyright (C) 2006 Enno Rehling\n\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, and you are welcome to redistribute it\nunder certain conditions; consult the file gpl.txt for details.\n\n");
+        fprintf(stderr, "compiled at %s on %s\n", __TIME__, __DATE__);
+        break;
+      case 'h' :
+        return usage(argv[0]);
+      case 'H':
+        f = fopen(argv[++i], "rt+");
+        if (!f) perror(argv[i]);
+        else if (hierarchy==NULL) {
+          hierarchy = f;
+        };
+        data = crdata_init(hierarchy);
+        break;
+      case 't' :
+        if (ntypes<MAXTYPES) types[ntypes++] = argv[++i];
+        else ++i;
+        break;
+      case 'o' :
+        pattern = argv[++i];
+        break;
+      default :
+        fprintf(stderr, "Ignoring unknown option.");
+        break;
+    }
+  }
+  else {
+    if (!hierarchy) {
+      data = crdata_init(NULL);
+      hierarchy = stdin;
+    }
+    data->parser = parser;
+    parser->iblock = &crdata_iblock;
+    parser->ireport = &crdata_ireport;
+    parser->snapshot = crdata_parse_snapshot;
+    parser->bcontext = (context_t)data;
+    read_cr(parser, argv[i]);
+    ++files;
+  }
+  if (!files) {
+    if (!data) data = crdata_init(NULL);
+    data->parser = parser;
+    parser->iblock = &crdata_iblock;
+    parser->ireport = &crdata_ireport;
+    parser->snapshot = crdata_parse_snapshot;
+    parser->bcontext = (context_t)data;
+    if (verbose) fprintf(stderr, "reading from stdin\n");
+    cr_parse(parser, stdin);
+  }
+  if (ntypes==0) {
+    types[ntypes++] = "REGION";
+    types[ntypes++] = "EINHEIT";
+    types[ntypes++] = "PARTEI";
+  }
+  utf8 = crdata_utf8(data);
+  if (ntypes>1 && !strstr(pattern, "%s")) {
+    fprintf(stderr, "the output name needs a %%s for more than one type\n");
+    return -1;
+  }
+
+  for (i=0;i!=ntypes;++i) {
+    char filename[1024];
+    table t;
+    memset(&t, 0, sizeof(t));
+    t.type = find_type(types[i], data->blocktypes);
+    if (t.type==NULL) {
+      fprintf(stderr, "unknown block type %s\n", types[i]);
+      continue;
+    }
+    collect_blocks(&t);
+    make_columns(&t);
+    output_name(filename, sizeof(filename), pattern, types[i]);
+    write_table(filename, &t);
+    free_table(&t);
+  }
+  return 0;
+}
@@ -22,12 +22,17 @@
 #include "crparse.h"
 #include "hierarchy.h"
 #include "conversion.h"
+#include "outbuf.h"
+#include "islands.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 void
 read_cr(parse_info * parser, const char * filename)
@@ -52,6 +57,10 @@ usage(const char * name)
     " -V       print version information\n"
     " -v       verbose\n"
     " -o file  write output to file (default is stdout)\n"
+    " -d dir   write an index and a page for each plane to dir\n"
+    " -i gap   with -d, a page for each island, of regions no more than gap apart\n"
+    " -n count with -d, no more than count regions on a page (default 500)\n"
+    " -j n     with -d, write pages with n threads (default: one per cpu)\n"
     "infiles:\n"
     " one or more cr-files. if none specified, read from stdin\n");
   return -1;
@@ -88,7 +97,7 @@ htmlstring(const char * s) {
     { '', "a" },
     { 0, NULL },
   };
-  buffer_type buffer[MAXBUF];
+  static buffer_type buffer[MAXBUF];
   static int b = 0;
   int i;
   char * d, *p;
@@ -109,184 +118,858 @@ htmlstring(const char * s) {
   return d;
 }
 
-void
-html_write(crdata * data, FILE * out)
+typedef struct id_index {
+  int id;
+  int pos;
+} id_index;
+
+/** the children of one type of a block, in the order of the report.
+ * list_index sorts their ids, so that blocks can be found by id
+ * without searching the report.
+ */
+typedef struct block_list {
+  block ** blocks;
+  id_index * index;
+  int size, maxsize;
+} block_list;
+
+static void
+list_add(block_list * list, block * b)
+{
+  if (list->size==list->maxsize) {
+    list->maxsize = list->maxsize?list->maxsize*2:64;
+    list->blocks = (block**)realloc(list->blocks, list->maxsize*sizeof(block*));
+    list->index = (id_index*)realloc(list->index, list->maxsize*sizeof(id_index));
+  }
+  list->blocks[list->size++] = b;
+}
+
+static int
+cmp_index(const void * a, const void * b)
+{
+  const id_index * ia = (const id_index *)a;
+  const id_index * ib = (const id_index *)b;
+  if (ia->id!=ib->id) return (ia->id<ib->id)?-1:1;
+  return ia->pos - ib->pos;
+}
+
+static void
+list_index(block_list * list)
+{
+  int i;
+  for (i=0;i!=list->size;++i) {
+    block * b = list->blocks[i];
+    list->index[i].id = b->size?b->ids[0]:0;
+    list->index[i].pos = i;
+  }
+  qsort(list->index, list->size, sizeof(id_index), cmp_index);
+}
+
+/* the position of the first block with this id in the list, or -1 */
+static int
+list_find(const block_list * list, int id)
 {
-  const report_interface * blocks = data->parser->ireport;
+  int l = 0, h = list->size;
+  while (l<h) {
+    int m = (l+h)/2;
+    if (list->index[m].id<id) l = m+1;
+    else h = m;
+  }
+  if (l<list->size && list->index[l].id==id) return list->index[l].pos;
+  return -1;
+}
+
+static const blocktype *
+child_type(const blocktype * parent, const char * name)
+{
+  const blocktype * btype;
+  for (btype=parent->children;btype;btype=btype->next) {
+    if (!stricmp(name, btype->name)) break;
+  }
+  return btype;
+}
+
+/** everything html_write needs while it walks the report once.
+ * the child types are looked up for the type of the last parent,
+ * and the lists are reused from one region to the next. with -d,
+ * each thread writing pages has a context of its own, and they
+ * share the list of factions.
+ */
+typedef struct html_context {
+  crdata * data;
+  outbuf * ob;
+  const block_list * factions;
+  const blocktype * rtype, * unit, * building, * ship, * rmessage;
+  const blocktype * utype, * commands, * skills, * items;
+  block_list units, buildings, ships, messages;
+} html_context;
+
+static void
+html_puts(outbuf * ob, const char * s)
+{
+  if (s) ob_puts(ob, s);
+}
+
+/* a unit id in base 36, like itoa36, but without its static buffer */
+static void
+html_id36(outbuf * ob, int i)
+{
+  char buffer[16];
+  char * cp = buffer+sizeof(buffer);
+  unsigned int u = (i<0)?0U-(unsigned int)i:(unsigned int)i;
+  do {
+    int x = (int)(u % 36);
+    if (x<10) *--cp = (char)('0' + x);
+    else if ('a' + x - 10 == 'l') *--cp = 'L';
+    else *--cp = (char)('a' + x - 10);
+    u /= 36;
+  } while (u);
+  if (i<0) *--cp = '-';
+  ob_write(ob, cp, buffer+sizeof(buffer)-cp);
+}
+
+static void
+html_messages(html_context * ctx, const block_list * messages)
+{
+  const block_interface * tags = ctx->data->parser->iblock;
+  outbuf * ob = ctx->ob;
+  int i;
+
+  if (messages->size==0) return;
+  ob_puts(ob, "<h3>Meldungen</h3>\n<ul>\n");
+  for (i=0;i!=messages->size;++i) {
+    const char * msg = NULL;
+    tags->get_string(ctx->data, messages->blocks[i], "rendered", &msg);
+    if (msg) {
+      ob_puts(ob, "<li>");
+      ob_puts(ob, msg);
+      ob_putc(ob, '\n');
+    }
+  }
+  ob_puts(ob, "</ul>\n");
+}
+
+static void
+html_faction(html_context * ctx, block * f)
+{
+  crdata * data = ctx->data;
   const block_interface * tags = data->parser->iblock;
-  const char * game = NULL;
-  block * r = (block*) blocks->find(data, data->blocks, "REGION", NULL, 0);
-  block * f = (block*) blocks->find(data, data->blocks, "PARTEI", NULL, 0);
-  block * v = (block*) blocks->find(data, data->blocks, "VERSION", NULL, 0);
-  fputs("<html>\n", out);
-  tags->get_string(data, v, "spiel", &game);
-  fprintf(out, "<div align=center><h1>%s Report Nr. %d</h1></div>\n", game, v->turn);
-
-  while (f) {
-    const char * passwd = NULL;
+  outbuf * ob = ctx->ob;
+  const blocktype * message = child_type(f->type, "MESSAGE");
+  const char * passwd = NULL;
+  block * m;
+
+  if (!tags->get_string(data, f, "passwort", &passwd)) {
     const char * name = NULL;
-    int score, average;
-    block * m = (block*) blocks->find(data, f, "MESSAGE", NULL, 0);
-    if (!tags->get_string(data, f, "passwort", &passwd)) {
-      tags->get_string(data, f, "parteiname", &name);
-      tags->get_int(data, f, "punkte", &score);
-      tags->get_int(data, f, "punktedurchschnitt", &average);
-      fprintf(out, "<h2>%s (%d)</h2>\n", name, f->ids[0]);
-      fputs("<ul>\n", out);
-      fprintf(out, "<li>Punkte: %d/%d\n", score, average);
-      tags->get_string(data, f, "typ", &name);
-      fprintf(out, "<li>Rasse: %s\n", name);
-      tags->get_string(data, f, "magiegebiet", &name);
-      fprintf(out, "<li>Magie: %s\n", name);
-      fputs("</ul>\n", out);
+    int score = 0, average = 0;
+    tags->get_string(data, f, "parteiname", &name);
+    tags->get_int(data, f, "punkte", &score);
+    tags->get_int(data, f, "punktedurchschnitt", &average);
+    ob_puts(ob, "<h2>");
+    html_puts(ob, name);
+    ob_puts(ob, " (");
+    ob_int(ob, f->ids[0]);
+    ob_puts(ob, ")</h2>\n<ul>\n<li>Punkte: ");
+    ob_int(ob, score);
+    ob_putc(ob, '/');
+    ob_int(ob, average);
+    ob_puts(ob, "\n<li>Rasse: ");
+    name = NULL;
+    tags->get_string(data, f, "typ", &name);
+    html_puts(ob, name);
+    ob_puts(ob, "\n<li>Magie: ");
+    name = NULL;
+    tags->get_string(data, f, "magiegebiet", &name);
+    html_puts(ob, name);
+    ob_puts(ob, "\n</ul>\n");
+  }
+  ctx->messages.size = 0;
+  for (m=f->children;m;m=m->next) {
+    if (m->type==message) list_add(&ctx->messages, m);
+  }
+  html_messages(ctx, &ctx->messages);
+}
+
+static void
+html_unit(html_context * ctx, block * u)
+{
+  crdata * data = ctx->data;
+  const block_interface * tags = data->parser->iblock;
+  outbuf * ob = ctx->ob;
+  block * c, * commands = NULL, * skills = NULL, * items = NULL;
+  const char * name = NULL, * race = NULL;
+  int number = 0, faction, money;
+
+  if (u->type!=ctx->utype) {
+    ctx->utype = u->type;
+    ctx->commands = child_type(u->type, "COMMANDS");
+    ctx->skills = child_type(u->type, "TALENTE");
+    ctx->items = child_type(u->type, "GEGENSTAENDE");
+  }
+  for (c=u->children;c;c=c->next) {
+    if (c->type==ctx->commands && !commands) commands = c;
+    else if (c->type==ctx->skills && !skills) skills = c;
+    else if (c->type==ctx->items && !items) items = c;
+  }
+
+  if (!commands) ob_puts(ob, "<em>\n");
+  tags->get_string(data, u, "name", &name);
+  if (tags->get_string(data, u, "wahrertyp", &race))
+    tags->get_string(data, u, "typ", &race);
+  tags->get_int(data, u, "anzahl", &number);
+  ob_puts(ob, "<li>");
+  html_puts(ob, name);
+  ob_puts(ob, " (");
+  html_id36(ob, u->ids[0]);
+  ob_puts(ob, "), ");
+  ob_int(ob, number);
+  ob_putc(ob, ' ');
+  html_puts(ob, race);
+  if (!tags->get_int(data, u, "partei", &faction)) {
+    int pos = list_find(ctx->factions, faction);
+    if (pos>=0) {
+      block * f = ctx->factions->blocks[pos];
+      const char * fname;
+      if (tags->get_string(data, f, "parteiname", &fname)) fname = "Unbekannt";
+      ob_puts(ob, ", ");
+      ob_puts(ob, fname);
+      ob_puts(ob, " (");
+      ob_int(ob, f->ids[0]);
+      ob_putc(ob, ')');
     }
-    if (m) {
-      fputs("<h3>Meldungen</h3>\n<ul>\n", out);
-      while (m) {
-        const char * msg;
-        tags->get_string(data, m, "rendered", &msg);
-        if (msg) fprintf(out, "<li>%s\n", msg);
-        do {
-          m = m->next;
-        } while (m && stricmp("MESSAGE", m->type->name)); /* TODO: slow */
-      }
-      fputs("</ul>\n", out);
+  }
+  if (!tags->get_int(data, u, "silber", &money)) {
+    ob_puts(ob, ", ");
+    ob_int(ob, money);
+    ob_puts(ob, " Silber");
+  }
+  if (skills) {
+    entry * e = skills->entries;
+    if (e) ob_puts(ob, ", Talente: ");
+    while (e) {
+      ob_puts(ob, e->tag->name);
+      ob_putc(ob, ' ');
+      ob_int(ob, e->data.ip[2]);
+      ob_puts(ob, " [");
+      ob_int(ob, number?e->data.ip[1]/number:0);
+      ob_putc(ob, ']');
+      e = e->next;
+      if (e) ob_puts(ob, ", ");
     }
-    do {
-      f = f->next;
-    } while (f && stricmp("PARTEI", f->type->name)); /* TODO: slow */
-  }
-  fputs("</dl>\n", out);
-  fputs("<hr>\n", out);
-  while (r) {
-    int indent = 0;
-    int laen = 0, trees = 0, peasants = 0, iron = 0, horses = 0;
-    block * u = (block*) blocks->find(data, r, "EINHEIT", NULL, 0);
-    block * b = (block*) blocks->find(data, r, "BURG", NULL, 0);
-    block * s = (block*) blocks->find(data, r, "SCHIFF", NULL, 0);
-    block * m = (block*) blocks->find(data, r, "MESSAGE", NULL, 0);
-    const char * name = NULL;
-    const char * terrain = NULL;
-    tags->get_string(data, r, "terrain", &terrain);
-    if (tags->get_string(data, r, "name", &name))
-      name = terrain;
-    fprintf(out, "<h2>%s (%d,%d), %s</h2>\n",
-      name, r->ids[0], r->ids[1], terrain);
-    fputs("<p>", out);
-    if (!tags->get_int(data, r, "baeume", &trees) && trees) fprintf(out, "%d Bume, ", trees);
-    if (!tags->get_int(data, r, "laen", &laen)) fprintf(out, "%d Laen, ", laen);
-    if (!tags->get_int(data, r, "pferde", &horses) && horses) fprintf(out, "%d Pferde, ", horses);
-    if (!tags->get_int(data, r, "eisen", &iron) && iron) fprintf(out, "%d Eisen, ", iron);
-    if (!tags->get_int(data, r, "bauern", &peasants)) fprintf(out, "%d Bauern.", peasants);
-    if (m) {
-      fputs("<h3>Meldungen</h3>\n<ul>\n", out);
-      while (m) {
-        const char * msg = NULL;
-        tags->get_string(data, m, "rendered", &msg);
-        if (msg) fprintf(out, "<li>%s\n", msg);
-        do {
-          m = m->next;
-        } while (m && stricmp("MESSAGE", m->type->name)); /* TODO: slow */
-      }
-      fputs("</ul>\n", out);
+  }
+  if (items) {
+    entry * e = items->entries;
+    if (e) ob_puts(ob, ", hat: ");
+    while (e) {
+      ob_int(ob, e->data.i);
+      ob_putc(ob, ' ');
+      ob_puts(ob, e->tag->name);
+      e = e->next;
+      if (e) ob_puts(ob, ", ");
     }
-    if (u) {
-      fputs("<ul>\n", out);
-      while (u) {
-        block * t;
-        block * c = blocks->find(data, u, "COMMANDS", NULL, 0);
-        const char * name = 0, * race = 0, * type = 0;
-        int number, faction, money;
+  }
+  ob_putc(ob, '\n');
+  if (!commands) ob_puts(ob, "</em>\n");
+}
+
+/* the units of a region, in the order of the report. a unit that is in
+ * the next building or ship of the region opens a list for it, which the
+ * units after it stay in until one is in neither. */
+static void
+html_units(html_context * ctx)
+{
+  crdata * data = ctx->data;
+  const block_interface * tags = data->parser->iblock;
+  outbuf * ob = ctx->ob;
+  int i, nb = 0, ns = 0, indent = 0;
+
+  for (i=0;i!=ctx->units.size;++i) {
+    block * u = ctx->units.blocks[i];
+    const char * name = NULL, * type = NULL;
+    int building = 0, ship = 0;
+    if (!tags->get_int(data, u, "burg", &building) && nb!=ctx->buildings.size) {
+      block * b = ctx->buildings.blocks[nb];
+      if (b->ids[0]==building) {
         int size = 0;
-        int ship = 0, building = 0;
-        if (!tags->get_int(data, u, "burg", &building) && b) {
-          if (b->ids[0]==building) {
-            if (indent) fputs("</ul>\n", out);
-            else indent = 1;
-            tags->get_string(data, b, "name", &name);
-            tags->get_string(data, b, "typ", &type);
-            tags->get_int(data, b, "groesse", &size);
-            fprintf(out, "<li>%s (%d), %s, Gre %d\n", name, building, type, size);
-            fputs("<ul>\n", out);
-            do {
-              b = b->next;
-            } while (b && stricmp("BURG", b->type->name)); /* TODO: slow */
-          }
-        }
-        if (!tags->get_int(data, u, "schiff", &ship) && s) {
-          if (s->ids[0]==ship) {
-            if (indent) fputs("</ul>\n", out);
-            else indent = 1;
-            tags->get_string(data, s, "name", &name);
-            tags->get_string(data, s, "typ", &type);
-            fprintf(out, "<li>%s (%d), %s\n", name, ship, type);
-            fputs("<ul>\n", out);
-            do {
-              s = s->next;
-            } while (s && stricmp("SCHIFF", s->type->name)); /* TODO: slow */
-          }
-        }
-        if (indent && !building && !ship) {
-          fputs("</ul>\n", out);
-          indent = 0;
-        }
-        if (!c) fputs("<em>\n", out);
-        tags->get_string(data, u, "name", &name);
-        if (tags->get_string(data, u, "wahrertyp", &race))
-          tags->get_string(data, u, "typ", &race);
-        tags->get_int(data, u, "anzahl", &number);
-        fprintf(out, "<li>%s (%s), %d %s",
-            name,
-            itoa36(u->ids[0]),
-            number,
-            race);
-        if (!tags->get_int(data, u, "partei", &faction)) {
-          block * f = blocks->find(data, data->blocks, "PARTEI", &faction, 1);
-          if (f) {
-            const char * name;
-            if (tags->get_string(data, f, "parteiname", &name)) name = "Unbekannt";
-            fprintf(out, ", %s (%d)",
-                name,
-                f->ids[0]);
-          }
-        }
-        if (!tags->get_int(data, u, "silber", &money)) {
-          fprintf(out, ", %d Silber", money);
-        }
-        t = blocks->find(data, u, "TALENTE", NULL, 0);
-        if (t) {
-          entry * e = t->entries;
-          if (e) fputs(", Talente: ", out);
-          while (e) {
-            fprintf(out, "%s %d [%d]", e->tag->name, e->data.ip[2], e->data.ip[1]/number);
-            e = e->next;
-            if (e) fputs(", ", out);
-          }
-        }
-        t = blocks->find(data, u, "GEGENSTAENDE", NULL, 0);
-        if (t) {
-          entry * e = t->entries;
-          if (e) fputs(", hat: ", out);
-          while (e) {
-            fprintf(out, "%d %s", e->data.i, e->tag->name);
-            e = e->next;
-            if (e) fputs(", ", out);
-          }
-        }
-        fputc('\n', out);
-        if (!c) fputs("</em>\n", out);
-        do {
-          u = u->next;
-        } while (u && stricmp("EINHEIT", u->type->name)); /* TODO: slow */
+        if (indent) ob_puts(ob, "</ul>\n");
+        else indent = 1;
+        tags->get_string(data, b, "name", &name);
+        tags->get_string(data, b, "typ", &type);
+        tags->get_int(data, b, "groesse", &size);
+        ob_puts(ob, "<li>");
+        html_puts(ob, name);
+        ob_puts(ob, " (");
+        ob_int(ob, building);
+        ob_puts(ob, "), ");
+        html_puts(ob, type);
+        ob_puts(ob, ", Gre ");
+        ob_int(ob, size);
+        ob_puts(ob, "\n<ul>\n");
+        ++nb;
+      }
+    }
+    if (!tags->get_int(data, u, "schiff", &ship) && ns!=ctx->ships.size) {
+      block * s = ctx->ships.blocks[ns];
+      if (s->ids[0]==ship) {
+        if (indent) ob_puts(ob, "</ul>\n");
+        else indent = 1;
+        tags->get_string(data, s, "name", &name);
+        tags->get_string(data, s, "typ", &type);
+        ob_puts(ob, "<li>");
+        html_puts(ob, name);
+        ob_puts(ob, " (");
+        ob_int(ob, ship);
+        ob_puts(ob, "), ");
+        html_puts(ob, type);
+        ob_puts(ob, "\n<ul>\n");
+        ++ns;
       }
-      if (indent) fputs("</ul>\n", out);
-      fputs("</ul>\n", out);
     }
-    do {
-      r = r->next;
-    } while (r && stricmp("REGION", r->type->name)); /* TODO: slow */
+    if (indent && !building && !ship) {
+      ob_puts(ob, "</ul>\n");
+      indent = 0;
+    }
+    html_unit(ctx, u);
+  }
+  if (indent) ob_puts(ob, "</ul>\n");
+}
+
+static void
+html_region(html_context * ctx, block * r)
+{
+  crdata * data = ctx->data;
+  const block_interface * tags = data->parser->iblock;
+  outbuf * ob = ctx->ob;
+  int laen = 0, trees = 0, peasants = 0, iron = 0, horses = 0;
+  const char * name = NULL;
+  const char * terrain = NULL;
+  block * c;
+
+  if (r->type!=ctx->rtype) {
+    ctx->rtype = r->type;
+    ctx->unit = child_type(r->type, "EINHEIT");
+    ctx->building = child_type(r->type, "BURG");
+    ctx->ship = child_type(r->type, "SCHIFF");
+    ctx->rmessage = child_type(r->type, "MESSAGE");
+  }
+  ctx->units.size = ctx->buildings.size = ctx->ships.size = ctx->messages.size = 0;
+  for (c=r->children;c;c=c->next) {
+    if (c->type==ctx->unit) list_add(&ctx->units, c);
+    else if (c->type==ctx->building) list_add(&ctx->buildings, c);
+    else if (c->type==ctx->ship) list_add(&ctx->ships, c);
+    else if (c->type==ctx->rmessage) list_add(&ctx->messages, c);
+  }
+
+  tags->get_string(data, r, "terrain", &terrain);
+  if (tags->get_string(data, r, "name", &name))
+    name = terrain;
+  ob_puts(ob, "<h2>");
+  html_puts(ob, name);
+  ob_puts(ob, " (");
+  ob_int(ob, r->ids[0]);
+  ob_putc(ob, ',');
+  ob_int(ob, r->size>1?r->ids[1]:0);
+  ob_puts(ob, "), ");
+  html_puts(ob, terrain);
+  ob_puts(ob, "</h2>\n<p>");
+  if (!tags->get_int(data, r, "baeume", &trees) && trees) {
+    ob_int(ob, trees);
+    ob_puts(ob, " Bume, ");
+  }
+  if (!tags->get_int(data, r, "laen", &laen)) {
+    ob_int(ob, laen);
+    ob_puts(ob, " Laen, ");
+  }
+  if (!tags->get_int(data, r, "pferde", &horses) && horses) {
+    ob_int(ob, horses);
+    ob_puts(ob, " Pferde, ");
+  }
+  if (!tags->get_int(data, r, "eisen", &iron) && iron) {
+    ob_int(ob, iron);
+    ob_puts(ob, " Eisen, ");
+  }
+  if (!tags->get_int(data, r, "bauern", &peasants)) {
+    ob_int(ob, peasants);
+    ob_puts(ob, " Bauern.");
+  }
+  html_messages(ctx, &ctx->messages);
+  if (ctx->units.size) {
+    ob_puts(ob, "<ul>\n");
+    html_units(ctx);
+    ob_puts(ob, "</ul>\n");
+  }
+}
+
+static void
+list_free(block_list * list)
+{
+  free(list->blocks);
+  free(list->index);
+}
+
+static void
+context_init(html_context * ctx, crdata * data, const block_list * factions)
+{
+  memset(ctx, 0, sizeof(html_context));
+  ctx->data = data;
+  ctx->factions = factions;
+}
+
+static void
+context_free(html_context * ctx)
+{
+  list_free(&ctx->units);
+  list_free(&ctx->buildings);
+  list_free(&ctx->ships);
+  list_free(&ctx->messages);
+}
+
+static void
+find_factions(crdata * data, block_list * factions)
+{
+  block * v = data->blocks;
+  const blocktype * faction = child_type(v->type, "PARTEI");
+  block * b;
+  for (b=v->children;b;b=b->next) {
+    if (b->type==faction) list_add(factions, b);
+  }
+  list_index(factions);
+}
+
+/* the title of the report and its factions */
+static void
+html_head(html_context * ctx)
+{
+  crdata * data = ctx->data;
+  const block_interface * tags = data->parser->iblock;
+  const char * game = NULL;
+  int i;
+
+  ob_puts(ctx->ob, "<html>\n");
+  tags->get_string(data, data->blocks, "spiel", &game);
+  ob_puts(ctx->ob, "<div align=center><h1>");
+  html_puts(ctx->ob, game);
+  ob_puts(ctx->ob, " Report Nr. ");
+  ob_int(ctx->ob, data->blocks->turn);
+  ob_puts(ctx->ob, "</h1></div>\n");
+  for (i=0;i!=ctx->factions->size;++i) {
+    html_faction(ctx, ctx->factions->blocks[i]);
+  }
+  ob_puts(ctx->ob, "</dl>\n");
+  ob_puts(ctx->ob, "<hr>\n");
+}
+
+/** writes the report in one pass over the children of each block.
+ * factions are found by id through a sorted index.
+ */
+void
+html_write(crdata * data, FILE * out)
+{
+  block * v = data->blocks;
+  const blocktype * region = child_type(v->type, "REGION");
+  block_list factions;
+  html_context ctx;
+  block * b;
+
+  memset(&factions, 0, sizeof(factions));
+  find_factions(data, &factions);
+  context_init(&ctx, data, &factions);
+  ctx.ob = ob_create(out);
+
+  html_head(&ctx);
+  for (b=v->children;b;b=b->next) {
+    if (b->type==region) html_region(&ctx, b);
+  }
+  ob_puts(ctx.ob, "</html>\n");
+  ob_destroy(ctx.ob);
+
+  context_free(&ctx);
+  list_free(&factions);
+}
+
+/* 64-bit FNV-1a, for recognizing pages we have written before */
+typedef unsigned long long digest;
+
+#define DIGEST_INIT 14695981039346656037ULL
+
+static digest
+digest_bytes(digest h, const void * data, size_t size)
+{
+  const unsigned char * p = (const unsigned char *)data;
+  while (size--) {
+    h ^= *p++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/** with -d, the report is written as an index and a page for each
+ * island (-i), or for each plane, split into pages of no more than
+ * maxregions regions. the digest of every page is kept in pages.idx,
+ * and a page is only written again if it has changed.
+ */
+typedef struct html_page {
+  char name[64];
+  char title[64];
+  int plane;
+  int first, size; /* the regions of the page in page_regions */
+  int x1, y1, x2, y2;
+  digest hash;
+} html_page;
+
+typedef struct page_region {
+  block * r;
+  int plane, island;
+  int pos; /* in the report */
+} page_region;
+
+typedef struct old_page {
+  char name[64];
+  digest hash;
+  int seen;
+} old_page;
+
+static int maxregions = 500;
+static int gap = -1;
+static int threads = 1; /* number of threads writing pages */
+
+static struct {
+  crdata * data;
+  const block_list * factions;
+  const char * dir;
+  page_region * regions;
+  html_page * pages;
+  int npages;
+  old_page * old;
+  int nold;
+  int next, written;
+  pthread_mutex_t lock;
+} split;
+
+static int
+cmp_region(const void * a, const void * b)
+{
+  const page_region * ra = (const page_region *)a;
+  const page_region * rb = (const page_region *)b;
+  if (ra->plane!=rb->plane) return (ra->plane<rb->plane)?-1:1;
+  if (ra->island!=rb->island) return (ra->island<rb->island)?-1:1;
+  return ra->pos - rb->pos;
+}
+
+static int
+cmp_old(const void * a, const void * b)
+{
+  return strcmp(((const old_page *)a)->name, ((const old_page *)b)->name);
+}
+
+/* sort the regions by plane and island, and cut them into pages */
+static void
+make_pages(crdata * data)
+{
+  block * v = data->blocks;
+  const blocktype * region = child_type(v->type, "REGION");
+  page_region * pr;
+  block * r;
+  int n = 0, i, start, island = 0, chunk = 0;
+
+  for (r=v->children;r;r=r->next) if (r->type==region) ++n;
+  pr = split.regions = (page_region*)malloc((n+1)*sizeof(page_region));
+  for (r=v->children,i=0;r;r=r->next) if (r->type==region) {
+    pr[i].r = r;
+    pr[i].plane = r->size>2?r->ids[2]:0;
+    pr[i].island = 0;
+    pr[i].pos = i;
+    ++i;
+  }
+  qsort(pr, n, sizeof(page_region), cmp_region);
+  if (gap>=0) {
+    int * xs = (int*)malloc((n+1)*sizeof(int));
+    int * ys = (int*)malloc((n+1)*sizeof(int));
+    int * is = (int*)malloc((n+1)*sizeof(int));
+    for (i=0;i!=n;++i) {
+      xs[i] = pr[i].r->ids[0];
+      ys[i] = pr[i].r->size>1?pr[i].r->ids[1]:0;
+    }
+    for (start=0;start!=n;start=i) {
+      for (i=start;i!=n && pr[i].plane==pr[start].plane;++i);
+      find_islands(xs+start, ys+start, i-start, gap, is+start);
+    }
+    for (i=0;i!=n;++i) pr[i].island = is[i];
+    free(xs);
+    free(ys);
+    free(is);
+    qsort(pr, n, sizeof(page_region), cmp_region);
   }
-  fputs("</html>\n", out);
+
+  split.pages = (html_page*)calloc(n+1, sizeof(html_page));
+  split.npages = 0;
+  for (i=0;i!=n;++i) {
+    html_page * page = split.npages?split.pages+split.npages-1:NULL;
+    int x = pr[i].r->ids[0], y = pr[i].r->size>1?pr[i].r->ids[1]:0;
+    if (i==0 || pr[i].plane!=pr[i-1].plane || pr[i].island!=pr[i-1].island) {
+      island = pr[i].island;
+      chunk = 0;
+    }
+    else if (page->size==maxregions) ++chunk;
+    else {
+      ++page->size;
+      if (x<page->x1) page->x1 = x;
+      if (x>page->x2) page->x2 = x;
+      if (y<page->y1) page->y1 = y;
+      if (y>page->y2) page->y2 = y;
+      continue;
+    }
+    page = split.pages+split.npages++;
+    page->plane = pr[i].plane;
+    page->first = i;
+    page->size = 1;
+    page->x1 = page->x2 = x;
+    page->y1 = page->y2 = y;
+    if (gap>=0) {
+      sprintf(page->name, "%d_%d", pr[i].plane, island);
+      sprintf(page->title, "Insel %d", island);
+    } else {
+      sprintf(page->name, "%d", pr[i].plane);
+      sprintf(page->title, "Ebene %d", pr[i].plane);
+    }
+    if (chunk) {
+      sprintf(page->name+strlen(page->name), "-%d", chunk);
+      sprintf(page->title+strlen(page->title), " (%d)", chunk+1);
+    }
+    strcat(page->name, ".html");
+  }
+}
+
+static void
+read_pages(void)
+{
+  char buffer[1024], name[64];
+  digest hash;
+  int size = 0;
+  FILE * F;
+
+  sprintf(buffer, "%s/pages.idx", split.dir);
+  F = fopen(buffer, "r");
+  if (F==NULL) return;
+  while (fscanf(F, "%llx %63s", &hash, name)==2) {
+    if (split.nold==size) {
+      size = size?size*2:256;
+      split.old = (old_page*)realloc(split.old, size*sizeof(old_page));
+    }
+    strcpy(split.old[split.nold].name, name);
+    split.old[split.nold].hash = hash;
+    split.old[split.nold].seen = 0;
+    ++split.nold;
+  }
+  fclose(F);
+  qsort(split.old, split.nold, sizeof(old_page), cmp_old);
+}
+
+/* write the digests of this run, and remove pages that are gone */
+static void
+write_pages(void)
+{
+  char buffer[1024];
+  FILE * F;
+  int i;
+
+  sprintf(buffer, "%s/pages.idx", split.dir);
+  F = fopen(buffer, "w");
+  if (F==NULL) {
+    perror(buffer);
+    return;
+  }
+  for (i=0;i!=split.npages;++i) {
+    fprintf(F, "%llx %s\n", split.pages[i].hash, split.pages[i].name);
+  }
+  fclose(F);
+  for (i=0;i!=split.nold;++i) if (!split.old[i].seen) {
+    sprintf(buffer, "%s/%s", split.dir, split.old[i].name);
+    remove(buffer);
+  }
+}
+
+static void
+page_link(outbuf * ob, const html_page * page)
+{
+  ob_puts(ob, "<a href=\"");
+  ob_puts(ob, page->name);
+  ob_puts(ob, "\">");
+  ob_puts(ob, page->title);
+  ob_puts(ob, "</a>");
+}
+
+static void
+page_navigation(outbuf * ob, int p)
+{
+  ob_puts(ob, "<p><a href=\"index.html\">bersicht</a>");
+  if (p>0) {
+    ob_puts(ob, " | ");
+    page_link(ob, split.pages+p-1);
+  }
+  if (p+1<split.npages) {
+    ob_puts(ob, " | ");
+    page_link(ob, split.pages+p+1);
+  }
+  ob_puts(ob, "\n");
+}
+
+/* the page is made in memory, and only written if its digest changed */
+static void
+write_page(html_context * ctx, int p)
+{
+  html_page * page = split.pages+p;
+  const block_interface * tags = ctx->data->parser->iblock;
+  const char * game = NULL;
+  old_page key, * old;
+  char buffer[1024];
+  char * text = NULL;
+  size_t size = 0;
+  FILE * F = open_memstream(&text, &size);
+  int i, changed;
+
+  ctx->ob = ob_create(F);
+  tags->get_string(ctx->data, ctx->data->blocks, "spiel", &game);
+  ob_puts(ctx->ob, "<html>\n<div align=center><h1>");
+  html_puts(ctx->ob, game);
+  ob_puts(ctx->ob, ", ");
+  ob_puts(ctx->ob, page->title);
+  ob_puts(ctx->ob, "</h1></div>\n");
+  page_navigation(ctx->ob, p);
+  ob_puts(ctx->ob, "<hr>\n");
+  for (i=0;i!=page->size;++i) {
+    html_region(ctx, split.regions[page->first+i].r);
+  }
+  ob_puts(ctx->ob, "<hr>\n");
+  page_navigation(ctx->ob, p);
+  ob_puts(ctx->ob, "</html>\n");
+  ob_destroy(ctx->ob);
+  fclose(F);
+
+  page->hash = digest_bytes(DIGEST_INIT, text, size);
+  strcpy(key.name, page->name);
+  old = (old_page*)bsearch(&key, split.old, split.nold, sizeof(old_page), cmp_old);
+  sprintf(buffer, "%s/%s", split.dir, page->name);
+  changed = old==NULL || old->hash!=page->hash;
+  if (old) old->seen = 1;
+  if (!changed) {
+    F = fopen(buffer, "rb");
+    if (F) fclose(F);
+    else changed = 1;
+  }
+  if (changed) {
+    F = fopen(buffer, "wb");
+    if (F==NULL) perror(buffer);
+    else {
+      fwrite(text, 1, size, F);
+      fclose(F);
+      pthread_mutex_lock(&split.lock);
+      ++split.written;
+      pthread_mutex_unlock(&split.lock);
+    }
+  }
+  free(text);
+}
+
+/* each thread takes the next page that nobody is writing yet */
+static void *
+page_worker(void * arg)
+{
+  html_context ctx;
+  context_init(&ctx, split.data, split.factions);
+  for (;;) {
+    int p;
+    pthread_mutex_lock(&split.lock);
+    p = split.next++;
+    pthread_mutex_unlock(&split.lock);
+    if (p>=split.npages) break;
+    write_page(&ctx, p);
+  }
+  context_free(&ctx);
+  return arg;
+}
+
+/* the entries html_write reads. crdata adds a property the first time
+ * it is asked for it, so this happens before the threads start, and
+ * they only read from the report.
+ */
+static const char * html_tags[] = {
+  "spiel", "passwort", "parteiname", "punkte", "punktedurchschnitt",
+  "typ", "magiegebiet", "rendered", "name", "wahrertyp", "anzahl",
+  "partei", "silber", "burg", "schiff", "groesse", "terrain", "baeume",
+  "laen", "pferde", "eisen", "bauern", NULL
+};
+
+void
+html_split(crdata * data, const char * dir)
+{
+  const block_interface * tags = data->parser->iblock;
+  block_list factions;
+  html_context ctx;
+  pthread_t * workers;
+  char buffer[1024];
+  FILE * F;
+  int i, k;
+
+  memset(&factions, 0, sizeof(factions));
+  find_factions(data, &factions);
+  for (i=0;html_tags[i];++i) tags->get_int(data, data->blocks, html_tags[i], &k);
+
+  split.data = data;
+  split.factions = &factions;
+  split.dir = dir;
+  mkdir(dir, 0777);
+  read_pages();
+  make_pages(data);
+
+  pthread_mutex_init(&split.lock, NULL);
+  if (threads<1) threads = 1;
+  workers = (pthread_t*)malloc(threads*sizeof(pthread_t));
+  for (i=0;i!=threads;++i) pthread_create(&workers[i], NULL, page_worker, NULL);
+
+  /* the index changes with every turn, it is always written */
+  sprintf(buffer, "%s/index.html", dir);
+  F = fopen(buffer, "wt");
+  if (F==NULL) perror(buffer);
+  else {
+    context_init(&ctx, data, &factions);
+    ctx.ob = ob_create(F);
+    html_head(&ctx);
+    ob_puts(ctx.ob, "<ul>\n");
+    for (i=0;i!=split.npages;++i) {
+      html_page * page = split.pages+i;
+      ob_puts(ctx.ob, "<li>");
+      page_link(ctx.ob, page);
+      ob_puts(ctx.ob, ", Ebene ");
+      ob_int(ctx.ob, page->plane);
+      ob_puts(ctx.ob, ": ");
+      ob_int(ctx.ob, page->size);
+      ob_puts(ctx.ob, " Regionen, (");
+      ob_int(ctx.ob, page->x1);
+      ob_putc(ctx.ob, ',');
+      ob_int(ctx.ob, page->y1);
+      ob_puts(ctx.ob, ") bis (");
+      ob_int(ctx.ob, page->x2);
+      ob_putc(ctx.ob, ',');
+      ob_int(ctx.ob, page->y2);
+      ob_puts(ctx.ob, ")\n");
+    }
+    ob_puts(ctx.ob, "</ul>\n</html>\n");
+    ob_destroy(ctx.ob);
+    fclose(F);
+    context_free(&ctx);
+  }
+
+  for (i=0;i!=threads;++i) pthread_join(workers[i], NULL);
+  free(workers);
+  pthread_mutex_destroy(&split.lock);
+  write_pages();
+  if (verbose) fprintf(stderr, "%d of %d pages written\n", split.written, split.npages);
+
+  free(split.regions);
+  free(split.pages);
+  free(split.old);
+  list_free(&factions);
 }
 
 int
@@ -295,12 +978,15 @@ main(int argc, char ** argv)
   FILE * f;
   FILE * out = stdout;
   FILE * hierarchy = NULL;
+  const char * dir = NULL;
   int i;
   crdata * data = NULL;
   parse_info * parser = calloc(1, sizeof(parse_info));
 
   parser->iblock = &crdata_iblock;
   parser->ireport = &crdata_ireport;
+  parser->snapshot = crdata_parse_snapshot;
+  threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
 
   for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
     switch(argv[i][1]) {
@@ -328,6 +1014,18 @@ main(int argc, char ** argv)
           out = f;
         };
         break;
+      case 'd' :
+        dir = argv[++i];
+        break;
+      case 'i' :
+        gap = atoi(argv[++i]);
+        break;
+      case 'n' :
+        maxregions = atoi(argv[++i]);
+        break;
+      case 'j' :
+        threads = atoi(argv[++i]);
+        break;
       default :
         fprintf(stderr, "Ignoring unknown option.");
         break;
@@ -351,7 +1049,8 @@ main(int argc, char ** argv)
   }
   if (data->blocks!=NULL) {
     if (verbose) fprintf(stderr, "writing\n");
-    html_write(data, out);
+    if (dir) html_split(data, dir);
+    else html_write(data, out);
   }
 #if DEBUG_ALLOC
   fprintf(stderr, "allocated %d of %d bytes.\n", alloc, request);
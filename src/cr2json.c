@@ -0,0 +1,437 @@
+/*
+ *  cr2json - export Eressea CR files as JSON Lines.
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+#include "crdata.h"
+#include "crparse.h"
+#include "hierarchy.h"
+#include "conversion.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* the report is written as one line of JSON for the VERSION block, and one
+ * for each block below it, with everything under that block nested in it:
+ *   {"type":"REGION","ids":[3,4],"turn":500,
+ *    "attributes":{"Terrain":"Ebene","Bauern":100},
+ *    "children":[{"type":"EINHEIT","ids":[1001],...}]}
+ * "turn" is left out where it is the turn of the parent, "entries" holds
+ * the lines without a tag (COMMANDS and the like).
+ */
+
+#define BATCHBLOCKS 256 /* top-level blocks encoded by a thread at a time */
+
+static int threads = 1; /* number of threads encoding blocks */
+static int utf8; /* the strings of the report are UTF-8, not latin-1 */
+
+typedef struct jbuf {
+  char * data;
+  size_t size, maxsize;
+  char * scratch; /* a string converted by json_string */
+  size_t maxscratch;
+} jbuf;
+
+static void
+jb_reserve(jbuf * jb, size_t size)
+{
+  if (jb->size+size > jb->maxsize) {
+    while (jb->size+size > jb->maxsize) jb->maxsize = jb->maxsize ? jb->maxsize*2 : 64*1024;
+    jb->data = realloc(jb->data, jb->maxsize);
+  }
+}
+
+static void
+jb_write(jbuf * jb, const char * data, size_t size)
+{
+  jb_reserve(jb, size);
+  memcpy(jb->data+jb->size, data, size);
+  jb->size += size;
+}
+
+static void
+jb_puts(jbuf * jb, const char * str)
+{
+  jb_write(jb, str, strlen(str));
+}
+
+#define jb_putc(jb, c) do { jb_reserve(jb, 1); (jb)->data[(jb)->size++] = (char)(c); } while (0)
+
+static void
+jb_int(jbuf * jb, int i)
+{
+  char buffer[12];
+  char * cp = buffer+sizeof(buffer);
+  unsigned int u = (i<0)?0U-(unsigned int)i:(unsigned int)i;
+  do {
+    *--cp = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (i<0) *--cp = '-';
+  jb_write(jb, cp, buffer+sizeof(buffer)-cp);
+}
+
+/* plain ascii is copied as it is, anything else is converted to UTF-8
+ * by cr_utf8 first, and then escaped for JSON.
+ */
+static void
+json_string(jbuf * jb, const char * str)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char * cp = (const unsigned char *)str;
+  const unsigned char * end;
+  jb_putc(jb, '"');
+  while (*cp>=0x20 && *cp<0x80 && *cp!='"' && *cp!='\\') ++cp;
+  if (!*cp) {
+    jb_write(jb, str, (const char *)cp-str);
+    jb_putc(jb, '"');
+    return;
+  }
+  if (2*strlen(str)+1 > jb->maxscratch) {
+    jb->maxscratch = 2*strlen(str)+1;
+    jb->scratch = realloc(jb->scratch, jb->maxscratch);
+  }
+  cp = (const unsigned char *)jb->scratch;
+  end = cp + cr_utf8(jb->scratch, str, utf8);
+  for (;;) {
+    const unsigned char * run = cp;
+    char * p;
+    while (cp!=end && *cp>=0x20 && *cp!='"' && *cp!='\\') ++cp;
+    if (cp!=run) jb_write(jb, (const char *)run, cp-run);
+    if (cp==end) break;
+    jb_reserve(jb, 6);
+    p = jb->data+jb->size;
+    if (*cp=='"' || *cp=='\\') {
+      *p++ = '\\';
+      *p++ = (char)*cp;
+    }
+    else if (*cp=='\n') {
+      *p++ = '\\';
+      *p++ = 'n';
+    }
+    else if (*cp=='\t') {
+      *p++ = '\\';
+      *p++ = 't';
+    }
+    else if (*cp=='\r') {
+      *p++ = '\\';
+      *p++ = 'r';
+    }
+    else {
+      memcpy(p, "\\u00", 4);
+      p += 4;
+      *p++ = hex[*cp >> 4];
+      *p++ = hex[*cp & 0xF];
+    }
+    jb->size = p-jb->data;
+    ++cp;
+  }
+  jb_putc(jb, '"');
+}
+
+static void
+json_block(jbuf * jb, const block * b, int children)
+{
+  const entry * e;
+  const block * c;
+  size_t i;
+  int first;
+
+  jb_puts(jb, "{\"type\":");
+  json_string(jb, b->type->name);
+  if (b->size) {
+    jb_puts(jb, ",\"ids\":[");
+    for (i=0;i!=b->size;++i) {
+      if (i) jb_putc(jb, ',');
+      jb_int(jb, b->ids[i]);
+    }
+    jb_putc(jb, ']');
+  }
+  if (!b->parent || b->turn!=b->parent->turn) {
+    jb_puts(jb, ",\"turn\":");
+    jb_int(jb, b->turn);
+  }
+
+  first = 1;
+  for (e=b->entries;e;e=e->next) {
+    if (e->type==MESSAGE || e->type==NONE || !e->tag) continue;
+    jb_puts(jb, first?",\"attributes\":{":",");
+    first = 0;
+    json_string(jb, e->tag->name);
+    jb_putc(jb, ':');
+    switch (e->type) {
+    case INT:
+      jb_int(jb, e->data.i);
+      break;
+    case INTS:
+      jb_putc(jb, '[');
+      for (i=1;i<=(size_t)e->data.ip[0];++i) {
+        if (i>1) jb_putc(jb, ',');
+        jb_int(jb, e->data.ip[i]);
+      }
+      jb_putc(jb, ']');
+      break;
+    default:
+      json_string(jb, e->data.cp);
+      break;
+    }
+  }
+  if (!first) jb_putc(jb, '}');
+
+  first = 1;
+  for (e=b->entries;e;e=e->next) {
+    if (e->type!=MESSAGE) continue;
+    jb_puts(jb, first?",\"entries\":[":",");
+    first = 0;
+    json_string(jb, e->data.cp);
+  }
+  if (!first) jb_putc(jb, ']');
+
+  if (children && b->children) {
+    jb_puts(jb, ",\"children\":[");
+    for (c=b->children;c;c=c->next) {
+      if (c!=b->children) jb_putc(jb, ',');
+      json_block(jb, c, 1);
+    }
+    jb_putc(jb, ']');
+  }
+  jb_putc(jb, '}');
+}
+
+/** batches of top-level blocks are encoded by a pool of threads and
+ * written in order by the main thread. batch n goes into the slot
+ * n%nslots, and a thread that wants to encode batch n waits until batch
+ * n-nslots has been written. the threads only read the report.
+ */
+typedef
+struct slot {
+  jbuf text;
+  int number; /* batch held by this slot, -1 if it is free */
+  int done;
+} slot;
+
+static struct {
+  block ** blocks; /* the top-level blocks, in the order of the report */
+  int nblocks;
+  int nbatches;
+  slot * slots;
+  int nslots;
+  int nwritten; /* batches written so far */
+  int next; /* next batch to encode */
+  pthread_mutex_t lock;
+  pthread_cond_t encoded;
+  pthread_cond_t written;
+} pool;
+
+static void
+encode_batch(jbuf * jb, int n)
+{
+  int i, end = n*BATCHBLOCKS+BATCHBLOCKS;
+  if (end>pool.nblocks) end = pool.nblocks;
+  jb->size = 0;
+  for (i=n*BATCHBLOCKS;i!=end;++i) {
+    block * b = pool.blocks[i];
+    /* the root is written without the blocks below it, they follow */
+    json_block(jb, b, b->parent!=NULL);
+    jb_putc(jb, '\n');
+  }
+}
+
+static void *
+batch_worker(void * arg)
+{
+  unused(arg);
+  pthread_mutex_lock(&pool.lock);
+  while (pool.next<pool.nbatches) {
+    int n = pool.next++;
+    slot * s = pool.slots + n % pool.nslots;
+    while (n>=pool.nwritten+pool.nslots) pthread_cond_wait(&pool.written, &pool.lock);
+    s->number = n;
+    s->done = 0;
+    pthread_mutex_unlock(&pool.lock);
+
+    encode_batch(&s->text, n);
+
+    pthread_mutex_lock(&pool.lock);
+    s->done = 1;
+    pthread_cond_broadcast(&pool.encoded);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+static void
+json_write(crdata * data, FILE * out)
+{
+  pthread_t * workers;
+  block * b;
+  int n, i;
+
+  utf8 = crdata_utf8(data);
+  pool.nblocks = 1;
+  for (b=data->blocks->children;b;b=b->next) ++pool.nblocks;
+  pool.blocks = malloc(pool.nblocks * sizeof(block*));
+  pool.blocks[0] = data->blocks;
+  for (b=data->blocks->children,i=1;b;b=b->next) pool.blocks[i++] = b;
+  pool.nbatches = (pool.nblocks+BATCHBLOCKS-1)/BATCHBLOCKS;
+
+  if (threads<1) threads = 1;
+  workers = malloc(threads * sizeof(pthread_t));
+  pool.nslots = threads * 2;
+  pool.slots = calloc(pool.nslots, sizeof(slot));
+  pool.next = 0;
+  pool.nwritten = 0;
+  for (i=0;i!=pool.nslots;++i) pool.slots[i].number = -1;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.encoded, NULL);
+  pthread_cond_init(&pool.written, NULL);
+  for (i=0;i!=threads;++i) pthread_create(&workers[i], NULL, batch_worker, NULL);
+
+  for (n=0;n!=pool.nbatches;++n) {
+    slot * s = pool.slots + n % pool.nslots;
+    pthread_mutex_lock(&pool.lock);
+    while (s->number!=n || !s->done) pthread_cond_wait(&pool.encoded, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    fwrite(s->text.data, 1, s->text.size, out);
+
+    pthread_mutex_lock(&pool.lock);
+    s->number = -1;
+    ++pool.nwritten;
+    pthread_cond_broadcast(&pool.written);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  for (i=0;i!=threads;++i) pthread_join(workers[i], NULL);
+  for (i=0;i!=pool.nslots;++i) {
+    free(pool.slots[i].text.data);
+    free(pool.slots[i].text.scratch);
+  }
+  free(pool.slots);
+  free(pool.blocks);
+  free(workers);
+  if (verbose) fprintf(stderr, "wrote %d blocks\n", pool.nblocks);
+}
+
+void
+read_cr(parse_info * parser, const char * filename)
+{
+  FILE * in = fopen(filename, "rt+");
+  if (!in) {
+    perror(filename);
+    return;
+  }
+  if (verbose) fprintf(stderr, "reading %s\n", filename);
+
+  cr_parse(parser, in);
+}
+
+int
+usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [options] [infiles]\n", name);
+  fprintf(stderr, "options:\n"
+    " -h       display this information\n"
+    " -H file  read cr-hierarchy from file\n"
+    " -o file  write output to file (default is stdout)\n"
+    " -j n     encode with n threads (default: one per cpu)\n"
+    " -V       print version information\n"
+    " -v       verbose\n"
+    "infiles:\n"
+    " one or more cr-files. if none specified, read from stdin\n");
+  return -1;
+}
+
+int
+main(int argc, char ** argv)
+{
+  FILE * f;
+  FILE * out = stdout;
+  FILE * hierarchy = NULL;
+  int i, files = 0;
+  crdata * data = NULL;
+  parse_info * parser = (parse_info*)calloc(1, sizeof(parse_info));
+
+  parser->iblock = &crdata_iblock;
+  parser->ireport = &crdata_ireport;
+  parser->snapshot = crdata_parse_snapshot;
+  threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
+    switch(argv[i][1]) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'V' :
+        fprintf(stderr, "cr2json\nCopyright (C) 2006 Enno Rehling\n\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, and you are welcome to redistribute it\nunder certain conditions; consult the file gpl.txt for details.\n\n");
+        fprintf(stderr, "compiled at %s on %s\n", __TIME__, __DATE__);
+        break;
+      case 'h' :
+        return usage(argv[0]);
+      case 'H':
+        f = fopen(argv[++i], "rt+");
+        if (!f) perror(argv[i]);
+        else if (hierarchy==NULL) {
+          hierarchy = f;
+        };
+        data = crdata_init(hierarchy);
+        break;
+      case 'o' :
+        f = fopen(argv[++i], "wb");
+        if (!f) perror(argv[i]);
+        else if (out==stdout) {
+          out = f;
+        };
+        break;
+      case 'j' :
+        threads = atoi(argv[++i]);
+        break;
+      default :
+        fprintf(stderr, "Ignoring unknown option.");
+        break;
+    }
+  }
+  else {
+    if (!hierarchy) {
+      data = crdata_init(NULL);
+      hierarchy = stdin;
+    }
+    data->parser = parser;
+    parser->bcontext = (context_t)data;
+    read_cr(parser, argv[i]);
+    ++files;
+  }
+  if (!files) {
+    if (!data) data = crdata_init(NULL);
+    data->parser = parser;
+    parser->bcontext = (context_t)data;
+    if (verbose) fprintf(stderr, "reading from stdin\n");
+    cr_parse(parser, stdin);
+  }
+  if (data->blocks!=NULL) {
+    if (verbose) fprintf(stderr, "writing\n");
+    json_write(data, out);
+  }
+  if (out!=stdout) fclose(out);
+  return 0;
+}
@@ -0,0 +1,658 @@
+/*
+ *  cr2sqlite - load Eressea CR files into an SQLite database.
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+#include "crdata.h"
+#include "crparse.h"
+#include "hierarchy.h"
+#include "conversion.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+/* every block type gets a table, named like the type in lowercase, with a
+ * row for each block:
+ *   block   a number for the block, unique in the database
+ *   report  the row in the report table for the run that loaded it
+ *   parent  the number of the block above it, NULL for VERSION
+ *   turn
+ *   id, or id1, id2, ... for types with more than one id
+ * and a column for every attribute that one of the blocks has. all the
+ * lines of a block are also in the attribute table, in their order, with
+ * their name (NULL for lines without one, like COMMANDS) and value.
+ * loading into an existing database adds the report to it, and the columns
+ * that its tables do not have yet.
+ */
+
+#define CMAXHASH 251
+#define TYPEHASH 509
+#define FIXEDCOLUMNS 4 /* block, report, parent, turn */
+
+/* attributes that hold a faction id, indexed with -i */
+static const char * faction_tags[] = { "Partei", "Verkleidung", NULL };
+
+static int utf8; /* the strings of the report are UTF-8, not latin-1 */
+
+typedef struct column {
+  char * name;          /* utf-8 */
+  const property * tag; /* NULL for the block's own columns */
+  int integer;          /* all the values are ints */
+  int param;            /* in the insert, 0 if the column is left out */
+  int nexthash;
+} column;
+
+typedef struct table {
+  char * name;
+  column * columns;
+  int ncolumns, maxcolumns;
+  int nids;
+  int colhash[CMAXHASH];
+  int rows;
+  sqlite3_stmt * insert;
+} table;
+
+typedef struct loader {
+  sqlite3 * db;
+  table * tables;
+  int ntables, maxtables;
+  struct {
+    const blocktype * type;
+    int table;
+  } typehash[TYPEHASH];
+  sqlite3_stmt * attribute;
+  const entry ** values; /* the entry of each column, for the current row */
+  int maxvalues;
+  char * scratch;        /* strings that need converting */
+  size_t maxscratch;
+  int report, next, blocks, attributes;
+} loader;
+
+static int
+sql_error(loader * ld, const char * what)
+{
+  fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(ld->db));
+  return -1;
+}
+
+static int
+sql_exec(loader * ld, const char * sql)
+{
+  char * error = NULL;
+  if (sqlite3_exec(ld->db, sql, NULL, NULL, &error)!=SQLITE_OK) {
+    fprintf(stderr, "%s: %s\n", sql, error);
+    sqlite3_free(error);
+    return -1;
+  }
+  return 0;
+}
+
+static char *
+scratch(loader * ld, size_t size)
+{
+  if (size>ld->maxscratch) {
+    while (size>ld->maxscratch) ld->maxscratch = ld->maxscratch ? ld->maxscratch*2 : 1024;
+    ld->scratch = realloc(ld->scratch, ld->maxscratch);
+  }
+  return ld->scratch;
+}
+
+/* most strings are plain ascii and are bound where they are, the others
+ * are converted by cr_utf8.
+ */
+static int
+bind_string(loader * ld, sqlite3_stmt * stmt, int param, const char * str)
+{
+  const unsigned char * cp = (const unsigned char *)str;
+  size_t size;
+
+  while (*cp && *cp<0x80 && *cp!='\\') ++cp;
+  if (!*cp) {
+    return sqlite3_bind_text(stmt, param, str, (int)(cp-(const unsigned char *)str), SQLITE_STATIC);
+  }
+  size = cr_utf8(scratch(ld, 2*strlen(str)+1), str, utf8);
+  return sqlite3_bind_text(stmt, param, ld->scratch, (int)size, SQLITE_TRANSIENT);
+}
+
+static int
+bind_entry(loader * ld, sqlite3_stmt * stmt, int param, const entry * e)
+{
+  int i;
+  char * p;
+
+  switch (e->type) {
+  case INT:
+    return sqlite3_bind_int(stmt, param, e->data.i);
+  case INTS:
+    /* a list of ints is a string, like in the CR */
+    p = scratch(ld, e->data.ip[0]*12+1);
+    for (i=1;i<=e->data.ip[0];++i) {
+      p += sprintf(p, i>1 ? " %d" : "%d", e->data.ip[i]);
+    }
+    return sqlite3_bind_text(stmt, param, ld->scratch, (int)(p-ld->scratch), SQLITE_TRANSIENT);
+  case STRING:
+  case MESSAGE:
+    return bind_string(ld, stmt, param, e->data.cp);
+  default:
+    return sqlite3_bind_null(stmt, param);
+  }
+}
+
+static char *
+utf8_name(const char * name)
+{
+  char * result = malloc(2*strlen(name)+1);
+  cr_utf8(result, name, utf8);
+  return result;
+}
+
+/* the columns of a table are compared like sqlite does, without case */
+static int
+has_column(const table * t, const char * name)
+{
+  int i;
+  for (i=0;i!=t->ncolumns;++i) {
+    if (t->columns[i].param && stricmp(t->columns[i].name, name)==0) return 1;
+  }
+  return 0;
+}
+
+static column *
+add_column(table * t, const char * name, int integer)
+{
+  column * c;
+  if (t->ncolumns==t->maxcolumns) {
+    t->maxcolumns = t->maxcolumns ? t->maxcolumns*2 : 32;
+    t->columns = realloc(t->columns, t->maxcolumns*sizeof(column));
+  }
+  c = t->columns + t->ncolumns;
+  memset(c, 0, sizeof(column));
+  c->name = utf8_name(name);
+  c->integer = integer;
+  c->nexthash = -1;
+  /* an attribute that differs from another column only in case goes to
+   * the attribute table only */
+  if (!has_column(t, c->name)) c->param = 1;
+  ++t->ncolumns;
+  return c;
+}
+
+static int
+find_column(const table * t, const property * tag)
+{
+  int i = t->colhash[(size_t)tag % CMAXHASH];
+  while (i>=0 && t->columns[i].tag!=tag) i = t->columns[i].nexthash;
+  return i;
+}
+
+/** the hierarchy can have a type in several places (MESSAGE, EFFECTS),
+ * they share a table.
+ */
+static table *
+find_table(loader * ld, const blocktype * type)
+{
+  unsigned int key = (unsigned int)((size_t)type % TYPEHASH);
+  table * t;
+  char * c;
+  int i;
+
+  while (ld->typehash[key].type && ld->typehash[key].type!=type) key = (key+1) % TYPEHASH;
+  if (ld->typehash[key].type) return ld->tables + ld->typehash[key].table;
+
+  for (i=0;i!=ld->ntables;++i) {
+    if (stricmp(ld->tables[i].name, type->name)==0) break;
+  }
+  if (i==ld->ntables) {
+    if (ld->ntables==ld->maxtables) {
+      ld->maxtables = ld->maxtables ? ld->maxtables*2 : 32;
+      ld->tables = realloc(ld->tables, ld->maxtables*sizeof(table));
+    }
+    t = ld->tables + ld->ntables++;
+    memset(t, 0, sizeof(table));
+    t->name = utf8_name(type->name);
+    for (c=t->name;*c;++c) *c = (char)tolower((unsigned char)*c);
+    for (i=0;i!=CMAXHASH;++i) t->colhash[i] = -1;
+    add_column(t, "block", 1);
+    add_column(t, "report", 1);
+    add_column(t, "parent", 1);
+    add_column(t, "turn", 1);
+    i = ld->ntables-1;
+  }
+  ld->typehash[key].type = type;
+  ld->typehash[key].table = i;
+  return ld->tables + i;
+}
+
+/** the columns of every table, from the blocks that go into it: the ids
+ * come right after the fixed columns, so they are added as a table is
+ * first seen, and when a block has more of them than those before.
+ */
+static void
+collect_columns(loader * ld, const block * b)
+{
+  for (;b;b=b->next) {
+    table * t = find_table(ld, b->type);
+    const entry * e;
+
+    while ((size_t)t->nids<b->size) {
+      char name[16];
+      column * c;
+      if (t->nids==0 && b->size==1) {
+        c = add_column(t, "id", 1);
+      }
+      else if (t->nids==1 && strcmp(t->columns[FIXEDCOLUMNS].name, "id")==0) {
+        /* the first block with more than one id */
+        free(t->columns[FIXEDCOLUMNS].name);
+        t->columns[FIXEDCOLUMNS].name = utf8_name("id1");
+        continue;
+      }
+      else {
+        sprintf(name, "id%d", t->nids+1);
+        c = add_column(t, name, 1);
+      }
+      ++t->nids;
+      if (t->ncolumns-1!=FIXEDCOLUMNS+t->nids-1) {
+        /* more ids than the blocks before, move it up to the others */
+        column id = *c;
+        int i, pos = FIXEDCOLUMNS+t->nids-1;
+        memmove(t->columns+pos+1, t->columns+pos, (t->ncolumns-1-pos)*sizeof(column));
+        t->columns[pos] = id;
+        for (i=0;i!=CMAXHASH;++i) t->colhash[i] = -1;
+        for (i=0;i!=t->ncolumns;++i) {
+          column * col = t->columns+i;
+          if (col->tag) {
+            unsigned int key = (unsigned int)((size_t)col->tag % CMAXHASH);
+            col->nexthash = t->colhash[key];
+            t->colhash[key] = i;
+          }
+        }
+      }
+    }
+    for (e=b->entries;e;e=e->next) {
+      int n;
+      if (!e->tag) continue;
+      n = find_column(t, e->tag);
+      if (n<0) {
+        column * c = add_column(t, e->tag->name, e->type==INT);
+        unsigned int key = (unsigned int)((size_t)e->tag % CMAXHASH);
+        c->tag = e->tag;
+        c->nexthash = t->colhash[key];
+        t->colhash[key] = t->ncolumns-1;
+      }
+      else if (e->type!=INT) {
+        t->columns[n].integer = 0;
+      }
+    }
+    ++ld->blocks;
+    collect_columns(ld, b->children);
+  }
+}
+
+/* creates the table, or adds the columns it does not have yet, and
+ * prepares the insert */
+static int
+prepare_table(loader * ld, table * t)
+{
+  sqlite3_stmt * stmt;
+  sqlite3_str * sql;
+  char * query;
+  int i, result, params = 0;
+
+  query = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" "
+    "(block INTEGER PRIMARY KEY, report INTEGER, parent INTEGER, turn INTEGER)", t->name);
+  result = sql_exec(ld, query);
+  sqlite3_free(query);
+  if (result) return result;
+
+  query = sqlite3_mprintf("PRAGMA table_info(\"%w\")", t->name);
+  result = sqlite3_prepare_v2(ld->db, query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (result!=SQLITE_OK) return sql_error(ld, t->name);
+  while (sqlite3_step(stmt)==SQLITE_ROW) {
+    const char * name = (const char *)sqlite3_column_text(stmt, 1);
+    for (i=0;i!=t->ncolumns;++i) {
+      if (stricmp(t->columns[i].name, name)==0) t->columns[i].param = -t->columns[i].param;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  /* the columns that are left are numbered in the order of the insert */
+  sql = sqlite3_str_new(ld->db);
+  sqlite3_str_appendf(sql, "INSERT INTO \"%w\" (", t->name);
+  for (i=0;i!=t->ncolumns;++i) {
+    column * c = t->columns+i;
+    if (!c->param) continue;
+    if (c->param>0) {
+      query = sqlite3_mprintf("ALTER TABLE \"%w\" ADD COLUMN \"%w\" %s",
+        t->name, c->name, c->integer ? "INTEGER" : "TEXT");
+      result = sql_exec(ld, query);
+      sqlite3_free(query);
+      if (result) {
+        sqlite3_free(sqlite3_str_finish(sql));
+        return result;
+      }
+    }
+    c->param = ++params;
+    sqlite3_str_appendf(sql, params>1 ? ", \"%w\"" : "\"%w\"", c->name);
+  }
+  sqlite3_str_appendall(sql, ") VALUES (");
+  for (i=1;i<=params;++i) {
+    sqlite3_str_appendf(sql, i>1 ? ", ?%d" : "?%d", i);
+  }
+  sqlite3_str_appendall(sql, ")");
+  query = sqlite3_str_finish(sql);
+  result = sqlite3_prepare_v2(ld->db, query, -1, &t->insert, NULL);
+  sqlite3_free(query);
+  if (result!=SQLITE_OK) return sql_error(ld, t->name);
+  return 0;
+}
+
+static int
+insert_blocks(loader * ld, const block * b, int parent)
+{
+  for (;b;b=b->next) {
+    table * t = find_table(ld, b->type);
+    sqlite3_stmt * stmt = t->insert;
+    const entry * e;
+    int i, number = ld->next++, seq = 0;
+
+    for (i=0;i!=t->ncolumns;++i) ld->values[i] = NULL;
+    for (e=b->entries;e;e=e->next) if (e->tag) {
+      int n = find_column(t, e->tag);
+      if (n>=0) ld->values[n] = e;
+    }
+    sqlite3_bind_int(stmt, 1, number);
+    sqlite3_bind_int(stmt, 2, ld->report);
+    if (parent) sqlite3_bind_int(stmt, 3, parent);
+    else sqlite3_bind_null(stmt, 3);
+    sqlite3_bind_int(stmt, 4, b->turn);
+    for (i=0;i!=t->nids;++i) {
+      int param = t->columns[FIXEDCOLUMNS+i].param;
+      if (!param) continue;
+      if ((size_t)i<b->size) sqlite3_bind_int(stmt, param, b->ids[i]);
+      else sqlite3_bind_null(stmt, param);
+    }
+    for (i=FIXEDCOLUMNS+t->nids;i<t->ncolumns;++i) {
+      const column * c = t->columns+i;
+      if (!c->param) continue;
+      if (ld->values[i]) bind_entry(ld, stmt, c->param, ld->values[i]);
+      else sqlite3_bind_null(stmt, c->param);
+    }
+    if (sqlite3_step(stmt)!=SQLITE_DONE) return sql_error(ld, t->name);
+    sqlite3_reset(stmt);
+    ++t->rows;
+
+    stmt = ld->attribute;
+    for (e=b->entries;e;e=e->next) {
+      sqlite3_bind_int(stmt, 1, number);
+      sqlite3_bind_int(stmt, 2, ++seq);
+      if (e->tag) bind_string(ld, stmt, 3, e->tag->name);
+      else sqlite3_bind_null(stmt, 3);
+      bind_entry(ld, stmt, 4, e);
+      if (sqlite3_step(stmt)!=SQLITE_DONE) return sql_error(ld, "attribute");
+      sqlite3_reset(stmt);
+      ++ld->attributes;
+    }
+
+    if (insert_blocks(ld, b->children, number)) return -1;
+  }
+  return 0;
+}
+
+static int
+create_index(loader * ld, const table * t, const char * suffix, const char * columns)
+{
+  char * query = sqlite3_mprintf("CREATE INDEX IF NOT EXISTS \"%w_%w\" ON \"%w\" (%s)",
+    t->name, suffix, t->name, columns);
+  int result = sql_exec(ld, query);
+  sqlite3_free(query);
+  return result;
+}
+
+/** the ids (coordinates for regions), the parent, faction ids in other
+ * blocks, and the block of an attribute. they are made after the rows are
+ * in, which is a lot faster than keeping them up to date with every insert.
+ */
+static int
+create_indexes(loader * ld)
+{
+  int i, k;
+  if (sql_exec(ld, "CREATE INDEX IF NOT EXISTS attribute_block ON attribute (block)")) return -1;
+  for (i=0;i!=ld->ntables;++i) {
+    const table * t = ld->tables+i;
+    if (t->nids) {
+      sqlite3_str * sql = sqlite3_str_new(ld->db);
+      char * columns;
+      int result;
+      for (k=0;k!=t->nids;++k) {
+        sqlite3_str_appendf(sql, k ? ", \"%w\"" : "\"%w\"", t->columns[FIXEDCOLUMNS+k].name);
+      }
+      columns = sqlite3_str_finish(sql);
+      result = create_index(ld, t, "id", columns);
+      sqlite3_free(columns);
+      if (result) return result;
+    }
+    if (create_index(ld, t, "parent", "parent")) return -1;
+    for (k=FIXEDCOLUMNS+t->nids;k<t->ncolumns;++k) {
+      const column * c = t->columns+k;
+      const char ** tag;
+      if (!c->param) continue;
+      for (tag=faction_tags;*tag;++tag) if (strcmp(c->name, *tag)==0) {
+        char * column = sqlite3_mprintf("\"%w\"", c->name);
+        int result = create_index(ld, t, c->name, column);
+        sqlite3_free(column);
+        if (result) return result;
+      }
+    }
+  }
+  return 0;
+}
+
+/** the report goes in with one transaction, and prepared statements for
+ * every table. the database does not have to be safe until it is done, so
+ * it is not synced in between.
+ */
+static int
+load_report(loader * ld, crdata * data, const char * files, int indexes)
+{
+  sqlite3_stmt * stmt;
+  int i, first = 1;
+
+  utf8 = crdata_utf8(data);
+  collect_columns(ld, data->blocks);
+  if (sql_exec(ld, "PRAGMA synchronous=OFF")) return -1;
+  if (sql_exec(ld, "PRAGMA cache_size=-65536")) return -1;
+  if (sql_exec(ld, "BEGIN")) return -1;
+  if (sql_exec(ld, "CREATE TABLE IF NOT EXISTS report "
+    "(report INTEGER PRIMARY KEY, files TEXT, turn INTEGER, first INTEGER, blocks INTEGER)")) return -1;
+  if (sql_exec(ld, "CREATE TABLE IF NOT EXISTS attribute "
+    "(block INTEGER, seq INTEGER, name TEXT, value)")) return -1;
+  for (i=0;i!=ld->ntables;++i) {
+    if (prepare_table(ld, ld->tables+i)) return -1;
+    if (ld->tables[i].ncolumns>ld->maxvalues) ld->maxvalues = ld->tables[i].ncolumns;
+  }
+  ld->values = malloc(ld->maxvalues*sizeof(entry*));
+
+  /* the block numbers of this report come after those of the last */
+  if (sqlite3_prepare_v2(ld->db, "SELECT max(first+blocks) FROM report", -1, &stmt, NULL)!=SQLITE_OK) {
+    return sql_error(ld, "report");
+  }
+  if (sqlite3_step(stmt)==SQLITE_ROW && sqlite3_column_type(stmt, 0)!=SQLITE_NULL) {
+    first = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  if (sqlite3_prepare_v2(ld->db, "INSERT INTO report (files, turn, first, blocks) VALUES (?, ?, ?, ?)", -1, &stmt, NULL)!=SQLITE_OK) {
+    return sql_error(ld, "report");
+  }
+  bind_string(ld, stmt, 1, files);
+  sqlite3_bind_int(stmt, 2, data->blocks->turn);
+  sqlite3_bind_int(stmt, 3, first);
+  sqlite3_bind_int(stmt, 4, ld->blocks);
+  if (sqlite3_step(stmt)!=SQLITE_DONE) return sql_error(ld, "report");
+  sqlite3_finalize(stmt);
+  ld->report = (int)sqlite3_last_insert_rowid(ld->db);
+  ld->next = first;
+
+  if (sqlite3_prepare_v2(ld->db, "INSERT INTO attribute (block, seq, name, value) VALUES (?, ?, ?, ?)", -1, &ld->attribute, NULL)!=SQLITE_OK) {
+    return sql_error(ld, "attribute");
+  }
+  if (insert_blocks(ld, data->blocks, 0)) return -1;
+  if (indexes && create_indexes(ld)) return -1;
+  if (sql_exec(ld, "COMMIT")) return -1;
+
+  if (verbose) {
+    for (i=0;i!=ld->ntables;++i) {
+      fprintf(stderr, "wrote %d rows to %s\n", ld->tables[i].rows, ld->tables[i].name);
+    }
+    fprintf(stderr, "wrote %d attributes\n", ld->attributes);
+  }
+  return 0;
+}
+
+static void
+free_loader(loader * ld)
+{
+  int i, k;
+  for (i=0;i!=ld->ntables;++i) {
+    table * t = ld->tables+i;
+    for (k=0;k!=t->ncolumns;++k) free(t->columns[k].name);
+    free(t->columns);
+    free(t->name);
+    sqlite3_finalize(t->insert);
+  }
+  sqlite3_finalize(ld->attribute);
+  free(ld->tables);
+  free(ld->values);
+  free(ld->scratch);
+}
+
+void
+read_cr(parse_info * parser, const char * filename)
+{
+  FILE * in = fopen(filename, "rt+");
+  if (!in) {
+    perror(filename);
+    return;
+  }
+  if (verbose) fprintf(stderr, "reading %s\n", filename);
+
+  cr_parse(parser, in);
+}
+
+int
+usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [options] [infiles]\n", name);
+  fprintf(stderr, "options:\n"
+    " -h       display this information\n"
+    " -H file  read cr-hierarchy from file\n"
+    " -o file  the database to write to (default: cr.sqlite)\n"
+    " -i       index coordinates, ids, parents and faction ids\n"
+    " -V       print version information\n"
+    " -v       verbose\n"
+    "infiles:\n"
+    " one or more cr-files. if none specified, read from stdin\n");
+  return -1;
+}
+
+int
+main(int argc, char ** argv)
+{
+  FILE * f;
+  FILE * hierarchy = NULL;
+  const char * filename = "cr.sqlite";
+  int i, files = 0, indexes = 0, result;
+  crdata * data = NULL;
+  parse_info * parser = (parse_info*)calloc(1, sizeof(parse_info));
+  sqlite3_str * names = sqlite3_str_new(NULL);
+  char * report;
+  loader ld;
+
+  parser->iblock = &crdata_iblock;
+  parser->ireport = &crdata_ireport;
+  parser->snapshot = crdata_parse_snapshot;
+
+  for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
+    switch(argv[i][1]) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'V' :
+        fprintf(stderr, "cr2sqlite\nCopyright (C) 2006 Enno Rehling\n\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, and you are welcome to redistribute it\nunder certain conditions; consult the file gpl.txt for details.\n\n");
+        fprintf(stderr, "compiled at %s on %s\n", __TIME__, __DATE__);
+        fprintf(stderr, "sqlite %s\n", sqlite3_libversion());
+        break;
+      case 'h' :
+        return usage(argv[0]);
+      case 'H':
+        f = fopen(argv[++i], "rt+");
+        if (!f) perror(argv[i]);
+        else if (hierarchy==NULL) {
+          hierarchy = f;
+        };
+        data = crdata_init(hierarchy);
+        break;
+      case 'o' :
+        filename = argv[++i];
+        break;
+      case 'i' :
+        indexes = 1;
+        break;
+      default :
+        fprintf(stderr, "Ignoring unknown option.");
+        break;
+    }
+  }
+  else {
+    if (!hierarchy) {
+      data = crdata_init(NULL);
+      hierarchy = stdin;
+    }
+    data->parser = parser;
+    parser->bcontext = (context_t)data;
+    read_cr(parser, argv[i]);
+    sqlite3_str_appendf(names, files ? " %s" : "%s", argv[i]);
+    ++files;
+  }
+  if (!files) {
+    if (!data) data = crdata_init(NULL);
+    data->parser = parser;
+    parser->bcontext = (context_t)data;
+    if (verbose) fprintf(stderr, "reading from stdin\n");
+    cr_parse(parser, stdin);
+    sqlite3_str_appendall(names, "-");
+  }
+  report = sqlite3_str_finish(names);
+  if (data->blocks==NULL) return 0;
+
+  memset(&ld, 0, sizeof(ld));
+  if (sqlite3_open(filename, &ld.db)!=SQLITE_OK) {
+    fprintf(stderr, "%s: %s\n", filename, sqlite3_errmsg(ld.db));
+    return -1;
+  }
+  if (verbose) fprintf(stderr, "writing %s\n", filename);
+  result = load_report(&ld, data, report, indexes);
+  if (result) sqlite3_exec(ld.db, "ROLLBACK", NULL, NULL, NULL);
+  free_loader(&ld);
+  sqlite3_free(report);
+  sqlite3_close(ld.db);
+  return result;
+}
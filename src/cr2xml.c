@@ -25,6 +25,7 @@
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/parser.h>
+#include <libxml/xmlwriter.h>
 #include <iconv.h>
 
 /* libc includes */
@@ -80,11 +81,144 @@ to_utf8(const char * inbuf)
   return convert(conv, inbuf);
 }
 
+/* names of blocks and attributes come from a small set, and every one of
+ * them is only converted once.
+ */
+#define NMAXHASH 1023
+
+typedef struct utf8_name {
+  char * name;
+  char * utf8;
+  struct utf8_name * nexthash;
+} utf8_name;
+
+static utf8_name * utf8_names[NMAXHASH];
+
+static const char *
+name_utf8(const char * name)
+{
+  unsigned int key = 0;
+  const unsigned char * cp;
+  utf8_name * n;
+  for (cp=(const unsigned char*)name;*cp;++cp) key = key*31 + *cp;
+  for (n=utf8_names[key % NMAXHASH];n;n=n->nexthash) {
+    if (!strcmp(n->name, name)) return n->utf8;
+  }
+  n = malloc(sizeof(utf8_name));
+  n->name = strdup(name);
+  n->utf8 = to_utf8(name);
+  n->nexthash = utf8_names[key % NMAXHASH];
+  utf8_names[key % NMAXHASH] = n;
+  return n->utf8;
+}
+
+/* values are nearly always plain ascii, which needs no conversion at all.
+ * the others are converted into a buffer that is reused, so the result
+ * is only good until the next call.
+ */
+static const char *
+value_utf8(const char * value)
+{
+  static iconv_t conv = 0;
+  static char * buffer = NULL;
+  static size_t size = 0;
+  const unsigned char * cp;
+  char * inbuf, * outbuf;
+  size_t insize, outsize;
+
+  if (value==NULL) {
+    if (conv) iconv_close(conv);
+    conv = 0;
+    free(buffer);
+    buffer = NULL;
+    size = 0;
+    return NULL;
+  }
+  for (cp=(const unsigned char*)value;*cp && *cp<0x80;++cp);
+  if (!*cp) return value;
+
+  if (conv==0) conv = iconv_open("UTF-8", "ISO-8859-1");
+  /* every character of latin-1 is at most two bytes in utf-8 */
+  insize = strlen(value)+1;
+  if (size<insize*2) {
+    size = insize*2;
+    buffer = realloc(buffer, size);
+  }
+  inbuf = (char*)value;
+  outbuf = buffer;
+  outsize = size;
+  iconv(conv, &inbuf, &insize, &outbuf, &outsize);
+  return buffer;
+}
+
+/* the element names for compact output. a type without an xml name in the
+ * hierarchy file uses the default from this table, or its own name in
+ * lowercase if it has none.
+ */
+static const char * translate[][2] = {
+  { "PARTEI", "faction" },
+  { "EINHEIT", "unit" },
+  { "GEGENSTAENDE", "items" },
+  { "DURCHSCHIFFUNG", "traffic" },
+  { "BURG", "building" },
+  { "SCHIFF", "ship" },
+  { "ALLIANZ", "ally" },
+  { 0, 0 },
+};
+
+#define EMAXHASH 127
+
+typedef struct xml_element {
+  const blocktype * type;
+  char * name; /* utf-8 */
+  struct xml_element * nexthash;
+} xml_element;
+
+static xml_element * elements[EMAXHASH];
+
+static xml_element *
+find_element(const blocktype * type)
+{
+  unsigned int key = (unsigned int)(((size_t)type >> 4) % EMAXHASH);
+  xml_element * e = elements[key];
+  while (e && e->type!=type) e = e->nexthash;
+  if (e==NULL) {
+    e = calloc(1, sizeof(xml_element));
+    e->type = type;
+    e->nexthash = elements[key];
+    elements[key] = e;
+  }
+  return e;
+}
+
+static const char *
+element_name(const blocktype * type)
+{
+  xml_element * e = find_element(type);
+  if (e->name==NULL) {
+    int i;
+    for (i=0;translate[i][0];++i) {
+      if (!strcmp(translate[i][0], type->name)) break;
+    }
+    if (translate[i][0]) {
+      e->name = to_utf8(translate[i][1]);
+    } else {
+      char buffer[64], * c;
+      strncpy(buffer, type->name, sizeof(buffer));
+      buffer[sizeof(buffer)-1] = 0;
+      for (c=buffer;*c;++c) *c = (char)tolower((unsigned char)*c);
+      e->name = to_utf8(buffer);
+    }
+  }
+  return e->name;
+}
+
 static blocktype *
 xml_readhierarchy(xmlNodePtr root, blocktype * parent)
 {
   xmlNodePtr node = root->children;
   xmlChar * name = xmlGetProp(root, BAD_CAST "name");
+  xmlChar * element = xmlGetProp(root, BAD_CAST "xml");
   blocktype * btype = make_type((const char*)name, parent, NULL, 0);
 
   assert(root->type==XML_ELEMENT_NODE);
@@ -100,6 +234,10 @@ xml_readhierarchy(xmlNodePtr root, blocktype * parent)
     }
     node = node->next;
   }
+  if (element) {
+    find_element(btype)->name = strdup((const char*)element);
+    xmlFree(element);
+  }
   xmlFree(name);
   return btype;
 }
@@ -133,71 +271,51 @@ usage(const char * name)
   return -1;
 }
 
-typedef struct xml_context {
-  xmlDocPtr doc;
-  xmlNodePtr previous;
-  blocktype * blocktypes;
-} xml_context;
-
-typedef struct block_name {
-  char * cr_name;
-  char * xml_name;
-  struct block_name * next;
-} block_name;
-
-static block_name * names = NULL;
-
-/* TODO: this belongs in an external xml configuration file */
-static const char * translate[][2] = {
-  { "PARTEI", "faction" },
-  { "EINHEIT", "unit" },
-  { "GEGENSTAENDE", "items" },
-  { "DURCHSCHIFFUNG", "traffic" },
-  { "BURG", "building" },
-  { "SCHIFF", "ship" },
-  { "ALLIANZ", "ally" },
-  { 0, 0 },
+/** the xml is written while the report is parsed, and only the block that
+ * is being read is kept in memory. what the parser sets on it is collected
+ * in items, until the next block starts and it can be written as a whole,
+ * attributes first. the elements that are still open are a stack of their
+ * block types, and a new block closes them until it finds its parent type
+ * from the hierarchy.
+ */
+enum {
+  ITEM_ATTRIBUTE, /* name="value" on the block itself */
+  ITEM_ID,        /* <id>value</id> */
+  ITEM_INT,       /* <int name="" value=""/> */
+  ITEM_STRING,    /* <string name="" value=""/> */
+  ITEM_ENTRY,     /* <entry value=""/> */
+  ITEM_LIST,      /* <list name="">, followed by its values */
+  ITEM_LISTINT,   /* <int value=""/> inside a list */
+  ITEM_ENDLIST
 };
 
-static block_name *
-get_names(void)
-{
-  if (names==NULL) {
-    int i;
-    for (i=0;translate[i][0];++i) {
-      block_name * name = malloc(sizeof(block_name));
-      name->cr_name = strdup(translate[i][0]);
-      name->xml_name = strdup(translate[i][1]);
-      name->next = names;
-      names = name;
-    }
-  }
-  return names;
-}
+typedef struct xml_item {
+  int kind;
+  size_t name, value; /* offsets into the string pool */
+} xml_item;
 
-static xmlChar *
-xml_block(const char * cr_name)
-{
-  block_name * p = get_names();
-  while (p && strcmp(p->cr_name, cr_name)!=0) p=p->next;
-  if (p) {
-    return (xmlChar *)to_utf8(p->xml_name);
-  } else {
-    char buffer[64], * c;
-    strncpy(buffer, cr_name, sizeof(buffer));
-    buffer[sizeof(buffer)-1] = 0;
-    for (c=buffer;*c;++c) *c = tolower(*c);
-    return to_utf8(buffer);
-  }
-}
+typedef struct xml_context {
+  xmlTextWriterPtr writer;
+  blocktype * blocktypes;
+  const blocktype ** stack;   /* types of the open elements */
+  int depth, maxdepth;
+  const blocktype * previous;        /* type of the last block written */
+
+  /* the current block */
+  const blocktype * type;
+  const char * element;
+  xml_item * items;
+  int nitems, maxitems;
+  char * pool;
+  size_t poolsize, maxpool;
+} xml_context;
 
 static const blocktype *
 node_type(context_t context, const char * name)
 {
   xml_context * ctx = (xml_context*)context;
-  xmlNodePtr parent = ctx->previous;
   const blocktype * type = ctx->blocktypes;
-  const blocktype * ptype = parent?(const blocktype *)parent->_private:NULL;
+  const blocktype * ptype = ctx->previous;
 
   if (ptype) type = find_type_rel(name, ptype);
   if (type==NULL) {
@@ -207,14 +325,62 @@ node_type(context_t context, const char * name)
   return type;
 }
 
+static size_t
+pool_add(xml_context * ctx, const char * str)
+{
+  size_t len = strlen(str)+1, offset = ctx->poolsize;
+  if (ctx->poolsize+len > ctx->maxpool) {
+    while (ctx->poolsize+len > ctx->maxpool) ctx->maxpool = ctx->maxpool ? ctx->maxpool*2 : 4096;
+    ctx->pool = realloc(ctx->pool, ctx->maxpool);
+  }
+  memcpy(ctx->pool+offset, str, len);
+  ctx->poolsize += len;
+  return offset;
+}
+
+static void
+add_item(xml_context * ctx, int kind, const char * name, const char * value)
+{
+  xml_item * item;
+  if (ctx->nitems==ctx->maxitems) {
+    ctx->maxitems = ctx->maxitems ? ctx->maxitems*2 : 64;
+    ctx->items = realloc(ctx->items, ctx->maxitems*sizeof(xml_item));
+  }
+  item = ctx->items + ctx->nitems++;
+  item->kind = kind;
+  item->name = name ? pool_add(ctx, name) : 0;
+  item->value = value ? pool_add(ctx, value) : 0;
+}
+
+/* setting an attribute twice replaces the value, as xmlSetProp did */
+static void
+set_attribute(xml_context * ctx, const char * name, const char * value)
+{
+  int i;
+  for (i=0;i!=ctx->nitems;++i) {
+    xml_item * item = ctx->items+i;
+    if (item->kind==ITEM_ATTRIBUTE && !strcmp(ctx->pool+item->name, name)) {
+      item->value = pool_add(ctx, value);
+      return;
+    }
+  }
+  add_item(ctx, ITEM_ATTRIBUTE, name, value);
+}
+
+static void
+begin_block(xml_context * ctx, const char * name, int compact)
+{
+  ctx->type = node_type((context_t)ctx, name);
+  ctx->element = compact ? element_name(ctx->type) : "block";
+  ctx->nitems = 0;
+  ctx->poolsize = 0;
+}
+
 static block_t
 create_compact_block(context_t context, const char * name, const int * ids, size_t size)
 {
-  xmlChar * bname = xml_block(name);
-  xmlNodePtr node = xmlNewNode(NULL, bname);
-  free(bname);
-
-  node->_private = (void*)node_type(context, name);
+  xml_context * ctx = (xml_context*)context;
+  begin_block(ctx, name, 1);
 
   if (size>0) {
     char * cids = malloc(13*size);
@@ -227,32 +393,30 @@ create_compact_block(context_t context, const char * name, const int * ids, size
         *p++ = ' ';
       }
     }
-    xmlSetProp(node, BAD_CAST "id", BAD_CAST cids);
+    set_attribute(ctx, "id", cids);
     free(cids);
   }
 
-  return (block_t)node;
+  return (block_t)ctx;
 }
 
 static block_t
 create_block(context_t context, const char * name, const int * ids, size_t size)
 {
-  xmlNodePtr node = xmlNewNode(NULL, "block");
-  xmlChar * cname = (xmlChar *)to_utf8(name);
-  node->_private = (void*)node_type(context, name);
+  xml_context * ctx = (xml_context*)context;
+  begin_block(ctx, name, 0);
 
   if (size>0) {
     int i;
     for (i=0;i!=size;++i) {
       char zText[12];
       sprintf(zText, "%d", ids[i]);
-      xmlNewTextChild(node, NULL, BAD_CAST "id", BAD_CAST zText);
+      add_item(ctx, ITEM_ID, NULL, zText);
     }
   }
-  xmlSetProp(node, BAD_CAST "name", BAD_CAST cname);
+  set_attribute(ctx, "name", name_utf8(name));
 
-  free(cname);
-  return (block_t)node;
+  return (block_t)ctx;
 }
 
 static void
@@ -261,23 +425,61 @@ destroy_block(context_t context, block_t bt)
   assert(!"didn't think this was used");
 }
 
+/* the block is complete: close what is not its parent, and write it */
 static void
 add_block(context_t context, block_t bt)
 {
   xml_context * ctx = (xml_context*)context;
-  xmlNodePtr parent = ctx->previous;
-  xmlNodePtr node = (xmlNodePtr)bt;
-  if (parent!=NULL) {
-    const blocktype * type = (const blocktype *)node->_private;
-    assert(type);
-    while (parent->_private!=type->parent) {
-      parent = parent->parent;
+  xmlTextWriterPtr w = ctx->writer;
+  const blocktype * type = ctx->type;
+  const char * pool = ctx->pool;
+  int i;
+
+  while (ctx->depth && ctx->stack[ctx->depth-1]!=type->parent) {
+    xmlTextWriterEndElement(w);
+    --ctx->depth;
+  }
+  xmlTextWriterStartElement(w, BAD_CAST ctx->element);
+  for (i=0;i!=ctx->nitems;++i) {
+    const xml_item * item = ctx->items+i;
+    if (item->kind==ITEM_ATTRIBUTE) {
+      xmlTextWriterWriteAttribute(w, BAD_CAST (pool+item->name), BAD_CAST (pool+item->value));
+    }
+  }
+  for (i=0;i!=ctx->nitems;++i) {
+    const xml_item * item = ctx->items+i;
+    switch (item->kind) {
+    case ITEM_ID:
+      xmlTextWriterWriteElement(w, BAD_CAST "id", BAD_CAST (pool+item->value));
+      break;
+    case ITEM_INT:
+    case ITEM_STRING:
+      xmlTextWriterStartElement(w, BAD_CAST (item->kind==ITEM_INT ? "int" : "string"));
+      xmlTextWriterWriteAttribute(w, BAD_CAST "name", BAD_CAST (pool+item->name));
+      xmlTextWriterWriteAttribute(w, BAD_CAST "value", BAD_CAST (pool+item->value));
+      xmlTextWriterEndElement(w);
+      break;
+    case ITEM_ENTRY:
+    case ITEM_LISTINT:
+      xmlTextWriterStartElement(w, BAD_CAST (item->kind==ITEM_ENTRY ? "entry" : "int"));
+      xmlTextWriterWriteAttribute(w, BAD_CAST "value", BAD_CAST (pool+item->value));
+      xmlTextWriterEndElement(w);
+      break;
+    case ITEM_LIST:
+      xmlTextWriterStartElement(w, BAD_CAST "list");
+      xmlTextWriterWriteAttribute(w, BAD_CAST "name", BAD_CAST (pool+item->name));
+      break;
+    case ITEM_ENDLIST:
+      xmlTextWriterEndElement(w);
+      break;
     }
-    xmlAddChild(parent, node);
-  } else {
-    xmlDocSetRootElement(ctx->doc, node);
   }
-  ctx->previous = node;
+  if (ctx->depth==ctx->maxdepth) {
+    ctx->maxdepth = ctx->maxdepth ? ctx->maxdepth*2 : 16;
+    ctx->stack = realloc(ctx->stack, ctx->maxdepth*sizeof(blocktype*));
+  }
+  ctx->stack[ctx->depth++] = type;
+  ctx->previous = type;
 }
 
 static block_t
@@ -297,85 +499,58 @@ static report_interface xml_ireport = {
 static void
 compact_set_int(context_t context, block_t bt, const char *name, int i)
 {
-  xmlNodePtr node = (xmlNodePtr)bt;
   char value[12];
-  char * cname = to_utf8(name);
 
+  if (!bt) return;
   sprintf(value, "%d", i);
-  xmlSetProp(node, BAD_CAST cname, value);
-  free(cname);
+  set_attribute((xml_context*)context, name_utf8(name), value);
 }
 
 static void
 block_set_int(context_t context, block_t bt, const char *name, int i)
 {
-  xmlNodePtr node = (xmlNodePtr)bt;
-  xmlNodePtr param = xmlAddChild(node, xmlNewNode(0, BAD_CAST "int"));
   char value[12];
-  xmlChar* cname = (xmlChar*)to_utf8(name);
 
+  if (!bt) return;
   sprintf(value, "%d", i);
-  xmlSetProp(param, BAD_CAST "name", cname);
-  xmlSetProp(param, BAD_CAST "value", BAD_CAST value);
-  free(cname);
+  add_item((xml_context*)context, ITEM_INT, name_utf8(name), value);
 }
 
 static void
 block_set_ints(context_t context, block_t bt, const char *name, const int * ip, size_t size)
 {
-  xmlNodePtr node = (xmlNodePtr)bt;
-  xmlNodePtr param = xmlAddChild(node, xmlNewNode(0, BAD_CAST "list"));
+  xml_context * ctx = (xml_context*)context;
   char value[12];
-  xmlChar* cname = (xmlChar*)to_utf8(name);
   int i;
 
-  xmlSetProp(param, BAD_CAST "name", cname);
+  if (!bt) return;
+  add_item(ctx, ITEM_LIST, name_utf8(name), NULL);
   for (i=0;i!=size;++i) {
-    xmlNodePtr iparam = xmlAddChild(param, xmlNewNode(0, BAD_CAST "int"));
     sprintf(value, "%d", ip[i]);
-    xmlSetProp(iparam, BAD_CAST "value", BAD_CAST value);
+    add_item(ctx, ITEM_LISTINT, NULL, value);
   }
-  free(cname);
+  add_item(ctx, ITEM_ENDLIST, NULL, NULL);
 }
 
 static void
 block_set_string(context_t context, block_t bt, const char * name, const char * value)
 {
-  xmlNodePtr node = (xmlNodePtr)bt;
-  xmlNodePtr param = xmlAddChild(node, xmlNewNode(0, BAD_CAST "string"));
-
-  xmlChar * cname = (xmlChar *)to_utf8(name);
-  xmlChar * cvalue = (xmlChar *)to_utf8(value);
-
-  xmlSetProp(param, BAD_CAST "name", BAD_CAST cname);
-  xmlSetProp(param, BAD_CAST "value", BAD_CAST cvalue);
-
-  free(cname);
-  free(cvalue);
+  if (!bt) return;
+  add_item((xml_context*)context, ITEM_STRING, name_utf8(name), value_utf8(value));
 }
 
 static void
 complex_set_string(context_t context, block_t bt, const char * name, const char * value)
 {
-  xmlNodePtr node = (xmlNodePtr)bt;
-  char * cname = to_utf8(name);
-  char * cvalue = to_utf8(value);
-
-  xmlSetProp(node, BAD_CAST cname, BAD_CAST cvalue);
-
-  free(cname);
-  free(cvalue);
+  if (!bt) return;
+  set_attribute((xml_context*)context, name_utf8(name), value_utf8(value));
 }
 
 static void
 block_set_entry(context_t context, block_t bt, const char * value)
 {
-  xmlNodePtr node = (xmlNodePtr)bt;
-  xmlNodePtr param = xmlAddChild(node, xmlNewNode(0, BAD_CAST "entry"));
-  xmlChar* cvalue = (xmlChar*)to_utf8(value);
-
-  xmlSetProp(param, BAD_CAST "value", cvalue);
-  free(cvalue);
+  if (!bt) return;
+  add_item((xml_context*)context, ITEM_ENTRY, NULL, value_utf8(value));
 }
 
 block_interface xml_iblock = {
@@ -394,9 +569,7 @@ main(int argc, char ** argv)
   parse_info * parser = calloc(1, sizeof(parse_info));
 
   xml_context context;
-  context.blocktypes = NULL;
-  context.doc = xmlNewDoc("1.0");
-  context.previous = NULL;
+  memset(&context, 0, sizeof(context));
 
   parser->iblock = &xml_iblock;
   parser->ireport = &xml_ireport;
@@ -441,14 +614,29 @@ main(int argc, char ** argv)
     if (verbose) fprintf(stderr, "reading from stdin\n");
     f = stdin;
   }
+  if (outfile!=NULL) context.writer = xmlNewTextWriterFilename(outfile, 0);
+  else context.writer = xmlNewTextWriter(xmlOutputBufferCreateFile(stdout, NULL));
+  if (context.writer==NULL) {
+    fprintf(stderr, "cannot write to %s\n", outfile ? outfile : "stdout");
+    return -1;
+  }
+  xmlTextWriterSetIndent(context.writer, 1);
+  xmlTextWriterSetIndentString(context.writer, BAD_CAST "  ");
+  xmlTextWriterStartDocument(context.writer, NULL, NULL, NULL);
+
   parser->bcontext = (context_t)&context;
   {
     cr_parse(parser, f);
   }
   if (f!=stdin) fclose(f);
 
-  xmlSaveFormatFile(outfile, context.doc, 1);
+  xmlTextWriterEndDocument(context.writer);
+  xmlFreeTextWriter(context.writer);
+  free(context.items);
+  free(context.pool);
+  free(context.stack);
 
+  value_utf8(NULL);
   to_utf8(NULL);
   from_utf8(NULL);
   return 0;
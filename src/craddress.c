@@ -24,33 +24,108 @@
 #include <string.h>
 
 FILE * out;
+static parse_info * parser;
+static int readall = 0; /* parse the whole report, not just up to its regions */
 
-enum { NONE, ADDRESS, FACTION } mode;
+enum { NONE, REPORT, ADDRESS, FACTION } mode;
 char * name;
 char * email;
 char * banner;
+static int id;   /* of the faction the address belongs to, or -1 */
+static int turn; /* of the address */
+static int report_turn;
+
+/** the addresses of all reports, one for each faction. if a faction is
+ * in more than one report, as its PARTEI or as an ADRESSE in another
+ * faction's report, the address from the latest turn is kept. addresses
+ * in ADRESSEN blocks come without a faction id and are told apart by
+ * their email.
+ */
+typedef struct address {
+  struct address * next;     /* in the order they were found */
+  struct address * nexthash;
+  int id, turn;
+  char * name, * email, * banner;
+} address;
+
+#define AMAXHASH 1023
+static address * addresses[AMAXHASH];
+static address * first;
+static address ** last = &first;
+
+static unsigned int
+hash_address(int id, const char * email)
+{
+  unsigned int key = (unsigned int)id;
+  if (id<0) {
+    key = 0;
+    while (*email) key = key * 31 + (unsigned char)*email++;
+  }
+  return key % AMAXHASH;
+}
+
+static void
+add_address(void)
+{
+  address ** ap = &addresses[hash_address(id, email)];
+  address * a;
+  while (*ap && ((*ap)->id!=id || (id<0 && strcmp((*ap)->email, email)))) ap = &(*ap)->nexthash;
+  a = *ap;
+  if (a==NULL) {
+    a = *ap = calloc(1, sizeof(address));
+    a->id = id;
+    *last = a;
+    last = &a->next;
+  }
+  else if (a->turn>turn) return;
+  else {
+    free(a->name);
+    free(a->email);
+    free(a->banner);
+  }
+  a->turn = turn;
+  a->name = name;
+  a->email = email;
+  a->banner = banner;
+  name = email = banner = NULL;
+}
 
 void
 printline()
 {
-  if (name && email)
-    fprintf(out, "\"%s\";\"[eressea]\";\"%s\";\"%s\";\n", name, email, banner?banner:"");
+  if (name && email) add_address();
   if (name) { free(name); name=NULL; }
   if (email) { free(email); email=NULL; }
   if (banner) { free(banner); banner=NULL; }
 }
 
+static void
+write_addresses(void)
+{
+  address * a;
+  fputs("Vorname;Nachname;E-Mail-Adresse;Kommentare;\n", out);
+  for (a=first;a;a=a->next) {
+    fprintf(out, "\"%s\";\"[eressea]\";\"%s\";\"%s\";\n", a->name, a->email, a->banner?a->banner:"");
+  }
+}
+
 block_t
 create_block(context_t ct, const char * name, const int * ids, size_t size)
 {
   unused(ct);
-  unused(size);
-  unused(ids);
-  if (!stricmp(name, "PARTEI")) mode = FACTION;
-  else if (!stricmp(name, "ADRESSEN")) mode = ADDRESS;
-  else mode = NONE;
   if (name || email || banner)
     printline();
+  /* ADRESSE is the address of another faction, and has its id like
+   * PARTEI. only the old ADRESSEN blocks come without one. */
+  if (!stricmp(name, "PARTEI") || !stricmp(name, "ADRESSE")) mode = FACTION;
+  else if (!stricmp(name, "ADRESSEN")) mode = ADDRESS;
+  else if (!stricmp(name, "VERSION")) mode = REPORT;
+  else mode = NONE;
+  /* Eressea writes the factions and their addresses before the first
+   * region, so the rest of the report can be skipped. */
+  if (!readall && !stricmp(name, "REGION")) parser->stop = 1;
+  id = (mode==FACTION && size)?ids[0]:-1;
+  turn = report_turn;
 
   return NULL;
 }
@@ -62,6 +137,16 @@ const report_interface merge_ireport = {
   NULL
 };
 
+void
+block_set_int(context_t ct, block_t bt, const char * tag, int i) {
+  unused(bt);
+  unused(ct);
+  if (!stricmp(tag, "runde")) {
+    if (mode==REPORT) report_turn = i;
+    else if (mode==FACTION) turn = i;
+  }
+}
+
 void
 block_set_string(context_t ct, block_t bt, const char * tag, const char *cp) {
   unused(bt);
@@ -81,7 +166,7 @@ block_set_string(context_t ct, block_t bt, const char * tag, const char *cp) {
 }
 
 const block_interface merge_iblock = {
-  NULL,
+  block_set_int,
   NULL,
   block_set_string,
   NULL,
@@ -95,13 +180,14 @@ const block_interface merge_iblock = {
 int
 usage(const char * name, const char* message)
 {
-  fprintf(stderr, "usage: %s [options] [infile]\n", name);
+  fprintf(stderr, "usage: %s [options] [infiles]\n", name);
   fprintf(stderr, "options:\n"
     " -h       display this information\n"
     " -V       print version information\n"
+    " -a       read all of a report, not just up to the first region\n"
     " -o file  write output to file (default is stdout)\n"
-    "infile:\n"
-    "          a cr-file. if none specified, read from stdin\n");
+    "infiles:\n"
+    " one or more cr-files. if none specified, read from stdin\n");
   if (message) fprintf(stderr, "\nERROR: %s\n", message);
   return -1;
 }
@@ -109,10 +195,9 @@ usage(const char * name, const char* message)
 int
 main(int argc, char** argv)
 {
-  FILE * in = stdin;
-  int i;
+  int i, files = 0;
   FILE * f;
-  parse_info * parser = calloc(1, sizeof(parse_info));
+  parser = calloc(1, sizeof(parse_info));
 
   parser->iblock=&merge_iblock;
   parser->ireport=&merge_ireport;
@@ -127,6 +212,9 @@ main(int argc, char** argv)
         break;
       case 'h' :
         return usage(argv[0], 0);
+      case 'a' :
+        readall = 1;
+        break;
       case 'o' :
         f = fopen(argv[++i], "wt");
         if (!f) perror(argv[i]);
@@ -138,14 +226,21 @@ main(int argc, char** argv)
     }
   }
   else {
+    ++files;
     f = fopen(argv[i], "rt");
     if (!f) perror(argv[i]);
     else {
-      in = f;
+      report_turn = 0;
+      cr_parse(parser, f);
+      printline();
+      fclose(f);
     };
   }
   if (!out) usage(argv[0], "cannot open output file");
-  fputs("Vorname;Nachname;E-Mail-Adresse;Kommentare;\n", out);
-  cr_parse(parser, in);
+  if (!files) {
+    cr_parse(parser, stdin);
+    printline();
+  }
+  write_addresses();
   return 0;
 }
@@ -25,11 +25,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int movex, movey;
+/* number of blocks that may wait for a writer thread: */
+#define CUTQUEUE 256
 
 int
 x_distance(int x1, int y1, int x2, int y2)
@@ -86,29 +88,314 @@ read_cr(parse_info * parser, const char * filename)
   cr_parse(parser, in);
 }
 
-int x=0, y=0, w=0, h=0;
+/** one region window that is written to its own output file.
+ * the window is a (w,h) rectangle in the skewed coordinates used by
+ * x_distance and y_distance, with the lower left corner at (x,y).
+ */
+typedef struct cut {
+  struct cut * next;
+  char * name;
+  int x, y, w, h;
+  int movex, movey;
+  FILE * out;
+  int error; /* errno of a failed write, 0 if the cut was written */
 
-void
-write_filtered(crdata * data, FILE * out, block * b)
-{
-  static void (*inherit_write)(crdata *, FILE *, block *) = NULL;
+  /* blocks waiting to be written by this cut's writer thread: */
+  struct chunk * queue[CUTQUEUE];
+  unsigned int head, tail;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+  pthread_t thread;
+} cut;
 
-  if (!inherit_write) {
-    inherit_write = cr_write;
-    cr_write=write_filtered;
-  }
+/** a serialized top-level block, shared by all cuts that contain it.
+ * for regions, the header line is rewritten by each writer, so the
+ * block itself is only formatted once no matter how many cuts it is in.
+ */
+typedef struct chunk {
+  char * data;
+  size_t size;
+  size_t body; /* offset of the first line after the block header */
+  const block * region; /* NULL if this is not a REGION block */
+  int refs;
+} chunk;
 
-  if (!strcmp(b->type->name, "REGION")) {
-    int p;
-    if ((p = x_distance(x, y, b->ids[0], b->ids[1]))>=w || p<0) return;
-    if ((p = y_distance(x, y, b->ids[0], b->ids[1]))>=h || p<0) return;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+cut_contains(const cut * c, const block * b)
+{
+  int p;
+  if (b->size<2) return 0;
+  if ((p = x_distance(c->x, c->y, b->ids[0], b->ids[1]))>=c->w || p<0) return 0;
+  if ((p = y_distance(c->x, c->y, b->ids[0], b->ids[1]))>=c->h || p<0) return 0;
 #if 0
-    if (koor_distance(x, y, b->ids[0], b->ids[1])>r) return;
+  if (koor_distance(x, y, b->ids[0], b->ids[1])>r) return 0;
 #endif
-    b->ids[0]+=movex;
-    b->ids[1]+=movey;
+  return 1;
+}
+
+static void
+cut_radius(cut * c, int r)
+{
+  c->x-=(r+1)/2;
+  c->y-=(r+1)/2;
+  c->w = c->h = r*2+1;
+}
+
+static cut *
+cut_add(cut ** cuts, const char * name, FILE * out)
+{
+  cut * c = (cut *)calloc(1, sizeof(cut));
+  c->name = strdup(name);
+  c->out = out;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->filled, NULL);
+  pthread_cond_init(&c->drained, NULL);
+  while (*cuts) cuts = &(*cuts)->next;
+  return *cuts = c;
+}
+
+/** cut list format, one cut per line:
+ *   name d x y w h movex movey outfile
+ *   name r x y radius movex movey outfile
+ * empty lines and lines starting with # or ; are ignored.
+ */
+static int
+read_cuts(FILE * in, cut ** cuts)
+{
+  char buf[1024];
+  int line = 0, count = 0;
+
+  while (fgets(buf, sizeof(buf), in)) {
+    char name[256], shape[16], filename[512];
+    int a, b, c, d, mx, my;
+    cut * ct;
+    FILE * out;
+
+    ++line;
+    if (sscanf(buf, " %255s", name)!=1 || name[0]=='#' || name[0]==';') continue;
+    if (sscanf(buf, "%255s %15s %d %d %d %d %d %d %511s", name, shape, &a, &b, &c, &d, &mx, &my, filename)==9 && !strcmp(shape, "d")) {
+      /* rectangle */
+    }
+    else if (sscanf(buf, "%255s %15s %d %d %d %d %d %511s", name, shape, &a, &b, &c, &mx, &my, filename)==8 && !strcmp(shape, "r")) {
+      d = 0;
+    }
+    else {
+      fprintf(stderr, "cut list line %d: syntax error\n", line);
+      continue;
+    }
+    out = fopen(filename, "wt");
+    if (!out) {
+      perror(filename);
+      continue;
+    }
+    ct = cut_add(cuts, name, out);
+    ct->x = a;
+    ct->y = b;
+    if (shape[0]=='r') cut_radius(ct, c);
+    else {
+      ct->w = c;
+      ct->h = d;
+    }
+    ct->movex = mx;
+    ct->movey = my;
+    ++count;
+  }
+  return count;
+}
+
+static void
+chunk_release(chunk * ch)
+{
+  int refs;
+  pthread_mutex_lock(&chunk_lock);
+  refs = --ch->refs;
+  pthread_mutex_unlock(&chunk_lock);
+  if (refs==0) {
+    free(ch->data);
+    free(ch);
   }
-  inherit_write(data, out, b);
+}
+
+static void
+cut_push(cut * c, chunk * ch)
+{
+  pthread_mutex_lock(&c->lock);
+  while (c->tail-c->head==CUTQUEUE) pthread_cond_wait(&c->drained, &c->lock);
+  c->queue[c->tail++ % CUTQUEUE] = ch;
+  pthread_cond_signal(&c->filled);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static chunk *
+cut_pop(cut * c)
+{
+  chunk * ch;
+  pthread_mutex_lock(&c->lock);
+  while (c->tail==c->head) pthread_cond_wait(&c->filled, &c->lock);
+  ch = c->queue[c->head++ % CUTQUEUE];
+  pthread_cond_signal(&c->drained);
+  pthread_mutex_unlock(&c->lock);
+  return ch;
+}
+
+/** writer thread: copies the chunks of one cut to its output file.
+ * a NULL chunk marks the end of the report.
+ */
+static void *
+cut_writer(void * arg)
+{
+  cut * c = (cut *)arg;
+  chunk * ch;
+
+  while ((ch = cut_pop(c))!=NULL) {
+    if (ch->region) {
+      const block * b = ch->region;
+      unsigned int i;
+      fprintf(c->out, "%s %d %d", b->type->name, b->ids[0]+c->movex, b->ids[1]+c->movey);
+      for (i=2;i<b->size;++i) fprintf(c->out, " %d", b->ids[i]);
+      fputc('\n', c->out);
+      fwrite(ch->data+ch->body, 1, ch->size-ch->body, c->out);
+    }
+    else fwrite(ch->data, 1, ch->size, c->out);
+    chunk_release(ch);
+  }
+  /* the output is closed here, so errors that only show up when the
+   * buffers are written out are not lost */
+  if (c->out==stdout) {
+    if (fflush(c->out) || ferror(c->out)) c->error = errno ? errno : EIO;
+  }
+  else if (ferror(c->out) | fclose(c->out)) c->error = errno ? errno : EIO;
+  c->out = NULL;
+  return NULL;
+}
+
+/** state of the single pass that feeds the writer threads.
+ * blocks outside of regions are collected in a common chunk that
+ * goes to every cut, each region gets a chunk of its own.
+ */
+typedef struct splitter {
+  crdata * data;
+  cut * cuts;
+  int ncuts;
+  const blocktype * rtype;
+  chunk * common;
+  FILE * stream;
+} splitter;
+
+static FILE *
+split_stream(splitter * sp)
+{
+  if (!sp->stream) {
+    sp->common = (chunk *)calloc(1, sizeof(chunk));
+    sp->stream = open_memstream(&sp->common->data, &sp->common->size);
+  }
+  return sp->stream;
+}
+
+static void
+split_flush(splitter * sp)
+{
+  cut * c;
+  if (!sp->stream) return;
+  fclose(sp->stream);
+  sp->stream = NULL;
+  if (sp->common->size==0) {
+    free(sp->common->data);
+    free(sp->common);
+  } else {
+    sp->common->refs = sp->ncuts;
+    for (c=sp->cuts;c;c=c->next) cut_push(c, sp->common);
+  }
+  sp->common = NULL;
+}
+
+static void
+split_region(splitter * sp, block * b)
+{
+  chunk * ch;
+  FILE * mem;
+  char * eol;
+  cut * c;
+  int refs = 0;
+
+  for (c=sp->cuts;c;c=c->next) if (cut_contains(c, b)) ++refs;
+  if (refs==0) return;
+
+  split_flush(sp);
+  ch = (chunk *)calloc(1, sizeof(chunk));
+  mem = open_memstream(&ch->data, &ch->size);
+  cr_write(sp->data, mem, b);
+  fclose(mem);
+  eol = memchr(ch->data, '\n', ch->size);
+  ch->body = eol?(size_t)(eol-ch->data)+1:ch->size;
+  ch->region = b;
+  ch->refs = refs;
+  for (c=sp->cuts;c;c=c->next) {
+    if (cut_contains(c, b)) cut_push(c, ch);
+  }
+}
+
+static void
+split_block(splitter * sp, block * b)
+{
+  const blocktype * t;
+
+  if (b->type==sp->rtype) {
+    split_region(sp, b);
+    return;
+  }
+  for (t=sp->rtype;t;t=t->parent) if (t==b->type) break;
+  if (t) {
+    /* regions are somewhere below this block, write it without
+     * children and look at each child on its own */
+    block * children = b->children;
+    if (b->type->flags&PARENTAGE && b->parent && b->turn!=b->parent->turn) return;
+    b->children = NULL;
+    cr_write(sp->data, split_stream(sp), b);
+    b->children = children;
+    for (b=children;b;b=b->next) split_block(sp, b);
+  }
+  else cr_write(sp->data, split_stream(sp), b);
+}
+
+/** writes all cuts from a single pass over the parsed report.
+ * every block is serialized at most once, and handed to the writer
+ * threads of all cuts that contain it.
+ */
+static int
+write_cuts(crdata * data, cut * cuts)
+{
+  int result = 0;
+  splitter sp;
+  cut * c;
+  block * b;
+
+  memset(&sp, 0, sizeof(sp));
+  sp.data = data;
+  sp.cuts = cuts;
+  sp.rtype = find_type("REGION", data->blocktypes);
+  for (c=cuts;c;c=c->next) {
+    pthread_create(&c->thread, NULL, cut_writer, c);
+    ++sp.ncuts;
+  }
+  for (b=data->blocks;b;b=b->next) {
+    if (sp.rtype) split_block(&sp, b);
+    else cr_write(data, split_stream(&sp), b);
+  }
+  split_flush(&sp);
+  for (c=cuts;c;c=c->next) cut_push(c, NULL);
+  for (c=cuts;c;c=c->next) {
+    pthread_join(c->thread, NULL);
+    if (c->error) {
+      fprintf(stderr, "cut %s: %s\n", c->name, strerror(c->error));
+      result = -1;
+    }
+    else if (verbose) fprintf(stderr, "wrote cut %s\n", c->name);
+  }
+  return result;
 }
 
 int
@@ -123,6 +410,10 @@ usage(const char * name)
     " -r n       specify radius\n"
     " -c x y     specify center\n"
     " -d l d w h specify dimensions (left/down/width/height)\n"
+    " -m x y     add (x,y) to all coordinates (move)\n"
+    " -f file    read a list of cuts from file, one per line:\n"
+    "              name d l d w h movex movey outfile\n"
+    "              name r x y radius movex movey outfile\n"
     "infiles:\n"
     " one or more cr-files. if none specified, read from stdin\n");
   return -1;
@@ -135,11 +426,14 @@ main(int argc, char ** argv)
   FILE * out = stdout;
   FILE * hierarchy = NULL;
   int i, r = 0;
-  block * b;
+  int x = 0, y = 0, w = 0, h = 0, movex = 0, movey = 0;
+  cut * cuts = NULL;
+  const char * cutfile = NULL;
   crdata * data = NULL;
   parse_info * parser = calloc(1, sizeof(parse_info));
   parser->ireport = &crdata_ireport;
   parser->iblock = &crdata_iblock;
+  parser->snapshot = crdata_parse_snapshot;
 
   for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
     switch(argv[i][1]) {
@@ -163,6 +457,15 @@ main(int argc, char ** argv)
     case 'r' :
       r = atoi(argv[++i]);
       break;
+    case 'f' :
+      cutfile = argv[++i];
+      f = fopen(cutfile, "rt");
+      if (!f) perror(cutfile);
+      else {
+        read_cuts(f, &cuts);
+        fclose(f);
+      }
+      break;
     case 'H':
       f = fopen(argv[++i], "rt+");
       if (!f) perror(argv[i]);
@@ -196,6 +499,11 @@ main(int argc, char ** argv)
     data->parser = parser;
     read_cr(parser, argv[i]);
   }
+  if (cutfile && cuts==NULL) {
+    /* not the default cut to stdout, a script would not notice */
+    fprintf(stderr, "%s: no cuts\n", cutfile);
+    return -1;
+  }
   if (parser->bcontext==NULL) {
     if (verbose) fprintf(stderr, "reading from stdin\n");
     data = crdata_init(hierarchy);
@@ -204,16 +512,19 @@ main(int argc, char ** argv)
     data->parser = parser;
     cr_parse(parser, stdin);
   }
-  if (r) {
-    x-=(r+1)/2;
-    y-=(r+1)/2;
-    w = h = r*2+1;
+  if (cuts==NULL) {
+    /* no cut list, the command line describes a single cut */
+    cut * c = cut_add(&cuts, "default", out);
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    if (r) cut_radius(c, r);
+    c->movex = movex;
+    c->movey = movey;
   }
   if (data) {
     if (verbose) fprintf(stderr, "writing\n");
-    for (b=data->blocks;b;b=b->next) {
-      write_filtered(data, out, b);
-    }
+    return write_cuts(data, cuts);
   } else return usage(argv[0]);
-  return 0;
 }
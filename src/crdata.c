@@ -20,6 +20,7 @@
 #include "config.h"
 #include "crdata.h"
 #include "hierarchy.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -95,11 +96,13 @@ hashblock(crdata * data, blocktype * type, const int * blockids, size_t size)
     key = ((key >> 31) & 1) ^ (key << 1) ^ hashkey;
     type = type->parent;
   }
+  /* coordinates are small numbers, and would fill only a few buckets if
+   * they were not spread over the whole key */
   while (i) {
     --i;
-    key = ((key >> 31) & 1) ^ (key << 1) ^ ids[i];
+    key = (key ^ (unsigned int)ids[i]) * 2654435761U;
   }
-  return key & KEYMASK;
+  return (key ^ (key >> 16)) & KEYMASK;
 }
 
 /** returns a block of type 'name' if such a type exists.
@@ -460,7 +463,11 @@ add_block(context_t context, block_t bt)
         else if (nb->turn>father->turn) {
           father->turn = nb->turn;
         }
-        b = findblock(data, father->children, nb->type, nb->ids, nb->size);
+        if (nb->size) b = findblock(data, father->children, nb->type, nb->ids, nb->size);
+        else {
+          /* blocks without ids are told apart by their parent alone */
+          for (b=father->children;b && b->type!=nb->type;b=b->next);
+        }
         break;
       }
       father = father->parent;
@@ -588,23 +595,31 @@ add_block(context_t context, block_t bt)
     assert(lb);
     list = *lb;
     if (list) {
-      unsigned int i = cpos;
-      for (;;) {
-        if (bcache[i].list==*lb && bcache[i].btype==nb->type) {
-          lb = bcache[i].end;
-          cpos = i;
-          break;
+      block * last = nb->type->blocks;
+      if (last && last->parent==nb->parent) {
+        /* the newest block of this type is in the same list, at or near
+         * the end of its run. this needs no search, even when the cache
+         * has lost the list because it has too many siblings with children */
+        lb = &last->next;
+      } else {
+        unsigned int i = cpos;
+        for (;;) {
+          if (bcache[i].list==*lb && bcache[i].btype==nb->type) {
+            lb = bcache[i].end;
+            cpos = i;
+            break;
+          }
+          i = (i+1) % BMAX;
+          if (i==cpos) {
+            cpos=(cpos+1) % BMAX;
+            break;
+          }
         }
-        i = (i+1) % BMAX;
-        if (i==cpos) {
-          cpos=(cpos+1) % BMAX;
-          break;
+        while (*lb) {
+          if ((*lb)->type==nb->type) break;
+          lb = &(*lb)->next;
         }
       }
-      while (*lb) {
-        if ((*lb)->type==nb->type) break;
-        lb = &(*lb)->next;
-      }
       while (*lb && (*lb)->type==nb->type) lb = &(*lb)->next;
     }
     bhash(data, nb);
@@ -627,7 +642,7 @@ const report_interface crdata_ireport = {
 };
 
 static int
-block_get(context_t context, block_t bt, int type, const char * tag, const void ** data)
+block_get(context_t context, block_t bt, int type, const char * tag, const entry ** ep)
 {
   block * b =(block*)bt;
   entry * e = b->entries;
@@ -636,23 +651,27 @@ block_get(context_t context, block_t bt, int type, const char * tag, const void
   while (e && e->tag!=p) e = e->next;
   if (!e) return CR_NOENTRY;
   if (e->type!=type) return CR_ILLEGALTYPE;
-  *data = e->data.vp;
+  *ep = e;
   return CR_SUCCESS;
 }
 
 static int
 block_get_int(context_t context, block_t b, const char * key, int *i)
 {
-  return block_get(context, b, INT, key, (const void**)i);
+  const entry * e;
+  int rv = block_get(context, b, INT, key, &e);
+  if (rv==CR_SUCCESS) *i = e->data.i;
+  return rv;
 }
 
 static int
 block_get_ints(context_t context, block_t b, const char * key, const int ** ip, size_t * size)
 {
-  int rv = block_get(context, b, INTS, key, (const void**)ip);
+  const entry * e;
+  int rv = block_get(context, b, INTS, key, &e);
   if (rv==CR_SUCCESS) {
-    *size = (*ip)[0];
-    *ip = &(*ip)[1];
+    *size = e->data.ip[0];
+    *ip = &e->data.ip[1];
   }
   return rv;
 }
@@ -660,7 +679,10 @@ block_get_ints(context_t context, block_t b, const char * key, const int ** ip,
 static int
 block_get_string(context_t context, block_t b, const char * key, const char ** cp)
 {
-  return block_get(context, b, STRING, key, (const void**)cp);
+  const entry * e;
+  int rv = block_get(context, b, STRING, key, &e);
+  if (rv==CR_SUCCESS) *cp = e->data.cp;
+  return rv;
 }
 
 static block_t
@@ -757,6 +779,325 @@ cr_writeblock(crdata * data, FILE * out, block * b)
   for (b=b->children;b;b=b->next) cr_write(data, out, b);
 }
 
+/** a snapshot is built in memory, one growing buffer per section, and
+ * written when it is complete. types and properties are found by their
+ * address in a small hash table.
+ */
+typedef struct snap_writer {
+  char * data[SNAP_SECTIONS];
+  size_t size[SNAP_SECTIONS], maxsize[SNAP_SECTIONS];
+  const void ** keys;
+  int * values;
+  size_t mask;
+} snap_writer;
+
+static size_t
+snap_add(snap_writer * w, int section, const void * data, size_t size)
+{
+  size_t pos = w->size[section];
+  if (pos+size > w->maxsize[section]) {
+    while (pos+size > w->maxsize[section]) {
+      w->maxsize[section] = w->maxsize[section] ? w->maxsize[section]*2 : 4096;
+    }
+    w->data[section] = realloc(w->data[section], w->maxsize[section]);
+  }
+  if (data) memcpy(w->data[section]+pos, data, size);
+  else memset(w->data[section]+pos, 0, size);
+  w->size[section] += size;
+  return pos;
+}
+
+static int
+snap_string(snap_writer * w, const char * str)
+{
+  return (int)snap_add(w, SNAP_STRINGS, str, strlen(str)+1);
+}
+
+static int *
+snap_slot(snap_writer * w, const void * key)
+{
+  size_t i = ((size_t)key >> 3) * 2654435761U & w->mask;
+  while (w->keys[i] && w->keys[i]!=key) i = (i+1) & w->mask;
+  w->keys[i] = key;
+  return w->values+i;
+}
+
+static void
+snap_types(snap_writer * w, const blocktype * t, int parent)
+{
+  for (;t;t=t->next) {
+    snap_type st;
+    st.name = snap_string(w, t->name);
+    st.parent = parent;
+    st.unique = t->unique ? *snap_slot(w, t->unique) : -1;
+    st.flags = t->flags;
+    *snap_slot(w, t) = (int)(w->size[SNAP_TYPES] / sizeof(snap_type));
+    snap_add(w, SNAP_TYPES, &st, sizeof(st));
+    snap_types(w, t->children, *snap_slot(w, t));
+  }
+}
+
+static size_t
+count_types(const blocktype * t)
+{
+  size_t n = 0;
+  for (;t;t=t->next) n += 1 + count_types(t->children);
+  return n;
+}
+
+#define SNAP_RECORD(w, section, type, i) (((type *)(w)->data[section])+(i))
+
+/* adds the block and its children, returns its index or -1 if it is not
+ * written, with the same rule as cr_writeblock */
+static int
+snap_blocks(snap_writer * w, const block * b, int parent)
+{
+  snap_block sb;
+  const entry * e;
+  const block * child;
+  int index, last = -1;
+
+  if (b->type->flags&PARENTAGE && b->parent && b->turn!=b->parent->turn) return -1;
+  sb.type = *snap_slot(w, b->type);
+  sb.parent = parent;
+  sb.children = sb.next = -1;
+  sb.turn = b->turn;
+  sb.ids = (int)(snap_add(w, SNAP_INTS, b->ids, b->size * sizeof(int)) / sizeof(int));
+  sb.size = (int)b->size;
+  sb.entries = (int)(w->size[SNAP_ENTRIES] / sizeof(snap_entry));
+  sb.nentries = 0;
+  for (e=b->entries;e;e=e->next) {
+    snap_entry se;
+    se.tag = e->tag ? *snap_slot(w, e->tag) : -1;
+    switch (e->type) {
+    case INT:
+      se.type = SNAP_INT;
+      se.value = e->data.i;
+      break;
+    case INTS:
+      se.type = SNAP_INTLIST;
+      se.value = (int)(snap_add(w, SNAP_INTS, e->data.ip, (e->data.ip[0]+1) * sizeof(int)) / sizeof(int));
+      break;
+    case STRING:
+      se.type = SNAP_STRING;
+      se.value = snap_string(w, e->data.cp);
+      break;
+    case MESSAGE:
+      se.type = SNAP_MESSAGE;
+      se.value = snap_string(w, e->data.cp);
+      break;
+    default:
+      continue;
+    }
+    snap_add(w, SNAP_ENTRIES, &se, sizeof(se));
+    ++sb.nentries;
+  }
+  index = (int)(w->size[SNAP_BLOCKS] / sizeof(snap_block));
+  snap_add(w, SNAP_BLOCKS, &sb, sizeof(sb));
+  for (child=b->children;child;child=child->next) {
+    int c = snap_blocks(w, child, index);
+    if (c<0) continue;
+    if (last<0) SNAP_RECORD(w, SNAP_BLOCKS, snap_block, index)->children = c;
+    else SNAP_RECORD(w, SNAP_BLOCKS, snap_block, last)->next = c;
+    last = c;
+  }
+  return index;
+}
+
+int
+crdata_save_snapshot(crdata * data, FILE * out)
+{
+  snap_writer w;
+  snap_header h;
+  const block * b;
+  size_t n, offset;
+  int i, last = -1;
+
+  memset(&w, 0, sizeof(w));
+  n = count_types(data->blocktypes);
+  for (i=0;i!=TMAXHASH;++i) {
+    const property * p;
+    for (p=data->taghash[i];p;p=p->nexthash) ++n;
+  }
+  for (w.mask=64;w.mask<2*n;w.mask*=2);
+  w.keys = (const void **)calloc(w.mask, sizeof(void*));
+  w.values = (int *)malloc(w.mask * sizeof(int));
+  --w.mask;
+
+  snap_types(&w, data->blocktypes, -1);
+  for (i=0;i!=TMAXHASH;++i) {
+    const property * p;
+    for (p=data->taghash[i];p;p=p->nexthash) {
+      int name = snap_string(&w, p->name);
+      *snap_slot(&w, p) = (int)(w.size[SNAP_PROPERTIES] / sizeof(int));
+      snap_add(&w, SNAP_PROPERTIES, &name, sizeof(int));
+    }
+  }
+  for (b=data->blocks;b;b=b->next) {
+    int c = snap_blocks(&w, b, -1);
+    if (c<0) continue;
+    if (last>=0) SNAP_RECORD(&w, SNAP_BLOCKS, snap_block, last)->next = c;
+    last = c;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SNAPSHOT_MAGIC, 8);
+  h.byteorder = SNAPSHOT_BYTEORDER;
+  h.version = SNAPSHOT_VERSION;
+  offset = sizeof(h);
+  for (i=0;i!=SNAP_SECTIONS;++i) {
+    static const size_t record[SNAP_SECTIONS] = {
+      sizeof(snap_type), sizeof(int), sizeof(snap_block), sizeof(snap_entry), sizeof(int), 1
+    };
+    h.offset[i] = (unsigned int)offset;
+    h.count[i] = (unsigned int)(w.size[i] / record[i]);
+    offset += (w.size[i] + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+  }
+  fwrite(&h, sizeof(h), 1, out);
+  for (i=0;i!=SNAP_SECTIONS;++i) {
+    static const char zero[sizeof(int)] = { 0 };
+    if (w.size[i]) fwrite(w.data[i], 1, w.size[i], out);
+    if (w.size[i] % sizeof(int)) fwrite(zero, 1, sizeof(int) - w.size[i] % sizeof(int), out);
+    free(w.data[i]);
+  }
+  free((void*)w.keys);
+  free(w.values);
+  return ferror(out) ? -1 : 0;
+}
+
+/** blocks, entries and strings are made from the records of the snapshot
+ * directly. an empty crdata takes the whole snapshot at once; to merge a
+ * snapshot into existing data, pass it to cr_parse.
+ */
+int
+crdata_load_snapshot(crdata * data, const void * snapshot, size_t size)
+{
+  const snap_header * h = snapshot_check(snapshot, size);
+  const char * base = (const char *)snapshot;
+  const snap_type * stypes;
+  const int * sproperties;
+  const snap_block * sblocks;
+  const snap_entry * sentries;
+  blocktype ** types;
+  property ** properties;
+  block * blocks;
+  int * ints;
+  char * strings;
+  unsigned int i;
+
+  if (!h || data->blocks) return -1;
+  stypes = (const snap_type *)(base + h->offset[SNAP_TYPES]);
+  sproperties = (const int *)(base + h->offset[SNAP_PROPERTIES]);
+  sblocks = (const snap_block *)(base + h->offset[SNAP_BLOCKS]);
+  sentries = (const snap_entry *)(base + h->offset[SNAP_ENTRIES]);
+
+  ints = memcpy(malloc(h->count[SNAP_INTS] * sizeof(int) + 1), base + h->offset[SNAP_INTS], h->count[SNAP_INTS] * sizeof(int));
+#if USE_MULTITHREADING
+  /* entries are freed one by one when they are merged */
+  strings = (char *)base + h->offset[SNAP_STRINGS];
+#else
+  strings = memcpy(malloc(h->count[SNAP_STRINGS] + 1), base + h->offset[SNAP_STRINGS], h->count[SNAP_STRINGS]);
+#endif
+
+  types = (blocktype **)malloc((h->count[SNAP_TYPES] + 1) * sizeof(blocktype*));
+  for (i=0;i!=h->count[SNAP_TYPES];++i) {
+    const snap_type * st = stypes+i;
+    const char * name = strings + st->name;
+    blocktype * t;
+    if (st->parent<0) {
+      for (t=data->blocktypes;t && strcmp(t->name, name);t=t->next);
+      if (!t) {
+        fprintf(stderr, "snapshot has a different hierarchy: %s\n", name);
+        return -1;
+      }
+    } else {
+      blocktype * parent = types[st->parent];
+      for (t=parent->children;t && strcmp(t->name, name);t=t->next);
+      if (!t) t = make_type(name, parent, st->unique>=0 ? types[st->unique] : NULL, st->flags);
+    }
+    t->flags |= st->flags & NOMERGE;
+    types[i] = t;
+  }
+  properties = (property **)malloc((h->count[SNAP_PROPERTIES] + 1) * sizeof(property*));
+  for (i=0;i!=h->count[SNAP_PROPERTIES];++i) {
+    properties[i] = getproperty(data, strings + sproperties[i]);
+  }
+
+  /* blocks are never freed, only merged into, so they can share one array */
+  i = h->count[SNAP_BLOCKS] + 1;
+  blocks = calloc(i, sizeof(block));
+  for (i=0;i!=h->count[SNAP_BLOCKS];++i) {
+    const snap_block * sb = sblocks+i;
+    block * b = blocks+i;
+    entry ** le = &b->entries;
+    int j;
+
+    b->type = types[sb->type];
+    b->turn = sb->turn;
+    b->size = sb->size;
+    b->ids = sb->size ? ints + sb->ids : NULL;
+    b->parent = sb->parent>=0 ? blocks + sb->parent : NULL;
+    b->children = sb->children>=0 ? blocks + sb->children : NULL;
+    b->next = sb->next>=0 ? blocks + sb->next : NULL;
+    for (j=0;j!=sb->nentries;++j) {
+      const snap_entry * se = sentries + sb->entries + j;
+      entry * e = calloc(1, sizeof(entry));
+      e->tag = se->tag>=0 ? properties[se->tag] : NULL;
+      switch (se->type) {
+      case SNAP_INT:
+        e->type = INT;
+        e->data.i = se->value;
+        break;
+      case SNAP_INTLIST:
+        e->type = INTS;
+        e->data.ip = ints + se->value;
+#if USE_MULTITHREADING
+        e->data.ip = memcpy(malloc((ints[se->value]+1) * sizeof(int)), e->data.ip, (ints[se->value]+1) * sizeof(int));
+#endif
+        break;
+      default:
+        e->type = (se->type==SNAP_STRING) ? STRING : MESSAGE;
+        e->data.cp = strings + se->value;
+#if USE_MULTITHREADING
+        e->data.cp = strdup(e->data.cp);
+#endif
+        break;
+      }
+      *le = e;
+      le = &e->next;
+    }
+    bhash(data, b);
+    b->nexttype = b->type->blocks;
+    b->type->blocks = b;
+  }
+  if (h->count[SNAP_BLOCKS]) {
+    data->blocks = blocks;
+    data->current = blocks + h->count[SNAP_BLOCKS] - 1;
+  }
+  free(types);
+  free(properties);
+  return 0;
+}
+
+/* a parse_info::snapshot for parsers that fill a crdata */
+int
+crdata_parse_snapshot(parse_info * info, const void * snapshot, size_t size)
+{
+  if (info->ireport!=&crdata_ireport || info->iblock!=&crdata_iblock) return -1;
+  return crdata_load_snapshot((crdata *)info->bcontext, snapshot, size);
+}
+
+/* nonzero if the charset in the VERSION block of the report says that
+ * its strings are UTF-8. without it, they are latin-1. */
+int
+crdata_utf8(crdata * data)
+{
+  const char * charset = NULL;
+  if (!data->blocks) return 0;
+  block_get_string((context_t)data, (block_t)data->blocks, "charset", &charset);
+  return charset && (!stricmp(charset, "UTF-8") || !stricmp(charset, "UTF8"));
+}
+
 void
 crdata_destroy(crdata * data)
 {
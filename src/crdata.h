@@ -26,7 +26,7 @@ extern "C" {
 #endif
 
 #define TMAXHASH 1023
-#define BMAXHASH 1023
+#define BMAXHASH 65521
 #define KEYMASK 0xFFFF
 #define KEYSIZE 16
 
@@ -94,7 +94,11 @@ typedef struct crdata {
 extern void (*cr_write)(crdata * data, FILE * out, block *b);
 
 extern crdata * crdata_init(FILE * hierarchy);
+extern int crdata_save_snapshot(crdata * data, FILE * out);
+extern int crdata_load_snapshot(crdata * data, const void * snapshot, size_t size);
+extern int crdata_parse_snapshot(parse_info * info, const void * snapshot, size_t size);
 extern void crdata_destroy(struct crdata *);
+extern int crdata_utf8(crdata * data);
 extern const block_interface crdata_iblock;
 extern const report_interface crdata_ireport;
 
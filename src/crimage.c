@@ -20,27 +20,82 @@
 #include "config.h"
 #include "image.h"
 #include "crparse.h"
+#include "islands.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* 64-bit FNV-1a, for recognizing inputs we have seen before */
+typedef unsigned long long digest;
+
+#define DIGEST_INIT 14695981039346656037ULL
+
+static digest
+digest_bytes(digest h, const void * data, size_t size)
+{
+  const unsigned char * p = (const unsigned char *)data;
+  while (size--) {
+    h ^= *p++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static digest
+digest_int(digest h, int i)
+{
+  return digest_bytes(h, &i, sizeof(i));
+}
+
+static digest
+digest_string(digest h, const char * str)
+{
+  return digest_bytes(h, str, str ? strlen(str)+1 : 0);
+}
+
+static int
+digest_file(const char * filename, digest * hp)
+{
+  char buffer[4096];
+  size_t size;
+  digest h = DIGEST_INIT;
+  FILE * F = fopen(filename, "rb");
+  if (F==NULL) return -1;
+  while ((size = fread(buffer, 1, sizeof(buffer), F))>0) {
+    h = digest_bytes(h, buffer, size);
+  }
+  fclose(F);
+  *hp = h;
+  return 0;
+}
 
 typedef
 struct terrain {
   const char * name;
   image tile;
-  struct terrain * next;
+  digest hash; /* of the png, 0 if there is none */
+  int index;
+  struct terrain * nexthash;
 } terrain;
 
-terrain * terrains;
+#define TMAXHASH 127
+static terrain * terrainhash[TMAXHASH];
+static terrain ** terrains; /* by index */
+static int nterrains;
 
 typedef
 struct region {
   int x, y, plane;
+  int island;
   int units, buildings, ships;
   const char * name;
   terrain * terrain;
@@ -50,12 +105,17 @@ struct region {
 
 region * regions;
 
+/* is r on the map of a plane, or of one island of it if island is not -1 */
+#define on_map(r, p, i) ((r)->plane==(p) && ((i)<0 || (r)->island==(i)))
+
 int print_names = 1; /* write names in region */
 int print_markers = 1; /* draw markers in region */
 int print_coors = 1; /* write coordinates in region */
 char * basedir = "";
 char * bg = NULL;
 static int verbose = 0;
+static int threads = 1; /* number of threads drawing the map */
+static image_format format;
 
 void
 read_cr(parse_info * parser, const char * filename)
@@ -93,6 +153,15 @@ usage(const char * name)
     " -t xpad ypad xspan yspan   specify tile dimensions\n"
     " -l x y w h   select image viewport\n"
     " -o file  write output to file (default is stdout)\n"
+    " -j n     draw the map with n threads (default: one per cpu)\n"
+    " -I file  the image of the last run, only draw what has changed\n"
+    " -i gap   an image for each island, of regions no more than gap regions apart,\n"
+    "          -o (and -I) must contain %%d, which is replaced by plane_island\n"
+    " -x file  write an index of the images to file\n"
+    " -T dir   write a pyramid of 256x256 tiles to dir/z/x/y.png\n"
+    " -P       write indexed color when there are no more than 256 colors\n"
+    " -z n     zlib compression level, 0 to 9\n"
+    " -F name  row filter: none, sub, up, average, paeth or adaptive\n"
     "infiles:\n"
     "          one or more cr-files. if none specified, read from stdin\n");
   return -1;
@@ -133,14 +202,20 @@ get_terrain(const char * cp) {
   terrain * t;
   FILE * in;
   char buffer[1024];
+  unsigned int key = 0;
+  const char * kp;
 
   if (strlen(cp)==0) return NULL;
-  for (t=terrains;t;t=t->next) {
+  for (kp=cp;*kp;++kp) key = key*31 + tolower(*(const unsigned char*)kp);
+  for (t=terrainhash[key % TMAXHASH];t;t=t->nexthash) {
     if (!stricmp(t->name, cp)) return t;
   }
   t = calloc(1, sizeof(terrain));
-  t->next = terrains;
-  terrains = t;
+  t->nexthash = terrainhash[key % TMAXHASH];
+  terrainhash[key % TMAXHASH] = t;
+  t->index = nterrains++;
+  terrains = realloc(terrains, nterrains * sizeof(terrain*));
+  terrains[t->index] = t;
   t->name = strcpy((char*)malloc(strlen(cp)+1), cp);
 
   strcat(strcat(strcpy(buffer, basedir), cp), ".png");
@@ -150,6 +225,7 @@ get_terrain(const char * cp) {
     t->tile.data = NULL;
     if (in) fclose(in);
   }
+  else if (digest_file(buffer, &t->hash)!=0) t->hash = 0;
   return t;
 }
 
@@ -217,102 +293,641 @@ enum {
 
 char* toolong = "Dies ist ein viel zu langer Regionsname";
 
-void
-image_print(image * img, image chars[], const char * name, int left, int top, int align, int size)
+int xof = 0;
+int yof = 0;
+int xwidth = INT_MAX;
+int xheight = INT_MAX;
+
+/* the map is drawn and written in bands of this many rows */
+#define BANDROWS 256
+
+/** the glyphs of font.png, in fontcolor, side by side in one image. glyph
+ * c starts at column glyphx[c] and is glyphwidth[c] wide, a width of 0
+ * means the font has no such glyph. scanning font.png for the glyphs is
+ * done once, after that the atlas is loaded from basedir/font.cache for as
+ * long as font.png and fontcolor stay the same.
+ */
+static image atlas;
+static int glyphx[256], glyphwidth[256];
+static image glyph[256]; /* views into the atlas */
+static int fontheight = 0;
+static digest fontdigest = 0;
+
+#define FONTCACHE_MAGIC "crimage font cache 1\n"
+
+static int
+scan_font(const char * filename)
+{
+  image font;
+  FILE * in;
+  int x = 0, y;
+  unsigned char c;
+
+  in = fopen(filename, "rb+");
+  if (in==NULL || image_read(&font, in)!=0) return -1;
+  image_create(&atlas, font.width, font.height);
+  while (x!=font.width) {
+    for (y=0;y!=font.height;++y) if (image_pixel(&font, x, y).alpha) break;
+    if (y!=font.height) break;
+    ++x;
+  }
+  fputs("reading font file: ", stderr);
+  for (c=33;c!=255;++c) {
+    int begin = x;
+    int end;
+    if (isprint(c)) fputc(c, stderr);
+    else fputc('.', stderr);
+    if (x==font.width) break;
+    while (x!=font.width) {
+      for (y=0;y!=font.height;++y) if (image_pixel(&font, x, y).alpha) break;
+      if (y==font.height) break;
+      ++x;
+    }
+    if (x==font.width) break;
+    end = x;
+    glyphx[c] = begin;
+    glyphwidth[c] = end-begin;
+    for (x=begin;x!=end;++x) {
+      for (y=0;y!=font.height;++y)
+        if (image_pixel(&font, x, y).alpha) image_pixel(&atlas, x, y) = fontcolor; /* = font.data[y][x]; */
+    }
+
+    while (x!=font.width) {
+      for (y=0;y!=font.height;++y) if (image_pixel(&font, x, y).alpha) break;
+      if (y!=font.height) break;
+      ++x;
+    }
+    if (x==font.width) break;
+  }
+  fputc('\n', stderr);
+  image_free(&font);
+  return 0;
+}
+
+static int
+read_font_cache(const char * filename, digest h)
+{
+  char magic[sizeof(FONTCACHE_MAGIC)];
+  digest cached;
+  int width, height, y;
+  FILE * F = fopen(filename, "rb");
+  if (F==NULL) return -1;
+  if (fread(magic, 1, sizeof(magic), F)!=sizeof(magic) || memcmp(magic, FONTCACHE_MAGIC, sizeof(magic))
+      || fread(&cached, sizeof(cached), 1, F)!=1 || cached!=h
+      || fread(&width, sizeof(int), 1, F)!=1 || fread(&height, sizeof(int), 1, F)!=1
+      || fread(glyphx, sizeof(glyphx), 1, F)!=1 || fread(glyphwidth, sizeof(glyphwidth), 1, F)!=1
+      || image_create(&atlas, width, height)!=0) {
+    fclose(F);
+    return -1;
+  }
+  for (y=0;y!=height;++y) {
+    if (fread(image_row(&atlas, y), sizeof(pixel), width, F)!=(size_t)width) {
+      image_free(&atlas);
+      memset(glyphwidth, 0, sizeof(glyphwidth));
+      fclose(F);
+      return -1;
+    }
+  }
+  fclose(F);
+  return 0;
+}
+
+static void
+write_font_cache(const char * filename, digest h)
+{
+  int y;
+  FILE * F = fopen(filename, "wb");
+  if (F==NULL) return;
+  fwrite(FONTCACHE_MAGIC, 1, sizeof(FONTCACHE_MAGIC), F);
+  fwrite(&h, sizeof(h), 1, F);
+  fwrite(&atlas.width, sizeof(int), 1, F);
+  fwrite(&atlas.height, sizeof(int), 1, F);
+  fwrite(glyphx, sizeof(glyphx), 1, F);
+  fwrite(glyphwidth, sizeof(glyphwidth), 1, F);
+  for (y=0;y!=atlas.height;++y) {
+    fwrite(image_row(&atlas, y), sizeof(pixel), atlas.width, F);
+  }
+  if (fclose(F)!=0) remove(filename);
+}
+
+static void
+read_font(void)
+{
+  char fontfile[1024], cachefile[1024];
+  digest h;
+  int c;
+
+  if (atlas.data) return; /* for the maps of several islands */
+  strcat(strcpy(fontfile, basedir), "font.png");
+  strcat(strcpy(cachefile, basedir), "font.cache");
+  if (digest_file(fontfile, &h)!=0) {
+    print_names = 0;
+    print_coors = 0;
+    return;
+  }
+  h = digest_bytes(h, &fontcolor, sizeof(fontcolor));
+  if (read_font_cache(cachefile, h)!=0) {
+    if (scan_font(fontfile)!=0) {
+      print_names = 0;
+      print_coors = 0;
+      return;
+    }
+    write_font_cache(cachefile, h);
+  }
+  for (c=0;c!=256;++c) if (glyphwidth[c]) {
+    glyph[c] = atlas;
+    glyph[c].width = glyphwidth[c];
+    glyph[c].data = image_row(&atlas, 0) + glyphx[c];
+  }
+  fontheight = atlas.height;
+  fontdigest = h;
+}
+
+/** a string, measured and cut to size. glyph i goes offsets[i] pixels to
+ * the right of the position the string is printed at. region names repeat
+ * a lot, so each string is laid out only once.
+ */
+typedef
+struct textlayout {
+  char * text;
+  int align, size;
+  int count;
+  unsigned char * glyphs;
+  int * offsets;
+  struct textlayout * nexthash;
+} textlayout;
+
+#define LMAXHASH 4093
+static textlayout * layouts[LMAXHASH];
+
+static const textlayout *
+layout_text(const char * name, int align, int size)
 {
   int p = 0, o = 0;
   const unsigned char * cp = (const unsigned char*)name;
+  unsigned int key = (unsigned int)digest_string(DIGEST_INIT, name);
+  textlayout ** lp = &layouts[key % LMAXHASH];
+  textlayout * t;
+
+  while (*lp && ((*lp)->align!=align || (*lp)->size!=size || strcmp((*lp)->text, name))) lp = &(*lp)->nexthash;
+  if (*lp) return *lp;
+
+  t = *lp = calloc(1, sizeof(textlayout));
+  t->text = strdup(name);
+  t->align = align;
+  t->size = size;
+  t->glyphs = malloc(strlen(name)+1);
+  t->offsets = malloc((strlen(name)+1) * sizeof(int));
   if (align==ALIGN_CENTER) {
     int s = 0;
     while (*cp) {
-      if (!chars[*cp].data) s+=2;
-      else s+=chars[*cp].width+1;
+      if (!glyphwidth[*cp]) s+=2;
+      else s+=glyphwidth[*cp]+1;
       ++cp;
     }
     if (s>size) o -= size/2;
     else o -= s/2;
+    cp = (const unsigned char*)name;
   }
   while (*cp) {
-    if (!chars[*cp].data) p+=2;
+    if (!glyphwidth[*cp]) p+=2;
     else
     {
-      if (p+chars[*cp].width>size-2) break;
-      image_bitblt(img, &chars[*cp], o+p+left, top);
-      p+=chars[*cp].width+1;
+      if (p+glyphwidth[*cp]>size-2) break;
+      t->glyphs[t->count] = *cp;
+      t->offsets[t->count] = o+p;
+      ++t->count;
+      p+=glyphwidth[*cp]+1;
     }
     cp++;
   }
+  return t;
 }
 
-int xof = 0;
-int yof = 0;
-int xwidth = INT_MAX;
-int xheight = INT_MAX;
+static void
+image_print(image * img, const textlayout * t, int left, int top)
+{
+  int i;
+  for (i=0;i!=t->count;++i) {
+    image_bitblt(img, &glyph[t->glyphs[i]], left+t->offsets[i], top);
+  }
+}
 
-void
-img(FILE * out, int plane)
+static void
+draw_marker(image * dest, int x, int y, pixel color)
+{
+  int a, b;
+  for (b=0;b!=3;++b) if (y+b>=0 && y+b<dest->height) {
+    pixel * row = image_row(dest, y+b);
+    for (a=0;a!=3;++a) if (x+a>=0 && x+a<dest->width) row[x+a] = color;
+  }
+}
+
+static pixel unitcolor = { 255,0,0,255 };
+static pixel shipcolor = { 0,0,255,255 };
+static pixel buildingcolor = { 0,255,0,255 };
+static pixel background = { 0xFF, 0xFF, 0xFF, 0 };
+
+enum {
+  MARK_UNITS = 1,
+  MARK_SHIPS = 2,
+  MARK_BUILDINGS = 4
+};
+
+/** terrain tiles with the markers already drawn on them, one for each
+ * terrain and combination of markers, so that a region is one blit.
+ * they are made before drawing starts, the drawing threads only read them.
+ */
+static image * composites;
+
+static const image *
+composite(int t, int markers)
+{
+  image * c = composites + t*8 + markers;
+  const image * tile = &terrains[t]->tile;
+  int y;
+  if (!markers) return tile;
+  if (!c->data) {
+    image_create(c, max(tile->width, 14), max(tile->height, 3));
+    for (y=0;y!=tile->height;++y) {
+      memcpy(image_row(c, y), image_row(tile, y), tile->width * sizeof(pixel));
+    }
+    if (markers & MARK_UNITS) draw_marker(c, 3, 0, unitcolor);
+    if (markers & MARK_SHIPS) draw_marker(c, 7, 0, shipcolor);
+    if (markers & MARK_BUILDINGS) draw_marker(c, 11, 0, buildingcolor);
+  }
+  return c;
+}
+
+/** the regions of the plane that is drawn, sorted by their position on the
+ * output image, with everything needed to draw them worked out in advance.
+ * rows go top to bottom and each row right to left, which is where a report
+ * written row by row puts them in the (reversed) region list, so labels that
+ * overlap a neighbour come out as they did when the list was drawn as is.
+ */
+typedef
+struct mapregion {
+  int sx, sy;  /* top left corner of the tile on the output image */
+  int cx;      /* center of the labels */
+  int terrain; /* index into terrains */
+  int markers;
+  const image * tile; /* the composite for terrain and markers */
+  const textlayout * label[2]; /* name and coordinates */
+  const region * r;
+  int order;   /* in the region list, to keep the sort stable */
+} mapregion;
+
+static mapregion * map;
+static int nmap;
+
+/* the area a region may draw on starts at (m->sx, m->sy) and has this size */
+static void
+region_extent(const mapregion * m, int * width, int * height)
+{
+  *width = max(m->tile->width, tiles->xspan+2);
+  *height = m->tile->height;
+  if ((print_names || print_coors) && *height<12+fontheight) *height = 12+fontheight;
+}
+
+/* draw a region onto dest, where the top left corner of dest is at (x0, y0) on the map */
+static void
+draw_region(image * dest, const mapregion * m, int x0, int y0)
+{
+  int y = m->sy - y0;
+  image_bitblt(dest, m->tile, m->sx - x0, y);
+  if (m->label[0]) image_print(dest, m->label[0], m->cx-x0, y+3);
+  if (m->label[1]) image_print(dest, m->label[1], m->cx-x0, y+12);
+}
+
+/* regions of the current plane, binned by the cells of a grid over the
+ * output image that they touch, in the order of the map. drawing a cell's
+ * regions in this order gives the same pixels as drawing the whole map at
+ * once. the cells are bands of rows for a single image, and the tiles of
+ * the highest zoom level for a pyramid.
+ */
+static const mapregion ** bins;
+static int * binstart; /* regions of cell c are bins[binstart[c]..binstart[c+1]-1] */
+static int cellw, cellh, ncols, nrows;
+
+/* the cells a region touches, returns 0 if it is outside the grid */
+static int
+region_cells(const mapregion * m, int * col0, int * col1, int * row0, int * row1)
 {
-  pixel unitcolor = { 255,0,0,255 };
-  pixel shipcolor = { 0,0,255,255 };
-  pixel buildingcolor = { 0,255,0,255 };
-  image root;
-  image font;
   int width, height;
-  FILE * in;
-  int x = 0, y;
-  int left=INT_MAX, top=INT_MAX, right = INT_MIN, down = INT_MIN;
-  region * r;
-  int reg = 0;
-  image character[256];
+  region_extent(m, &width, &height);
+  if (m->sx+width<=0 || m->sy+height<=0) return 0;
+  *col0 = max(0, m->sx) / cellw;
+  *row0 = max(0, m->sy) / cellh;
+  *col1 = min(ncols-1, (m->sx+width-1) / cellw);
+  *row1 = min(nrows-1, (m->sy+height-1) / cellh);
+  return *col0<=*col1 && *row0<=*row1;
+}
 
-  if (print_names || print_coors) {
-    unsigned char c;
-    char buffer[1024];
-    strcat(strcpy(buffer, basedir), "font.png");
-    in = fopen(buffer, "rb+");
-    if (in!=NULL) {
-      image_read(&font, in);
-      fclose(in);
-      while (x!=font.width) {
-        for (y=0;y!=font.height;++y) if (font.data[y][x].alpha) break;
-        if (y!=font.height) break;
-        ++x;
-      }
-      fputs("reading font file: ", stderr);
-      for (c=33;c!=255;++c) {
-        int begin = x;
-        int end;
-        if (isprint(c)) fputc(c, stderr);
-        else fputc('.', stderr);
-        if (x==font.width) break;
-        while (x!=font.width) {
-          for (y=0;y!=font.height;++y) if (font.data[y][x].alpha) break;
-          if (y==font.height) break;
-          ++x;
-        }
-        if (x==font.width) break;
-        end = x;
-        image_create(&character[c], end-begin, font.height);
-        for (x=begin;x!=end;++x) {
-          for (y=0;y!=font.height;++y)
-            if (font.data[y][x].alpha) character[c].data[y][x-begin] = fontcolor; /* = font.data[y][x]; */
-        }
+static void
+bin_regions(int width, int height)
+{
+  int i, c, n = 0, col, row, col0, col1, row0, row1;
+  int * fill;
 
-        while (x!=font.width) {
-          for (y=0;y!=font.height;++y) if (font.data[y][x].alpha) break;
-          if (y!=font.height) break;
-          ++x;
-        }
-        if (x==font.width) break;
+  cellw = width;
+  cellh = height;
+  ncols = (xwidth + width - 1) / width;
+  nrows = (xheight + height - 1) / height;
+  binstart = calloc(ncols*nrows+1, sizeof(int));
+  for (i=0;i!=nmap;++i) {
+    if (region_cells(map+i, &col0, &col1, &row0, &row1)) {
+      for (row=row0;row<=row1;++row) for (col=col0;col<=col1;++col) {
+        ++binstart[row*ncols+col+1];
       }
-      fputc('\n', stderr);
-    } else {
-      print_names = 0;
-      print_coors = 0;
     }
   }
+  for (c=0;c!=ncols*nrows;++c) {
+    n += binstart[c+1];
+    binstart[c+1] = n;
+  }
+  bins = malloc(max(n, 1) * sizeof(mapregion*));
+  fill = malloc(ncols*nrows * sizeof(int));
+  memcpy(fill, binstart, ncols*nrows * sizeof(int));
+  for (i=0;i!=nmap;++i) {
+    if (region_cells(map+i, &col0, &col1, &row0, &row1)) {
+      for (row=row0;row<=row1;++row) for (col=col0;col<=col1;++col) {
+        bins[fill[row*ncols+col]++] = map+i;
+      }
+    }
+  }
+  free(fill);
+}
+
+static void
+clear_image(image * dest)
+{
+  int x, y;
+  for (y = 0; y < dest->height; y++) {
+    pixel * row = image_row(dest, y);
+    for (x = 0; x < dest->width; x++) {
+      row[x] = background;
+    }
+  }
+}
+
+static void
+draw_cell(image * dest, int col, int row)
+{
+  int c = row*ncols+col, i;
+  clear_image(dest);
+  for (i=binstart[c];i!=binstart[c+1];++i) {
+    draw_region(dest, bins[i], col*cellw, row*cellh);
+  }
+}
+
+/* everything the pixels of the map depend on, other than the regions */
+static digest settings;
+
+static void
+map_settings(int plane)
+{
+  settings = digest_int(DIGEST_INIT, plane);
+  settings = digest_string(settings, basedir);
+  settings = digest_bytes(settings, tiles, sizeof(tileinfo));
+  settings = digest_bytes(settings, &fontdigest, sizeof(fontdigest));
+  settings = digest_bytes(settings, &fontcolor, sizeof(fontcolor));
+  settings = digest_int(settings, print_names + print_markers*2 + print_coors*4);
+}
+
+/* the regions drawn on a cell, relative to its top left corner, with the
+ * png of their terrain, so that a new tile only redraws where it is used */
+static digest
+cell_digest(digest h, int col, int row)
+{
+  int c = row*ncols+col, i;
+  for (i=binstart[c];i!=binstart[c+1];++i) {
+    const mapregion * m = bins[i];
+    h = digest_int(h, m->sx - col*cellw);
+    h = digest_int(h, m->sy - row*cellh);
+    h = digest_int(h, m->cx - m->sx);
+    h = digest_int(h, m->r->x);
+    h = digest_int(h, m->r->y);
+    h = digest_int(h, m->markers);
+    h = digest_string(h, terrains[m->terrain]->name);
+    h = digest_bytes(h, &terrains[m->terrain]->hash, sizeof(digest));
+    h = digest_string(h, m->r->name);
+  }
+  return h;
+}
+
+/** incremental maps: the digest of every band goes into a crBD chunk of
+ * the image, after the settings they were drawn with. given the image of
+ * the last run with -I, a band whose digest has not changed is copied
+ * from it as it is, still compressed, and only the bands that a changed
+ * region touches are drawn again. the chunk is in the byte order of the
+ * machine, like the font cache.
+ */
+#define BANDCHUNK "crBD"
+
+typedef
+struct bandinfo {
+  digest hash;
+  digest adler;   /* of the uncompressed rows, */
+  digest rawsize; /* which the IDATs do not tell */
+} bandinfo;
+
+static const char * previous = NULL;
+static bandinfo * bands;             /* of this run */
+static bandinfo * oldbands;          /* from the previous image */
+static image_chunk * oldchunks;  /* the compressed bands of the previous image */
+static int noldbands;
+static digest oldsettings;
+
+static void
+read_previous(const char * filename)
+{
+  unsigned char * data;
+  size_t size;
+  FILE * F = fopen(filename, "rb");
+  if (F==NULL) {
+    perror(filename);
+    return;
+  }
+  if (image_read_chunks(F, BANDCHUNK, &oldchunks, &noldbands, &data, &size)!=0 || !data
+      || size!=sizeof(digest)+noldbands*sizeof(bandinfo)) {
+    fprintf(stderr, "%s was not written by crimage, drawing all of it\n", filename);
+    while (noldbands) image_chunk_free(oldchunks + --noldbands);
+    free(oldchunks);
+    oldchunks = NULL;
+    free(data);
+  } else {
+    memcpy(&oldsettings, data, sizeof(digest));
+    oldbands = malloc(max(noldbands, 1) * sizeof(bandinfo));
+    memcpy(oldbands, data+sizeof(digest), noldbands*sizeof(bandinfo));
+    free(data);
+  }
+  fclose(F);
+}
+
+static void
+free_previous(void)
+{
+  while (noldbands) image_chunk_free(oldchunks + --noldbands);
+  free(oldchunks);
+  free(oldbands);
+  oldchunks = NULL;
+  oldbands = NULL;
+  oldsettings = 0;
+}
+
+/* work out which bands can be taken from the previous image */
+static void
+band_digests(void)
+{
+  int b, reused = 0;
+  settings = digest_int(settings, xwidth);
+  settings = digest_int(settings, xheight);
+  settings = digest_bytes(settings, &format, offsetof(image_format, colors));
+  settings = digest_bytes(settings, format.colors, format.ncolors * sizeof(pixel));
+  bands = calloc(nrows, sizeof(bandinfo));
+  for (b=0;b!=nrows;++b) {
+    bands[b].hash = cell_digest(settings, 0, b);
+    if (oldsettings==settings && noldbands==nrows && oldbands[b].hash==bands[b].hash) {
+      bands[b].adler = oldbands[b].adler;
+      bands[b].rawsize = oldbands[b].rawsize;
+      ++reused;
+    }
+  }
+  if (previous) fprintf(stderr, "redrawing %d of %d bands\n", nrows-reused, nrows);
+}
+
+/* the compressed rows of band b, drawn on band if they have changed */
+static int
+make_band(image_writer * writer, image * band, int b, image_chunk * chunk)
+{
+  if (bands[b].rawsize) {
+    *chunk = oldchunks[b];
+    chunk->adler = (unsigned long)bands[b].adler;
+    chunk->rawsize = (size_t)bands[b].rawsize;
+    return 0;
+  }
+  draw_cell(band, 0, b);
+  return image_compress(writer, band, min(BANDROWS, xheight-b*BANDROWS), chunk);
+}
+
+static void
+write_band(image_writer * writer, int b, image_chunk * chunk)
+{
+  image_write_chunk(writer, chunk);
+  if (!bands[b].rawsize) {
+    bands[b].adler = chunk->adler;
+    bands[b].rawsize = chunk->rawsize;
+    image_chunk_free(chunk);
+  }
+}
+
+/** bands are drawn and compressed by a pool of threads and written in
+ * order by the main thread. each band goes into the slot b%nslots, and a
+ * thread that wants to draw band b waits until band b-nslots has been
+ * written.
+ */
+typedef
+struct slot {
+  image band;
+  image_chunk chunk;
+  int number; /* band held by this slot, -1 if it is free */
+  int done;
+} slot;
+
+static struct {
+  image_writer * writer;
+  slot * slots;
+  int nslots;
+  int next; /* next band to draw */
+  pthread_mutex_t lock;
+  pthread_cond_t drawn;
+  pthread_cond_t written;
+} pool;
+
+static void *
+band_worker(void * arg)
+{
+  unused(arg);
+  pthread_mutex_lock(&pool.lock);
+  while (pool.next<nrows) {
+    int b = pool.next++;
+    slot * s = pool.slots + b % pool.nslots;
+    while (s->number!=-1) pthread_cond_wait(&pool.written, &pool.lock);
+    s->number = b;
+    s->done = 0;
+    pthread_mutex_unlock(&pool.lock);
+
+    make_band(pool.writer, &s->band, b, &s->chunk);
+
+    pthread_mutex_lock(&pool.lock);
+    s->done = 1;
+    pthread_cond_broadcast(&pool.drawn);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+static void
+draw_bands(image_writer * writer)
+{
+  pthread_t * workers = malloc(threads * sizeof(pthread_t));
+  int b, i;
+
+  pool.writer = writer;
+  pool.nslots = threads * 2;
+  pool.slots = malloc(pool.nslots * sizeof(slot));
+  pool.next = 0;
+  for (i=0;i!=pool.nslots;++i) {
+    image_create(&pool.slots[i].band, xwidth, BANDROWS);
+    pool.slots[i].number = -1;
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.drawn, NULL);
+  pthread_cond_init(&pool.written, NULL);
+  for (i=0;i!=threads;++i) pthread_create(&workers[i], NULL, band_worker, NULL);
+
+  for (b=0;b!=nrows;++b) {
+    slot * s = pool.slots + b % pool.nslots;
+    pthread_mutex_lock(&pool.lock);
+    while (s->number!=b || !s->done) pthread_cond_wait(&pool.drawn, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    write_band(writer, b, &s->chunk);
+
+    pthread_mutex_lock(&pool.lock);
+    s->number = -1;
+    pthread_cond_broadcast(&pool.written);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  for (i=0;i!=threads;++i) pthread_join(workers[i], NULL);
+  for (i=0;i!=pool.nslots;++i) image_free(&pool.slots[i].band);
+  free(pool.slots);
+  free(workers);
+}
+
+static int
+cmp_mapregion(const void * a, const void * b)
+{
+  const mapregion * ma = (const mapregion *)a;
+  const mapregion * mb = (const mapregion *)b;
+  if (ma->sy!=mb->sy) return ma->sy<mb->sy ? -1 : 1;
+  if (ma->sx!=mb->sx) return ma->sx>mb->sx ? -1 : 1;
+  return ma->order - mb->order;
+}
+
+/* work out the size of the map, and make the table of regions to draw */
+static void
+layout(int plane, int island)
+{
+  int width, height;
+  int x, y;
+  int left=INT_MAX, top=INT_MAX, right = INT_MIN, down = INT_MIN;
+  region * r;
+  int reg = 0;
 
   for (r=regions;r;r=r->next) {
+    if (!on_map(r, plane, island)) continue;
     maptoscr(r->x, r->y, &x, &y);
     if (x<left) left = x;
     if (right<x) right = x;
@@ -327,37 +942,329 @@ img(FILE * out, int plane)
   xwidth = min(xwidth, width);
   xheight = min(xheight, height);
   fprintf(stderr, "output size: %d x %d\n", xwidth, xheight);
-  fprintf(stderr, "memory reqd: %d KB\n", xwidth * xheight * sizeof(pixel) / 1024);
 
-  image_create(&root, xwidth, xheight);
-  for (y = 0; y < root.height; y++) {
-    pixel bg = { 0xFF, 0xFF, 0xFF, 0 };
-    for (x = 0; x < root.width; x++) {
-      root.data[y][x] = bg;
-    }
-  }
-
-  for (r=regions;r;r=r->next) if (r->plane==plane && r->terrain && r->terrain->tile.data) {
-    char buffer[12];
-    int a, b;
+  if (!composites) composites = calloc(max(nterrains, 1) * 8, sizeof(image));
+  map = malloc(max(reg, 1) * sizeof(mapregion));
+  nmap = 0;
+  for (r=regions;r;r=r->next) {
+    mapregion * m = map + nmap;
+    if (!on_map(r, plane, island) || !r->terrain || !r->terrain->tile.data) continue;
     maptoscr(r->x, r->y, &x, &y);
-    image_bitblt(&root, &r->terrain->tile, xof+(x-left)*tiles->xspan/2, yof+(y-top)*tiles->yspan);
+    m->sx = xof+(x-left)*tiles->xspan/2;
+    m->sy = yof+(y-top)*tiles->yspan;
+    m->cx = xof+(x-left+1)*tiles->xspan/2+1;
+    m->terrain = r->terrain->index;
+    m->markers = 0;
     if (print_markers) {
-      if (r->units) for (a=0;a!=3;++a) for (b=0;b!=3;++b)
-        root.data[(y-top)*tiles->yspan+b][(x-left)*tiles->xspan/2+3+a] = unitcolor;
-      if (r->ships) for (a=0;a!=3;++a) for (b=0;b!=3;++b)
-        root.data[(y-top)*tiles->yspan+b][(x-left)*tiles->xspan/2+7+a] = shipcolor;
-      if (r->buildings) for (a=0;a!=3;++a) for (b=0;b!=3;++b)
-        root.data[(y-top)*tiles->yspan+b][(x-left)*tiles->xspan/2+11+a] = buildingcolor;
+      if (r->units) m->markers |= MARK_UNITS;
+      if (r->ships) m->markers |= MARK_SHIPS;
+      if (r->buildings) m->markers |= MARK_BUILDINGS;
+    }
+    m->tile = composite(m->terrain, m->markers);
+    m->label[0] = m->label[1] = NULL;
+    if (print_names && r->name) {
+      m->label[0] = layout_text(r->name, ALIGN_CENTER, tiles->xspan-2);
     }
-    if (print_names && r->name) image_print(&root, character, r->name, xof+(x-left+1)*tiles->xspan/2+1, yof+(y-top)*tiles->yspan+3, ALIGN_CENTER, tiles->xspan-2);
     if (print_coors && !(r->x%2) && !(r->y%2)) {
+      char buffer[32];
       sprintf(buffer, "[%d,%d]", r->x, r->y);
-      image_print(&root, character, buffer, xof+(x-left+1)*tiles->xspan/2+1, yof+(y-top)*tiles->yspan+12, ALIGN_CENTER, tiles->xspan-2);
+      m->label[1] = layout_text(buffer, ALIGN_CENTER, tiles->xspan-2);
+    }
+    m->r = r;
+    m->order = nmap++;
+  }
+  qsort(map, nmap, sizeof(mapregion), cmp_mapregion);
+}
+
+/* every color the map can have, if there are no more than 256 */
+static void
+make_palette(void)
+{
+  int i, x, y;
+  format.ncolors = 0;
+  image_palette_add(&format, background);
+  if (print_markers) {
+    image_palette_add(&format, unitcolor);
+    image_palette_add(&format, shipcolor);
+    image_palette_add(&format, buildingcolor);
+  }
+  if (print_names || print_coors) image_palette_add(&format, fontcolor);
+  for (i=0;i!=nterrains;++i) {
+    const image * tile = &terrains[i]->tile;
+    for (y=0;y<tile->height;++y) for (x=0;x!=tile->width;++x) {
+      pixel p = image_pixel(tile, x, y);
+      if (p.alpha && image_palette_add(&format, p)!=0) {
+        fprintf(stderr, "more than 256 colors, writing rgb.\n");
+        format.indexed = 0;
+        return;
+      }
+    }
+  }
+  if (verbose) fprintf(stderr, "%d colors\n", format.ncolors);
+}
+
+void
+img(FILE * out, int plane, int island)
+{
+  image_writer * writer;
+  image_chunk chunk;
+  unsigned char * data;
+  int b;
+
+  if (print_names || print_coors) read_font();
+  layout(plane, island);
+  fprintf(stderr, "memory reqd: %lu KB\n", (unsigned long)(xwidth * BANDROWS * sizeof(pixel) / 1024 * (threads>1 ? threads*2 : 1)));
+
+  bin_regions(xwidth, BANDROWS);
+  if (format.indexed) make_palette();
+  map_settings(plane);
+  band_digests();
+  writer = image_write_begin(out, xwidth, xheight, &format);
+  if (!writer) {
+    fprintf(stderr, "error: cannot write image\n");
+    return;
+  }
+  if (threads>1) {
+    draw_bands(writer);
+  } else {
+    image band;
+    image_create(&band, xwidth, BANDROWS);
+    for (b=0;b!=nrows;++b) {
+      make_band(writer, &band, b, &chunk);
+      write_band(writer, b, &chunk);
+    }
+    image_free(&band);
+  }
+  data = malloc(sizeof(digest) + nrows*sizeof(bandinfo));
+  memcpy(data, &settings, sizeof(digest));
+  memcpy(data+sizeof(digest), bands, nrows*sizeof(bandinfo));
+  image_write_extra(writer, BANDCHUNK, data, sizeof(digest) + nrows*sizeof(bandinfo));
+  free(data);
+  image_write_end(writer);
+  free(bands);
+  free(bins);
+  free(binstart);
+  free(map);
+}
+
+/** a tile pyramid for web maps: tiledir/z/x/y.png, with the whole map in
+ * the single tile of zoom level 0, and every level twice the size of the
+ * one before, down to maxzoom, where a tile is drawn at full size. tiles
+ * without regions are not written.
+ *
+ * the digest of a tile covers everything its pixels depend on, and the
+ * digests of the last run are kept in tiledir/tiles.idx. a tile whose
+ * digest has not changed is not written again, and if that is true for
+ * a tile of a lower zoom level, the whole part of the pyramid below it
+ * is left alone.
+ */
+#define TILESIZE 256
+#define THMAXHASH 4093
+
+enum {
+  TILE_OLD,  /* only known from the last run */
+  TILE_SEEN, /* part of the pyramid */
+  TILE_KEPT  /* unchanged, and so are all tiles below it */
+};
+
+typedef
+struct tilehash {
+  int z, x, y;
+  digest hash;
+  int state;
+  struct tilehash * nexthash;
+} tilehash;
+
+static tilehash * tilehashes[THMAXHASH];
+static const char * tiledir = NULL;
+static int maxzoom;
+
+static tilehash *
+find_tilehash(int z, int x, int y, int create)
+{
+  unsigned int key = ((unsigned int)z * 31 + (unsigned int)x) * 7919 + (unsigned int)y;
+  tilehash ** thp = &tilehashes[key % THMAXHASH];
+  while (*thp && ((*thp)->z!=z || (*thp)->x!=x || (*thp)->y!=y)) thp = &(*thp)->nexthash;
+  if (!*thp && create) {
+    *thp = calloc(1, sizeof(tilehash));
+    (*thp)->z = z;
+    (*thp)->x = x;
+    (*thp)->y = y;
+  }
+  return *thp;
+}
+
+static void
+read_tilehashes(void)
+{
+  char buffer[1024];
+  int z, x, y;
+  digest hash;
+  FILE * F = fopen(strcat(strcpy(buffer, tiledir), "/tiles.idx"), "r");
+  if (F==NULL) return;
+  while (fscanf(F, "%d %d %d %llx", &z, &x, &y, &hash)==4) {
+    find_tilehash(z, x, y, 1)->hash = hash;
+  }
+  fclose(F);
+}
+
+/* is a tile below a tile we kept? */
+static int
+tile_kept(int z, int x, int y)
+{
+  while (z-->0) {
+    tilehash * th = find_tilehash(z, x/=2, y/=2, 0);
+    if (th && th->state==TILE_KEPT) return 1;
+  }
+  return 0;
+}
+
+static void
+tile_name(char * buffer, int z, int x, int y)
+{
+  sprintf(buffer, "%s/%d/%d/%d.png", tiledir, z, x, y);
+}
+
+/* write the digests of this run, and remove tiles that have become empty */
+static void
+write_tilehashes(void)
+{
+  char buffer[1024];
+  int i;
+  FILE * F = fopen(strcat(strcpy(buffer, tiledir), "/tiles.idx"), "w");
+  if (F==NULL) {
+    perror(buffer);
+    return;
+  }
+  for (i=0;i!=THMAXHASH;++i) {
+    tilehash * th;
+    for (th=tilehashes[i];th;th=th->nexthash) {
+      if (th->state!=TILE_OLD || tile_kept(th->z, th->x, th->y)) {
+        fprintf(F, "%d %d %d %llx\n", th->z, th->x, th->y, th->hash);
+      } else {
+        tile_name(buffer, th->z, th->x, th->y);
+        remove(buffer);
+      }
+    }
+  }
+  fclose(F);
+}
+
+static digest
+tile_digest(int z, int x, int y)
+{
+  digest h = settings;
+  if (z==maxzoom) {
+    int c = y*ncols+x;
+    if (x>=ncols || y>=nrows || binstart[c]==binstart[c+1]) return 0;
+    h = cell_digest(h, x, y);
+  } else {
+    int i, empty = 1;
+    for (i=0;i!=4;++i) {
+      digest child = tile_digest(z+1, x*2+i%2, y*2+i/2);
+      if (child) empty = 0;
+      h = digest_bytes(h, &child, sizeof(child));
+    }
+    if (empty) return 0;
+  }
+  return h ? h : 1;
+}
+
+static void
+write_tile(image * tile, int z, int x, int y)
+{
+  char buffer[1024];
+  FILE * F;
+  sprintf(buffer, "%s/%d", tiledir, z);
+  mkdir(buffer, 0777);
+  sprintf(buffer, "%s/%d/%d", tiledir, z, x);
+  mkdir(buffer, 0777);
+  tile_name(buffer, z, x, y);
+  F = fopen(buffer, "wb");
+  if (F==NULL) {
+    perror(buffer);
+    return;
+  }
+  if (verbose) fprintf(stderr, "writing %s\n", buffer);
+  image_write(tile, F, &format);
+  fclose(F);
+}
+
+/* bring tile (x, y) of zoom level z up to date. if img is not NULL, the
+ * caller needs the pixels of the tile, and it must be drawn even if it
+ * has not changed.
+ */
+static void
+make_tile(int z, int x, int y, image * img)
+{
+  digest h = tile_digest(z, x, y);
+  tilehash * th;
+  image tile;
+  int changed;
+
+  if (!h) {
+    if (img) clear_image(img);
+    return;
+  }
+  th = find_tilehash(z, x, y, 1);
+  changed = th->hash!=h;
+  if (!changed) {
+    char buffer[1024];
+    FILE * F;
+    tile_name(buffer, z, x, y);
+    F = fopen(buffer, "rb");
+    if (F) fclose(F);
+    else changed = 1;
+  }
+  th->hash = h;
+  th->state = TILE_SEEN;
+  if (!changed && !img) {
+    th->state = TILE_KEPT;
+    return;
+  }
+
+  if (!img) {
+    image_create(&tile, TILESIZE, TILESIZE);
+    img = &tile;
+  } else {
+    tile.data = NULL;
+  }
+  if (z==maxzoom) {
+    draw_cell(img, x, y);
+  } else {
+    image child;
+    int i;
+    image_create(&child, TILESIZE, TILESIZE);
+    for (i=0;i!=4;++i) {
+      make_tile(z+1, x*2+i%2, y*2+i/2, &child);
+      image_downsample(img, &child, (i%2)*TILESIZE/2, (i/2)*TILESIZE/2);
     }
+    image_free(&child);
   }
+  if (changed) write_tile(img, z, x, y);
+  if (tile.data) image_free(&tile);
+}
+
+void
+pyramid(int plane)
+{
+  if (print_names || print_coors) read_font();
+  layout(plane, -1);
+  for (maxzoom=0;(TILESIZE<<maxzoom)<max(xwidth, xheight);++maxzoom);
+  fprintf(stderr, "zoom levels: 0 to %d\n", maxzoom);
+
+  /* the tiles are drawn with the settings of a map, terrain tiles and
+   * all, and the format decides what goes into the files */
+  map_settings(plane);
+  settings = digest_bytes(settings, &format, offsetof(image_format, colors));
 
-  image_write(&root, out);
+  mkdir(tiledir, 0777);
+  read_tilehashes();
+  bin_regions(TILESIZE, TILESIZE);
+  make_tile(0, 0, 0, NULL);
+  write_tilehashes();
+  free(bins);
+  free(binstart);
 }
 
 static void
@@ -389,17 +1296,98 @@ ini_file(void)
   fclose(F);
 }
 
+/* split a plane into islands, returns how many there are */
+static int
+mark_islands(int plane, int gap)
+{
+  int n = 0, i, islands;
+  int *xs, *ys, *is;
+  region * r;
+  for (r = regions;r;r=r->next) if (r->plane==plane) ++n;
+  xs = malloc((n+1)*sizeof(int));
+  ys = malloc((n+1)*sizeof(int));
+  is = malloc((n+1)*sizeof(int));
+  for (r = regions, i = 0;r;r=r->next) if (r->plane==plane) {
+    xs[i] = r->x;
+    ys[i++] = r->y;
+  }
+  islands = find_islands(xs, ys, n, gap, is);
+  for (r = regions, i = 0;r;r=r->next) if (r->plane==plane) r->island = is[i++];
+  free(xs);
+  free(ys);
+  free(is);
+  return islands;
+}
+
+/* a line of the index: where an island is, and which image it is in */
+static void
+write_index(FILE * F, int plane, int island, const char * filename)
+{
+  int n = 0, x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+  region * r;
+  for (r = regions;r;r=r->next) if (on_map(r, plane, island)) {
+    x1 = min(x1, r->x);
+    x2 = max(x2, r->x);
+    y1 = min(y1, r->y);
+    y2 = max(y2, r->y);
+    ++n;
+  }
+  fprintf(F, "%d %d %d %d %d %d %d %d %d %s\n", plane, island, n, x1, y1, x2, y2, xwidth, xheight, filename);
+}
+
+/* the name of an output file, with %d replaced by label. the pattern
+ * comes from the command line, so the result is allocated to fit it,
+ * and the caller frees it. */
+static char *
+output_name(const char * pattern, const char * label)
+{
+  const char * cp = strstr(pattern, "%d");
+  size_t head = cp-pattern, len = strlen(label);
+  char * name = (char*)malloc(strlen(pattern)-2+len+1);
+  memcpy(name, pattern, head);
+  memcpy(name+head, label, len);
+  strcpy(name+head+len, cp+2);
+  return name;
+}
+
+/* draw a map into outname, or stdout if that is NULL, and take the bands
+ * that have not changed from prevname if it is not NULL.
+ */
+static void
+write_map(const char * outname, const char * prevname, int plane, int island)
+{
+  FILE * out = stdout;
+  /* before the output is opened, it may be the same file */
+  if (prevname) read_previous(prevname);
+  if (outname) {
+    out = fopen(outname, "wb");
+    if (!out) {
+      perror(outname);
+      free_previous();
+      return;
+    }
+  }
+  img(out, plane, island);
+  fflush(out);
+  if (out!=stdout) fclose(out);
+  free_previous();
+}
+
 int
 main(int argc, char ** argv)
 {
-  FILE * f;
-  FILE * out = stdout;
-  int i, plane=0, done=0;
-  parse_info * parser = calloc(1, sizeof(parser));
+  FILE * index = NULL;
+  const char * outname = NULL;
+  int i, plane=0, done=0, gap=-1;
+  parse_info * parser = calloc(1, sizeof(parse_info));
 
   parser->iblock = &img_iblock;
   parser->ireport = &img_ireport;
 
+  image_format_init(&format);
+#ifdef _SC_NPROCESSORS_ONLN
+  threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
   tiles = &ehmv_tiles;
   for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
     switch(argv[i][1]) {
@@ -409,6 +1397,9 @@ main(int argc, char ** argv)
     case 'v':
       verbose = 1;
       break;
+    case 'j':
+      threads = atoi(argv[++i]);
+      break;
     case 'V':
       fprintf(stderr, "crimage\nCopyright (C) 2000 Enno Rehling\n\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, and you are welcome to redistribute it\nunder certain conditions; consult the file gpl.txt for details.\n\n");
       fprintf(stderr, "compiled at %s on %s\n", __TIME__, __DATE__);
@@ -425,6 +1416,39 @@ main(int argc, char ** argv)
       xwidth =  atoi(argv[++i]);
       xheight =  atoi(argv[++i]);
       break;
+    case 'I':
+      previous = argv[++i];
+      break;
+    case 'i':
+      gap = atoi(argv[++i]);
+      break;
+    case 'x':
+      index = fopen(argv[++i], "wt");
+      if (!index) perror(argv[i]);
+      else fputs("# plane island regions xmin ymin xmax ymax width height file\n", index);
+      break;
+    case 'T':
+      tiledir = argv[++i];
+      break;
+    case 'P':
+      format.indexed = 1;
+      break;
+    case 'z':
+      format.level = atoi(argv[++i]);
+      break;
+    case 'F':
+      {
+        const char * filters[] = { "none", "sub", "up", "average", "paeth", "adaptive", NULL };
+        const char * name = argv[++i];
+        for (format.filter=0;filters[format.filter];++format.filter) {
+          if (!strcmp(filters[format.filter], name)) break;
+        }
+        if (!filters[format.filter]) {
+          fprintf(stderr, "unknown filter %s\n", name);
+          format.filter = FILTER_ADAPTIVE;
+        }
+      }
+      break;
     case 't':
       tiles->xpad =  atoi(argv[++i]);
       tiles->ypad =  atoi(argv[++i]);
@@ -450,11 +1474,7 @@ main(int argc, char ** argv)
     case 'h' :
       return usage(argv[0]);
     case 'o' :
-      f = fopen(argv[++i], "wb");
-      if (!f) perror(argv[i]);
-      else if (out==stdout) {
-        out = f;
-      };
+      outname = argv[++i];
       break;
     default :
       fprintf(stderr, "Ignoring unknown option.");
@@ -469,11 +1489,30 @@ main(int argc, char ** argv)
   if (verbose) fprintf(stderr, "writing\n");
 
   ini_file();
-  if (regions) img(out, plane);
-  else fprintf(stderr, "error: no input data\n");
-  fflush(out);
+  if (!regions) fprintf(stderr, "error: no input data\n");
+  else if (tiledir) pyramid(plane);
+  else if (gap<0) write_map(outname, previous, plane, -1);
+  else if (!outname || !strstr(outname, "%d")) {
+    fprintf(stderr, "error: -i needs an output file name with %%d\n");
+  } else {
+    /* an image for each island, the size of the island */
+    int k, islands = mark_islands(plane, gap);
+    int w = xwidth, h = xheight;
+    for (k=0;k!=islands;++k) {
+      char * name, * prevname = NULL, label[32];
+      sprintf(label, "%d_%d", plane, k);
+      name = output_name(outname, label);
+      if (previous && strstr(previous, "%d")) prevname = output_name(previous, label);
+      xwidth = w;
+      xheight = h;
+      write_map(name, prevname, plane, k);
+      if (index) write_index(index, plane, k, name);
+      free(name);
+      free(prevname);
+    }
+  }
+  if (index) fclose(index);
   if (verbose) fprintf(stderr, "done.\n");
-  if (out!=stdout) fclose(out);
 
   return 0;
 }
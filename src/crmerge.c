@@ -20,6 +20,7 @@
 #include "config.h"
 #include "crdata.h"
 #include "crparse.h"
+#include "hierarchy.h"
 #include "origin.h"
 
 #include <assert.h>
@@ -29,25 +30,82 @@
 #include <string.h>
 
 static int movex, movey;
+static int moved; /* the coordinates for this file were given on the command line */
+static origins coordinates;
+static int snapshot; /* write a snapshot, not a cr */
 
 report_interface merge_ireport;
+block_interface merge_iblock;
+
+/* block types are compared by pointer, not by name: */
+static const blocktype * rtype;
+static const blocktype * vtype;
 
 block_t
 create_and_move_block(context_t context, const char * name, const int * ids, size_t size)
 {
   crdata * data = (crdata *)context;
-  int nids[3];
-  if ((movex || movey) && !stricmp(name, "REGION")) {
+  block * b = (block *)crdata_ireport.create(context, name, ids, size);
+
+  if (!vtype) {
+    rtype = find_type("REGION", data->blocktypes);
+    vtype = find_type("VERSION", data->blocktypes);
+  }
+  if (b && b->type==rtype && (movex || movey)) {
     if (size < 2 || size > 3) {
       fprintf(stderr, "warning: invalid REGION block in line %d\n", data->parser->line);
+      crdata_ireport.destroy(context, b);
       return NULL;
     }
-    nids[0] = ids[0]+movex;
-    nids[1] = ids[1]+movey;
-    if (size==3) nids[2] = ids[2];
-    return crdata_ireport.create(context, name, nids, size);
+    b->ids[0] += movex;
+    b->ids[1] += movey;
+  }
+  return b;
+}
+
+/** a report can name its own coordinate system in the VERSION block,
+ * either by id (1;origin) or by name ("Astralraum";origin). unless
+ * -m or -c was given for the file, its regions are moved into the
+ * root coordinate system of the -C definitions.
+ */
+static void
+use_origin(crdata * data, const origin * o)
+{
+  if (moved) return;
+  if (!o || o_offset(&coordinates, o, &movex, &movey)!=0) {
+    fprintf(stderr, "warning: unknown coordinate system in line %d\n", data->parser->line);
+    movex = movey = 0;
+  }
+}
+
+static void
+merge_set_int(context_t context, block_t bt, const char * name, int i)
+{
+  crdata * data = (crdata *)context;
+  block * b = (block *)bt;
+  if (b && b->type==vtype && !stricmp(name, "origin")) {
+    use_origin(data, o_find(&coordinates, i));
+  }
+  else crdata_iblock.set_int(context, bt, name, i);
+}
+
+static void
+merge_set_string(context_t context, block_t bt, const char * name, const char * value)
+{
+  crdata * data = (crdata *)context;
+  block * b = (block *)bt;
+  if (b && b->type==vtype && !stricmp(name, "origin")) {
+    use_origin(data, o_find_name(&coordinates, value));
   }
-  else return crdata_ireport.create(context, name, ids, size);
+  else crdata_iblock.set_string(context, bt, name, value);
+}
+
+/* a snapshot that needs no moving is loaded at once, if it is the first */
+static int
+merge_snapshot(parse_info * parser, const void * buffer, size_t size)
+{
+  if (moved || movex || movey) return -1;
+  return crdata_load_snapshot((crdata *)parser->bcontext, buffer, size);
 }
 
 void
@@ -72,8 +130,9 @@ usage(const char * name)
     " -C file  read coordinates from file\n"
     " -H file  read cr-hierarchy from file\n"
     " -m x y   move upcoming regions\n"
-    " -c id    use coordinate system\n"
+    " -c id    use coordinate system (id or name) for the upcoming file\n"
     " -o file  write output to file (default is stdout)\n"
+    " -b       write a binary snapshot instead of a cr (before -o)\n"
     " -V       print version information\n"
     " -v       verbose\n"
     "infiles:\n"
@@ -93,7 +152,6 @@ main(int argc, char ** argv)
   FILE * f;
   FILE * out = stdout;
   FILE * hierarchy = NULL;
-  origin * origins = NULL;
   int i;
   block * b;
   crdata * data = NULL;
@@ -101,13 +159,16 @@ main(int argc, char ** argv)
 
   merge_ireport=crdata_ireport;
   merge_ireport.create = create_and_move_block;
+  merge_iblock=crdata_iblock;
+  merge_iblock.set_int = merge_set_int;
+  merge_iblock.set_string = merge_set_string;
 
   for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
     origin * o;
     int id;
     switch(argv[i][1]) {
       case 'C' :
-        parser->bcontext = (context_t)&origins;
+        parser->bcontext = (context_t)&coordinates;
         parser->iblock = &oblock;
         parser->ireport = &ocollection;
         read_cr(parser, argv[++i]);
@@ -122,17 +183,18 @@ main(int argc, char ** argv)
       case 'm' :
         movex = atoi(argv[++i]);
         movey = atoi(argv[++i]);
+        moved = 1;
         break;
       case 'c' :
-        id = atoi(argv[++i]);
-        o = o_find(origins, id);
+        ++i;
+        id = atoi(argv[i]);
+        o = (id || argv[i][0]=='0')?o_find(&coordinates, id):o_find_name(&coordinates, argv[i]);
         movex = 0;
         movey = 0;
-        while (o) {
-          movex += o->x;
-          movey += o->y;
-          o = o->parent;
+        if (!o || o_offset(&coordinates, o, &movex, &movey)!=0) {
+          fprintf(stderr, "unknown coordinate system %s\n", argv[i]);
         }
+        moved = 1;
         break;
       case 'h' :
         return usage(argv[0]);
@@ -144,8 +206,11 @@ main(int argc, char ** argv)
         };
         data = crdata_init(hierarchy);
         break;
+      case 'b' :
+        snapshot = 1;
+        break;
       case 'o' :
-        f = fopen(argv[++i], "wt");
+        f = fopen(argv[++i], snapshot ? "wb" : "wt");
         if (!f) perror(strerror(errno));
         else if (out==stdout) {
           out = f;
@@ -162,23 +227,30 @@ main(int argc, char ** argv)
       hierarchy = stdin;
     }
     data->parser = parser;
-    parser->iblock = &crdata_iblock;
+    parser->iblock = &merge_iblock;
     parser->ireport = &merge_ireport;
+    parser->snapshot = merge_snapshot;
     parser->bcontext = (context_t)data;
     read_cr(parser, argv[i]);
     movey=movex=0;
+    moved=0;
   }
   if (!data) {
     data = crdata_init(NULL);
     data->parser = parser;
-    parser->iblock = &crdata_iblock;
+    parser->iblock = &merge_iblock;
     parser->ireport = &merge_ireport;
+    parser->snapshot = merge_snapshot;
     parser->bcontext = (context_t)data;
     if (verbose) fprintf(stderr, "reading from stdin\n");
     cr_parse(parser, stdin);
   }
   if (verbose) fprintf(stderr, "writing\n");
-  for (b=data->blocks;b;b=b->next) {
+  if (snapshot) {
+    if (out==stdout) fprintf(stderr, "a snapshot is binary, it needs -o\n");
+    else if (crdata_save_snapshot(data, out)!=0) perror("snapshot");
+  }
+  else for (b=data->blocks;b;b=b->next) {
     cr_write(data, out, b);
   }
 #if DEBUG_ALLOC
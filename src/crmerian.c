@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include "crparse.h"
+#include "islands.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -42,6 +43,7 @@ terrain * terrains;
 typedef
 struct region {
   int x, y, plane;
+  int island;
   int turn;
   terrain * terrain;
   unsigned int units : 1;
@@ -55,27 +57,82 @@ int mark;
 
 #define xp(r) (((r)->x)*2 + (r)->y)
 #define yp(r) ((r)->y)
+/* is r on the map of a plane, or of one island of it if island is not -1 */
+#define on_map(r, p, i) ((r)->plane==(p) && ((i)<0 || (r)->island==(i)))
+
+enum {
+  AXIS_SIGN,
+  AXIS_HUNDREDS,
+  AXIS_TENS,
+  AXIS_ONES,
+  AXIS_SLASH
+};
+
+/* one line of the axis labels, with a character for every other column,
+ * built in buf and written at once. column i shows x = lx+(i+shift)/2.
+ */
+static void
+axis_line(FILE * out, char * buf, int indent, int width, int lx, int shift, int o, int kind)
+{
+  char * cp = buf;
+  int i;
+  memset(cp, ' ', indent);
+  cp += indent;
+  for (i=0;i!=width;++i) {
+    int x = lx+((i+shift)/2);
+    if (i%2 != o % 2) *cp++ = ' ';
+    else switch (kind) {
+    case AXIS_SIGN:
+      *cp++ = (char)((x<0)?'-':(x>0)?'+':' ');
+      break;
+    case AXIS_HUNDREDS:
+      *cp++ = (char)((abs(x)/100)?((abs(x)/100)+'0'):' ');
+      break;
+    case AXIS_TENS:
+      *cp++ = (char)((abs(x)%100)/10?((abs(x)%100)/10+'0'):(abs(x)<100?' ':'0'));
+      break;
+    case AXIS_ONES:
+      *cp++ = (char)(abs(x)%10+'0');
+      break;
+    default:
+      *cp++ = '/';
+    }
+  }
+  *cp++ = '\n';
+  fwrite(buf, 1, cp-buf, out);
+}
+
+/* the number labels, top or bottom, down to the digits that are needed */
+static void
+axis_labels(FILE * out, char * buf, int indent, int width, int lx, int shift, int o, int xw)
+{
+  axis_line(out, buf, indent, width, lx, 1, o, AXIS_SIGN);
+  if (xw>2) axis_line(out, buf, indent, width, lx, 1, o, AXIS_HUNDREDS);
+  if (xw>1) axis_line(out, buf, indent, width, lx, 1, o, AXIS_TENS);
+  axis_line(out, buf, indent, width, lx, shift, o, AXIS_ONES);
+}
 
 void
-merian(FILE * out, int plane)
+merian(FILE * out, int plane, int island)
 {
   int x1 = INT_MAX, x2=INT_MIN, y1=INT_MAX, y2=INT_MIN;
   region *left=0, *right=0, *top=0, *bottom=0;
-  char ** line;
-  char * c;
-  int y, xw;
+  region ** byrow;
+  int * rowstart;
+  char * line;
+  int y, xw, width, n, i;
   region * r;
   terrain * t;
 
-  if (!regions) return;
   for (r = regions; r;r=r->next)
   {
-    if (r->plane!=plane) continue;
+    if (!on_map(r, plane, island)) continue;
     if (!left || xp(r)<xp(left)) left=r;
     if (!right || xp(r)>xp(right)) right=r;
     if (!top || yp(r)>yp(top)) top=r;
     if (!bottom || yp(r)<yp(bottom)) bottom=r;
   }
+  if (!left) return;
   x1 = xp(left);
   x2 = xp(right)+1;
   y1 = yp(bottom);
@@ -92,145 +149,128 @@ merian(FILE * out, int plane)
   }
   fputc('\n', out);
 
-  line = (char**)calloc(1, (y2-y1)*sizeof(char*));
-  c = (char*)calloc(1, (y2-y1)*((x2-x1)*sizeof(char)+13));
-  memset(c, ' ', (y2-y1)*((x2-x1)*sizeof(char)+13));
-  {
-    int width = 1+x2-x1;
-    int lx = top->x - (xp(top)-x1) / 2;
-    int i;
-    if ((y2-y1) % 2 ==0) ++lx;
-
-    fputs("         ", out);
-    for (i=0;i!=width;++i) {
-      int x = lx+((i+1)/2);
-      int o = abs(x1-y2);
-      if (i%2 == o % 2)
-        fprintf(out, "%c", (x<0)?'-':(x>0)?'+':' ');
-      else fputc(' ', out);
-    }
-    fputc('\n', out);
-    switch (xw) {
-    case 3:
-      fputs("         ", out);
-      for (i=0;i!=width;++i) {
-        int x = lx+((i+1)/2);
-        int o = abs(x1-y2);
-        if (i%2 == o % 2)
-          fprintf(out, "%c", (abs(x)/100)?((abs(x)/100)+'0'):' ');
-        else fputc(' ', out);
-      }
-      fputc('\n', out);
-    case 2:
-      fputs("         ", out);
-      for (i=0;i!=width;++i) {
-        int x = lx+((i+1)/2);
-        int o = abs(x1-y2);
-        if (i%2 == o % 2)
-          fprintf(out, "%c", (abs(x)%100)/10?((abs(x)%100)/10+'0'):(abs(x)<100?' ':'0'));
-        else fputc(' ', out);
-      }
-      fputc('\n', out);
-    default:
-      fputs("         ", out);
-      for (i=0;i!=width;++i) {
-        int x = lx+(i/2);
-        int o = abs(x1-y2);
-        if (i%2 == o % 2)
-          fprintf(out, "%c", abs(x)%10+'0');
-        else fputc(' ', out);
-      }
-      fputc('\n', out);
-    }
-    fputs("        ", out);
-    for (i=0;i!=width;++i) {
-      int o = abs(x1-y2);
-      if (i%2 == o % 2)
-        fputc('/', out);
-      else fputc(' ', out);
-    }
+  /* the regions of the plane by row, in the order of the list */
+  rowstart = (int*)calloc(y2-y1+1, sizeof(int));
+  for (r = regions;r;r=r->next) {
+    if (on_map(r, plane, island)) ++rowstart[yp(r)-y1+1];
   }
-  fputc('\n', out);
-  for (y=y1;y!=y2;++y) {
-    line[y-y1] = c + (y-y1)*((x2-x1)*sizeof(char)+13);
-    sprintf(line[y-y1], "%4d", y);
-    line[y-y1][4] = ' ';
-    sprintf(line[y-y1]+7+(x2-x1), "%4d", y);
+  for (y=y1,n=0;y!=y2;++y) {
+    n += rowstart[y-y1+1];
+    rowstart[y-y1+1] = n;
   }
-
+  byrow = (region**)malloc(max(n, 1)*sizeof(region*));
   for (r = regions;r;r=r->next) {
-    if (r->plane!=plane) continue;
+    if (on_map(r, plane, island)) byrow[rowstart[yp(r)-y1]++] = r;
+  }
+  for (y=y2-1;y!=y1;--y) rowstart[y-y1] = rowstart[y-y1-1];
+  rowstart[0] = 0;
+
+  /* one line at a time, reused for every line of the map */
+  width = 1+x2-x1;
+  line = (char*)malloc(width+32);
+
+  axis_labels(out, line, 9, width, top->x - (xp(top)-x1) / 2 + ((y2-y1) % 2 ==0),
+              0, abs(x1-y2), xw);
+  axis_line(out, line, 8, width, 0, 0, abs(x1-y2), AXIS_SLASH);
+
+  for (y=y2-1;y>=y1;--y) {
+    memset(line, ' ', width+32);
+    sprintf(line, "%4d", y);
+    line[4] = ' ';
+    sprintf(line+7+(x2-x1), "%4d", y);
+    for (i=rowstart[y-y1];i!=rowstart[y-y1+1];++i) {
+      r = byrow[i];
+      line[5+(xp(r)-x1)] = ' ';
+      if (mark && r->units && r->turn==turn)
+        line[6+(xp(r)-x1)] = r->terrain->mark;
+      else
+        line[6+(xp(r)-x1)] = r->terrain->symbol;
+    }
+    n = (int)strlen(line);
+    line[n] = '\n';
+    fwrite(line, 1, n+1, out);
+  }
+
+  axis_line(out, line, 5, width, 0, 0, abs(x1-y1), AXIS_SLASH);
+  axis_labels(out, line, 4, width, bottom->x - (xp(bottom)-x1) / 2,
+              1, abs(x1-y1), xw);
 
-    line[yp(r)-y1][5+(xp(r)-x1)] = ' ';
-    if (mark && r->units && r->turn==turn)
-      line[yp(r)-y1][6+(xp(r)-x1)] = r->terrain->mark;
-    else
-      line[yp(r)-y1][6+(xp(r)-x1)] = r->terrain->symbol;
+  free(line);
+  free(byrow);
+  free(rowstart);
+}
+
+#define MAXPLANES 64
+
+/* the planes there are regions in, in ascending order */
+static int
+find_planes(int * planes)
+{
+  int n = 0, i;
+  region * r;
+  for (r = regions;r;r=r->next) {
+    for (i=0;i!=n && planes[i]<r->plane;++i);
+    if (i!=n && planes[i]==r->plane) continue;
+    if (n==MAXPLANES) break;
+    memmove(planes+i+1, planes+i, (n-i)*sizeof(int));
+    planes[i] = r->plane;
+    ++n;
   }
+  return n;
+}
 
-  /* print header */
-  for (y=y1;y!=y2;++y) {
-    fputs(line[y2-y-1], out);
-    fputc('\n', out);
+/* split a plane into islands, returns how many there are */
+static int
+mark_islands(int plane, int gap)
+{
+  int n = 0, i, islands;
+  int *xs, *ys, *is;
+  region * r;
+  for (r = regions;r;r=r->next) if (r->plane==plane) ++n;
+  xs = malloc((n+1)*sizeof(int));
+  ys = malloc((n+1)*sizeof(int));
+  is = malloc((n+1)*sizeof(int));
+  for (r = regions, i = 0;r;r=r->next) if (r->plane==plane) {
+    xs[i] = r->x;
+    ys[i++] = r->y;
   }
+  islands = find_islands(xs, ys, n, gap, is);
+  for (r = regions, i = 0;r;r=r->next) if (r->plane==plane) r->island = is[i++];
+  free(xs);
+  free(ys);
+  free(is);
+  return islands;
+}
 
-  {
-    int width = 1+x2-x1;
-    int lx = bottom->x - (xp(bottom)-x1) / 2;
-    int i;
-    fputs("     ", out);
-    for (i=0;i!=width;++i) {
-      int o = abs(x1-y1);
-      if (i%2 == o % 2)
-        fputc('/', out);
-      else fputc(' ', out);
-    }
-    fputc('\n', out);
-    fputs("    ", out);
-    for (i=0;i!=width;++i) {
-      int x = lx+((i+1)/2);
-      int o = abs(x1-y1);
-      if (i%2 == o % 2)
-        fprintf(out, "%c", (x<0)?'-':(x>0)?'+':' ');
-      else fputc(' ', out);
-    }
-    fputc('\n', out);
-    switch (xw) {
-    case 3:
-      fputs("    ", out);
-      for (i=0;i!=width;++i) {
-        int x = lx+((i+1)/2);
-        int o = abs(x1-y1);
-        if (i%2 == o % 2)
-          fprintf(out, "%c", (abs(x)/100)?((abs(x)/100)+'0'):' ');
-        else fputc(' ', out);
-      }
-      fputc('\n', out);
-    case 2:
-      fputs("    ", out);
-      for (i=0;i!=width;++i) {
-        int x = lx+((i+1)/2);
-        int o = abs(x1-y1);
-        if (i%2 == o % 2)
-          fprintf(out, "%c", (abs(x)%100)/10?((abs(x)%100)/10+'0'):(abs(x)<100?' ':'0'));
-        else fputc(' ', out);
-      }
-      fputc('\n', out);
-    default:
-      fputs("    ", out);
-      for (i=0;i!=width;++i) {
-        int x = lx+((i+1)/2);
-        int o = abs(x1-y1);
-        if (i%2 == o % 2)
-          fprintf(out, "%c", abs(x)%10+'0');
-        else fputc(' ', out);
-      }
-      fputc('\n', out);
-    }
+/* a line of the index: where an island is, and which file its map is in */
+static void
+write_index(FILE * F, int plane, int island, const char * filename)
+{
+  int n = 0, x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+  region * r;
+  for (r = regions;r;r=r->next) if (on_map(r, plane, island)) {
+    x1 = min(x1, r->x);
+    x2 = max(x2, r->x);
+    y1 = min(y1, r->y);
+    y2 = max(y2, r->y);
+    ++n;
   }
+  if (n) fprintf(F, "%d %d %d %d %d %d %d %s\n", plane, island, n, x1, y1, x2, y2, filename);
+}
 
-  free(c);
-  free(line);
+/* the name of an output file, with %d replaced by label. the pattern
+ * comes from the command line, so the result is allocated to fit it,
+ * and the caller frees it. */
+static char *
+output_name(const char * pattern, const char * label)
+{
+  const char * cp = strstr(pattern, "%d");
+  size_t head = cp-pattern, len = strlen(label);
+  char * name = (char*)malloc(strlen(pattern)-2+len+1);
+  memcpy(name, pattern, head);
+  memcpy(name+head, label, len);
+  strcpy(name+head+len, cp+2);
+  return name;
 }
 
 int x=0, y=0, r = 4;
@@ -242,11 +282,14 @@ usage(const char * name)
   fprintf(stderr, "options:\n"
     " -h       display this information\n"
     " -m       mark populated regions\n"
-    " -p id    output for a specific plane\n"
+    " -p id    output for a specific plane, may be repeated, 'all' for every plane\n"
+    " -i gap   a map for each island, of regions no more than gap regions apart\n"
+    " -x file  write an index of the maps to file\n"
     " -H file  read cr-hierarchy from file\n"
     " -V       print version information\n"
     " -v       verbose\n"
-    " -o file  write output to file (default is stdout)\n"
+    " -o file  write output to file (default is stdout), %%d is the plane\n"
+    "          (and island, as plane_island)\n"
     "infiles:\n"
     "          one or more cr-files. if none specified, read from stdin\n");
   return -1;
@@ -360,9 +403,11 @@ read_cr(const char * filename)
 int
 main(int argc, char ** argv)
 {
-  FILE * f;
   FILE * out = stdout;
-  int i, plane=0;
+  FILE * index = NULL;
+  const char * outname = NULL;
+  int planes[MAXPLANES], nplanes = 0, allplanes = 0;
+  int i, gap = -1;
 
   get_terrain("Hochland", 'h', 'H');
   get_terrain("Gletscher", 'g', 'G');
@@ -377,11 +422,20 @@ main(int argc, char ** argv)
   for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
     switch(argv[i][1]) {
     case 'p' :
-      plane = atoi(argv[++i]);
+      if (!strcmp(argv[++i], "all")) allplanes = 1;
+      else if (nplanes!=MAXPLANES) planes[nplanes++] = atoi(argv[i]);
       break;
     case 'm' :
       mark = 1;
       break;
+    case 'i' :
+      gap = atoi(argv[++i]);
+      break;
+    case 'x' :
+      index = fopen(argv[++i], "wt");
+      if (!index) perror(argv[i]);
+      else fputs("# plane island regions xmin ymin xmax ymax file\n", index);
+      break;
     case 'v':
       verbose = 1;
       break;
@@ -392,11 +446,7 @@ main(int argc, char ** argv)
     case 'h' :
       return usage(argv[0]);
     case 'o' :
-      f = fopen(argv[++i], "wt");
-      if (!f) perror(argv[i]);
-      else if (out==stdout) {
-        out = f;
-      };
+      outname = argv[++i];
       break;
     default :
       fprintf(stderr, "Ignoring unknown option.");
@@ -408,7 +458,43 @@ main(int argc, char ** argv)
     read_cr(argv[i]);
   }
   if (verbose) fprintf(stderr, "writing\n");
-  merian(out, plane);
+  if (allplanes) nplanes = find_planes(planes);
+  else if (!nplanes) planes[nplanes++] = 0;
+
+  /* all maps come from the same parse. with %d in the name of the output
+   * file, each plane or island gets a file of its own.
+   */
+  if (outname && !strstr(outname, "%d")) {
+    out = fopen(outname, "wt");
+    if (!out) {
+      perror(outname);
+      return -1;
+    }
+  }
+  for (i=0;i!=nplanes;++i) {
+    int k, islands = (gap>=0) ? mark_islands(planes[i], gap) : 1;
+    for (k=0;k!=islands;++k) {
+      FILE * F = out;
+      char * name = NULL, label[32];
+      if (gap>=0) sprintf(label, "%d_%d", planes[i], k);
+      else sprintf(label, "%d", planes[i]);
+      if (outname && strstr(outname, "%d")) {
+        name = output_name(outname, label);
+        F = fopen(name, "wt");
+        if (!F) {
+          perror(name);
+          free(name);
+          continue;
+        }
+      }
+      merian(F, planes[i], gap>=0 ? k : -1);
+      if (index) write_index(index, planes[i], gap>=0 ? k : -1, name ? name : outname ? outname : "-");
+      if (F!=out) fclose(F);
+      free(name);
+    }
+  }
+  if (index) fclose(index);
+  if (out!=stdout) fclose(out);
 
   return 0;
 }
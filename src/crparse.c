@@ -23,7 +23,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include "config.h"
 #include "crparse.h"
+#include "snapshot.h"
+
+#if HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 void
 read_int(parse_info * info, block_t b, char * buffer)
@@ -92,57 +100,316 @@ read_string(parse_info * info, block_t b, char * buffer)
     if (info->iblock->set_entry) info->iblock->set_entry(info->bcontext, b, value);
 }
 
+static size_t
+raw_length(const char * buffer, size_t len)
+{
+  while (len && isspace(*(const unsigned char*)(buffer+len-1))) --len;
+  return len;
+}
+
+static block_t
+parse_line(parse_info * info, block_t b, char * line, const char * raw, size_t rawsize)
+{
+  char * buffer = line;
+  const unsigned char utf8_bom[4] = { 0xef, 0xbb, 0xbf };
+  if (memcmp(buffer, utf8_bom, 3)==0) {
+    buffer = buffer+3;
+    raw = raw+3;
+    rawsize = rawsize>3?rawsize-3:0;
+  }
+  info->raw = raw;
+  info->rawsize = raw_length(raw, rawsize);
+  if (buffer[0]=='"') {
+    if (b || !info->skip) read_string(info, b, buffer);
+  }
+  else if (buffer[0]=='-' || isdigit(buffer[0])) {
+    if (b || !info->skip) read_int(info, b, buffer);
+  }
+  else if (isalpha(buffer[0])) {
+    int ids[10];
+    char * name = buffer;
+    char * id = buffer;
+    int i=1;
+    while (*id) {
+      while (*id && !isspace(*(const unsigned char*)id)) ++id;
+      if (*id) {
+        if (i==1) *id++ = 0;
+        while (*id && *id != '-' && !isdigit(*id)) ++id;
+        if (*id) {
+          int k = 0;
+          int d = 1;
+          if (*id=='-') {
+            ++id;
+            d = -1;
+          }
+          while (*id && isdigit(*id)) {
+            k = k*10 + *id - '0';
+            ++id;
+          }
+          ids[i++] = d * k;
+        }
+      }
+    }
+    ids[0] = i-1;
+    {
+      block_t last = b;
+      if (last && info->ireport->add) info->ireport->add(info->bcontext, last);
+      if (info->ireport->create) b = info->ireport->create(info->bcontext, name, ids+1, ids[0]);
+    }
+  }
+  info->raw = NULL;
+  info->rawsize = 0;
+  info->line++;
+  return b;
+}
+
+/* a reference into a section of the snapshot, with room for n records */
+#define SNAP_INDEX(i, section, n) ((i)>=0 && (unsigned int)(i)+(n)<=h->count[section])
+
+/* every reference in the snapshot is checked once here, so no reader has to */
+static int
+snapshot_valid(const snap_header * h)
+{
+  const char * base = (const char *)h;
+  const snap_type * types = (const snap_type *)(base + h->offset[SNAP_TYPES]);
+  const int * properties = (const int *)(base + h->offset[SNAP_PROPERTIES]);
+  const snap_block * blocks = (const snap_block *)(base + h->offset[SNAP_BLOCKS]);
+  const snap_entry * entries = (const snap_entry *)(base + h->offset[SNAP_ENTRIES]);
+  const int * ints = (const int *)(base + h->offset[SNAP_INTS]);
+  const char * strings = base + h->offset[SNAP_STRINGS];
+  unsigned int i;
+
+  if (h->count[SNAP_STRINGS] && strings[h->count[SNAP_STRINGS]-1]) return 0;
+  for (i=0;i!=h->count[SNAP_TYPES];++i) {
+    const snap_type * t = types+i;
+    if (!SNAP_INDEX(t->name, SNAP_STRINGS, 1)) return 0;
+    if (t->parent>=(int)i || (t->unique!=-1 && !SNAP_INDEX(t->unique, SNAP_TYPES, 1))) return 0;
+  }
+  for (i=0;i!=h->count[SNAP_PROPERTIES];++i) {
+    if (!SNAP_INDEX(properties[i], SNAP_STRINGS, 1)) return 0;
+  }
+  for (i=0;i!=h->count[SNAP_BLOCKS];++i) {
+    const snap_block * b = blocks+i;
+    if (!SNAP_INDEX(b->type, SNAP_TYPES, 1) || b->parent>=(int)i) return 0;
+    if (b->children!=-1 && (b->children<=(int)i || !SNAP_INDEX(b->children, SNAP_BLOCKS, 1))) return 0;
+    if (b->next!=-1 && (b->next<=(int)i || !SNAP_INDEX(b->next, SNAP_BLOCKS, 1))) return 0;
+    if (b->size<0 || !SNAP_INDEX(b->ids, SNAP_INTS, b->size)) return 0;
+    if (b->nentries<0 || !SNAP_INDEX(b->entries, SNAP_ENTRIES, b->nentries)) return 0;
+  }
+  for (i=0;i!=h->count[SNAP_ENTRIES];++i) {
+    const snap_entry * e = entries+i;
+    if (e->type==SNAP_MESSAGE ? e->tag!=-1 : !SNAP_INDEX(e->tag, SNAP_PROPERTIES, 1)) return 0;
+    switch (e->type) {
+    case SNAP_INT:
+      break;
+    case SNAP_INTLIST:
+      if (!SNAP_INDEX(e->value, SNAP_INTS, 1) || ints[e->value]<0) return 0;
+      if (!SNAP_INDEX(e->value, SNAP_INTS, 1+ints[e->value])) return 0;
+      break;
+    case SNAP_STRING:
+    case SNAP_MESSAGE:
+      if (!SNAP_INDEX(e->value, SNAP_STRINGS, 1)) return 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const snap_header *
+snapshot_check(const void * data, size_t size)
+{
+  static const size_t record[SNAP_SECTIONS] = {
+    sizeof(snap_type), sizeof(int), sizeof(snap_block), sizeof(snap_entry), sizeof(int), 1
+  };
+  const snap_header * h = (const snap_header *)data;
+  int i;
+
+  if (size<sizeof(snap_header) || memcmp(h->magic, SNAPSHOT_MAGIC, 8)!=0) return NULL;
+  if (h->byteorder!=SNAPSHOT_BYTEORDER || h->version!=SNAPSHOT_VERSION) {
+    fprintf(stderr, "snapshot was written by a different machine or version\n");
+    return NULL;
+  }
+  for (i=0;i!=SNAP_SECTIONS;++i) {
+    if (h->offset[i] % sizeof(int) || h->offset[i]>size
+        || h->count[i] > (size - h->offset[i]) / record[i]) {
+      fprintf(stderr, "snapshot is truncated\n");
+      return NULL;
+    }
+  }
+  if (!snapshot_valid(h)) {
+    fprintf(stderr, "snapshot is corrupt\n");
+    return NULL;
+  }
+  return h;
+}
+
+/* room for a line of size characters in the raw buffer */
+static char *
+snap_line(parse_info * info, char ** raw, size_t * maxraw, size_t size)
+{
+  if (size+1>*maxraw) {
+    *maxraw = size+1024;
+    *raw = realloc(*raw, *maxraw);
+  }
+  info->raw = *raw;
+  return *raw;
+}
+
+/** the blocks of a snapshot are passed to the interfaces as if they came
+ * from the CR file that crdata would write, and so are the lines in raw.
+ */
+static void
+parse_snapshot(parse_info * info, const snap_header * h)
+{
+  const char * base = (const char *)h;
+  const snap_type * types = (const snap_type *)(base + h->offset[SNAP_TYPES]);
+  const int * properties = (const int *)(base + h->offset[SNAP_PROPERTIES]);
+  const snap_block * blocks = (const snap_block *)(base + h->offset[SNAP_BLOCKS]);
+  const snap_entry * entries = (const snap_entry *)(base + h->offset[SNAP_ENTRIES]);
+  const int * ints = (const int *)(base + h->offset[SNAP_INTS]);
+  const char * strings = base + h->offset[SNAP_STRINGS];
+  const block_interface * ib = info->iblock;
+  char * raw = NULL, * p;
+  size_t maxraw = 0;
+  block_t b = NULL;
+  unsigned int i;
+  int j;
+
+  info->line = 1;
+  info->stop = 0;
+  for (i=0;i!=h->count[SNAP_BLOCKS] && !info->stop;++i) {
+    const snap_block * sb = blocks+i;
+    const char * name = strings + types[sb->type].name;
+    const int * ids = ints + sb->ids;
+
+    p = snap_line(info, &raw, &maxraw, strlen(name) + 12 * sb->size);
+    p += sprintf(p, "%s", name);
+    for (j=0;j!=sb->size;++j) p += sprintf(p, " %d", ids[j]);
+    info->rawsize = p - raw;
+    if (b && info->ireport->add) info->ireport->add(info->bcontext, b);
+    b = info->ireport->create ? info->ireport->create(info->bcontext, name, ids, sb->size) : NULL;
+    info->line++;
+    if (!b && info->skip) continue;
+
+    if (sb->turn && (sb->parent<0 || (sb->size && sb->turn!=blocks[sb->parent].turn))) {
+      p = snap_line(info, &raw, &maxraw, 20);
+      info->rawsize = sprintf(p, "%d;Runde", sb->turn);
+      if (ib->set_int) ib->set_int(info->bcontext, b, "Runde", sb->turn);
+      info->line++;
+    }
+    for (j=0;j!=sb->nentries && !info->stop;++j) {
+      const snap_entry * e = entries + sb->entries + j;
+      const char * tag = e->tag>=0 ? strings + properties[e->tag] : NULL;
+      const int * ip;
+      int k;
+      switch (e->type) {
+      case SNAP_INT:
+        p = snap_line(info, &raw, &maxraw, 12 + strlen(tag));
+        info->rawsize = sprintf(p, "%d;%s", e->value, tag);
+        if (ib->set_int) ib->set_int(info->bcontext, b, tag, e->value);
+        break;
+      case SNAP_INTLIST:
+        ip = ints + e->value;
+        p = snap_line(info, &raw, &maxraw, 12 * ip[0] + 1 + strlen(tag));
+        for (k=1;k<=ip[0];++k) p += sprintf(p, k>1 ? " %d" : "%d", ip[k]);
+        p += sprintf(p, ";%s", tag);
+        info->rawsize = p - raw;
+        if (ib->set_ints) ib->set_ints(info->bcontext, b, tag, ip+1, ip[0]);
+        break;
+      case SNAP_STRING:
+        p = snap_line(info, &raw, &maxraw, strlen(strings + e->value) + 3 + strlen(tag));
+        info->rawsize = sprintf(p, "\"%s\";%s", strings + e->value, tag);
+        if (ib->set_string) ib->set_string(info->bcontext, b, tag, strings + e->value);
+        break;
+      case SNAP_MESSAGE:
+        p = snap_line(info, &raw, &maxraw, strlen(strings + e->value) + 2);
+        info->rawsize = sprintf(p, "\"%s\"", strings + e->value);
+        if (ib->set_entry) ib->set_entry(info->bcontext, b, strings + e->value);
+        break;
+      }
+      info->line++;
+    }
+  }
+  info->raw = NULL;
+  info->rawsize = 0;
+  free(raw);
+  if (b && info->ireport->add) info->ireport->add(info->bcontext, b);
+}
+
 void
 cr_parse(parse_info * info, void * infile)
 {
   FILE * in = (FILE*)infile;
   char line[1024 * 32];
+  char raw[1024 * 32];
   block_t b = NULL;
-  info->line = 1;
+  int i;
 
-  while (!feof(in) && fgets(line, sizeof(line), in)) {
-    const char * buffer = line;
-    const unsigned char utf8_bom[4] = { 0xef, 0xbb, 0xbf };
-    if (memcmp(buffer, utf8_bom, 3)==0) {
-      buffer = buffer+3;
+#if HAVE_MMAP
+  /* regular files are mapped into memory instead of copied through stdio */
+  struct stat st;
+  if (fstat(fileno(in), &st)==0 && S_ISREG(st.st_mode) && st.st_size>0 && ftell(in)==0) {
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if (data!=MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      cr_parse_buffer(info, (const char *)data, st.st_size);
+      munmap(data, st.st_size);
+      fseek(in, 0, SEEK_END);
+      return;
     }
-    if (buffer[0]=='"')
-      read_string(info, b, buffer);
-    else if (buffer[0]=='-' || isdigit(buffer[0]))
-      read_int(info, b, buffer);
-    else if (isalpha(buffer[0])) {
-      int ids[10];
-      char * name = buffer;
-      char * id = buffer;
-      int i=1;
-      while (*id) {
-        while (*id && !isspace(*(const unsigned char*)id)) ++id;
-        if (*id) {
-          if (i==1) *id++ = 0;
-          while (*id && *id != '-' && !isdigit(*id)) ++id;
-          if (*id) {
-            int k = 0;
-            int d = 1;
-            if (*id=='-') {
-              ++id;
-              d = -1;
-            }
-            while (*id && isdigit(*id)) {
-              k = k*10 + *id - '0';
-              ++id;
-            }
-            ids[i++] = d * k;
-          }
-        }
-      }
-      ids[0] = i-1;
-      {
-        block_t last = b;
-        if (last && info->ireport->add) info->ireport->add(info->bcontext, last);
-        if (info->ireport->create) b = info->ireport->create(info->bcontext, name, ids+1, ids[0]);
-      }
+  }
+#endif
+  i = getc(in);
+  if (i==(unsigned char)SNAPSHOT_MAGIC[0]) {
+    /* a snapshot that is not a regular file, it has to be read first */
+    size_t size = 1, maxsize = 1024 * 1024;
+    char * data = malloc(maxsize);
+    data[0] = (char)i;
+    while ((i = fread(data+size, 1, maxsize-size, in))>0) {
+      size += i;
+      if (size==maxsize) data = realloc(data, maxsize *= 2);
     }
-    info->line++;
+    cr_parse_buffer(info, data, size);
+    free(data);
+    return;
+  }
+  if (i!=EOF) ungetc(i, in);
+  info->line = 1;
+  info->stop = 0;
+  while (!info->stop && !feof(in) && fgets(line, sizeof(line), in)) {
+    size_t len = strlen(line);
+    memcpy(raw, line, len+1);
+    b = parse_line(info, b, line, raw, len);
+  }
+  if (b && info->ireport->add) info->ireport->add(info->bcontext, b);
+}
+
+void
+cr_parse_buffer(parse_info * info, const char * data, size_t size)
+{
+  char line[1024 * 32];
+  const char * end = data+size;
+  block_t b = NULL;
+
+  if (size>=8 && memcmp(data, SNAPSHOT_MAGIC, 8)==0) {
+    const snap_header * h = snapshot_check(data, size);
+    if (h && (!info->snapshot || info->snapshot(info, data, size)!=0)) parse_snapshot(info, h);
+    return;
+  }
+  info->line = 1;
+  info->stop = 0;
+
+  while (data!=end && !info->stop) {
+    const char * eol = memchr(data, '\n', end-data);
+    size_t len = eol?(size_t)(eol-data)+1:(size_t)(end-data);
+    /* overlong lines are split, just like fgets would do it */
+    if (len>sizeof(line)-1) len = sizeof(line)-1;
+    memcpy(line, data, len);
+    line[len] = 0;
+    b = parse_line(info, b, line, data, len);
+    data += len;
   }
   if (b && info->ireport->add) info->ireport->add(info->bcontext, b);
 }
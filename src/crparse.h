@@ -68,9 +68,18 @@ struct parse_info {
   context_t bcontext;
   int line;
   int verbose;
+  int skip; /* if set, attributes of blocks that create() returned NULL for are not parsed */
+  const char * raw; /* while a callback runs: the current line as it was read */
+  size_t rawsize;   /* length of raw, without the line break and trailing spaces */
+  int stop;         /* a callback sets this to end the parse after the current line */
+  /* if set, a snapshot is given to this function first. it returns 0 if
+   * it has read the snapshot, otherwise its blocks are passed to the
+   * interfaces like those of a CR file. */
+  int (*snapshot)(struct parse_info * info, const void * data, size_t size);
 } parse_info;
 
 void cr_parse(parse_info * info, void * in);
+void cr_parse_buffer(parse_info * info, const char * data, size_t size);
 
 #ifdef __cplusplus
 }
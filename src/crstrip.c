@@ -18,6 +18,8 @@
  */
 #include "config.h"
 #include "crparse.h"
+#include "dfa.h"
+#include "outbuf.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,33 +36,142 @@ typedef struct section {
   struct section * next;
   char * name;
   tag * tags;
+  tag * contents;
 } section;
 
+/** the filter file, compiled into one automaton each for the section
+ * names, the tag names and the string contents. every section has a
+ * number, and each tag or content rule carries the number of the
+ * section it belongs to, so a match returns the set of sections that
+ * allow it.
+ */
+typedef struct filter {
+  struct dfa * sections;
+  struct dfa * tags;
+  struct dfa * contents;
+  unsigned int * restricted; /* sections that have content rules */
+  int words;
+} filter;
+
 typedef struct merian_context {
   FILE * out;
+  outbuf * ob;
   section * sec;
+  filter * tags;
+  const parse_info * parser;
 } merian_context;
 
+/** kept lines are copied from the input exactly as they were read */
+static void
+copy_line(merian_context * mc)
+{
+  ob_write(mc->ob, mc->parser->raw, mc->parser->rawsize);
+  ob_putc(mc->ob, '\n');
+}
+
+/** patterns in the filter file are
+ *   /regex/  a regular expression,
+ *   a*b?[cd] a glob pattern if it contains one of *?[,
+ *   name     a plain name otherwise.
+ */
+static int
+add_pattern(struct dfa * d, char * str, int id)
+{
+  size_t len = strlen(str);
+  int result;
+  if (len>1 && str[0]=='/' && str[len-1]=='/') {
+    str[len-1] = 0;
+    result = dfa_add(d, str+1, PATTERN_REGEX, id);
+    str[len-1] = '/';
+  }
+  else if (strpbrk(str, "*?[")) result = dfa_add(d, str, PATTERN_GLOB, id);
+  else result = dfa_add(d, str, PATTERN_LITERAL, id);
+  if (result!=0) fprintf(stderr, "invalid pattern in filter: %s\n", str);
+  return result;
+}
+
+static filter *
+compile_tags(section * sec)
+{
+  filter * f = (filter *)calloc(1, sizeof(filter));
+  section * s;
+  int id = 0;
+
+  f->sections = dfa_create();
+  f->tags = dfa_create();
+  f->contents = dfa_create();
+  for (s=sec;s;s=s->next) ++id;
+  f->words = id/32+1;
+  f->restricted = (unsigned int *)calloc(f->words, sizeof(unsigned int));
+  for (s=sec,id=0;s;s=s->next,++id) {
+    tag * t;
+    int errors = 0;
+    /* a filter without one of its rules could let through what it was
+     * written to remove, so a bad pattern stops crstrip */
+    if (add_pattern(f->sections, s->name, id)) ++errors;
+    for (t=s->tags;t;t=t->next) if (add_pattern(f->tags, t->name, id)) ++errors;
+    for (t=s->contents;t;t=t->next) if (add_pattern(f->contents, t->name, id)) ++errors;
+    if (errors) return NULL;
+    if (s->contents) f->restricted[id/32] |= 1U << (id % 32);
+  }
+  return f;
+}
+
+/* the tag and content automata only know about the sections that
+ * have rules, so their masks may be shorter than the section mask. */
+static int
+intersects(const unsigned int * a, const unsigned int * sections, int words)
+{
+  int i;
+  if (!a) return 0;
+  for (i=0;i!=words;++i) if (a[i] & sections[i]) return 1;
+  return 0;
+}
+
+static int
+keep_tag(const filter * f, const unsigned int * sections, const char * name)
+{
+  return intersects(dfa_match(f->tags, name), sections, dfa_words(f->tags));
+}
+
+/** strings are kept if one of the block's sections has no content
+ * rules, or one of them matches the string.
+ */
+static int
+keep_content(const filter * f, const unsigned int * sections, const char * value)
+{
+  int i, words = dfa_words(f->sections);
+  for (i=0;i!=words;++i) if (sections[i] & ~f->restricted[i]) return 1;
+  return intersects(dfa_match(f->contents, value), sections, dfa_words(f->contents));
+}
+
+/** filter file format:
+ *   @section  blocks whose name matches are kept
+ *   ;tag      attributes of the previous section to keep
+ *   "content  if a section has content rules, its strings and entries
+ *             are only kept if they match one of them
+ */
 void
 read_tags(FILE * in, section ** sec)
 {
-  char buf[64];
+  char buf[1024];
 
-  while (fgets(buf, 64, in)) {
+  while (fgets(buf, sizeof(buf), in)) {
     size_t end = strlen(buf);
-    if (end && buf[end-1]=='\n') buf[end-1] = '\0';
+    while (end && (buf[end-1]=='\n' || buf[end-1]=='\r')) buf[--end] = '\0';
     if (buf[0]=='@') {
       section * last = *sec;
       *sec = (section *) calloc(1, sizeof(section));
       (*sec)->next = last;
       (*sec)->name = (char*)calloc(strlen(buf), sizeof(char));
       strcpy((*sec)->name, buf+1);
-    } else if (sec) {
-      tag * last = (*sec)->tags;
-      (*sec)->tags = (tag *) calloc(1, sizeof(tag));
-      (*sec)->tags->next = last;
-      (*sec)->tags->name = (char*)calloc(strlen(buf), sizeof(char));
-      strcpy((*sec)->tags->name, buf+1);
+    } else if (*sec && end>1) {
+      tag ** tags = (buf[0]=='"')?&(*sec)->contents:&(*sec)->tags;
+      tag * last = *tags;
+      *tags = (tag *) calloc(1, sizeof(tag));
+      (*tags)->next = last;
+      (*tags)->name = (char*)calloc(strlen(buf), sizeof(char));
+      strcpy((*tags)->name, buf+1);
     }
   }
 }
@@ -68,18 +179,12 @@ read_tags(FILE * in, section ** sec)
 block_t
 create_block(context_t context, const char * name, const int * ids, size_t size)
 {
-  section * c;
   merian_context * mc = (merian_context*)context;
-  for (c = mc->sec;c;c=c->next) {
-    if (!stricmp(name, c->name)) {
-      unsigned int i;
-      fprintf(mc->out, "%s", name);
-      for (i=0;i!=size;++i) fprintf(mc->out, " %d", ids[i]);
-      fprintf(mc->out, "\n");
-      break;
-    }
-  }
-  return c;
+  const unsigned int * sections = dfa_match(mc->tags->sections, name);
+  unused(ids);
+  unused(size);
+  if (sections) copy_line(mc);
+  return (block_t)sections;
 }
 
 const report_interface merge_ireport = {
@@ -91,61 +196,33 @@ const report_interface merge_ireport = {
 
 void
 block_set_int(context_t context, block_t bt, const char *name, int i) {
-  section * s = (section*)bt;
-  FILE * out = ((merian_context*)context)->out;
-  if (s) {
-    tag * t;
-    for (t=s->tags;t;t = t->next) {
-      if (!stricmp(name, t->name)) {
-        fprintf(out, "%d;%s\n", i, name);
-        break;
-      }
-    }
-  }
+  const unsigned int * s = (const unsigned int *)bt;
+  merian_context * mc = (merian_context*)context;
+  unused(i);
+  if (s && keep_tag(mc->tags, s, name)) copy_line(mc);
 }
 
 void
 block_set_ints(context_t context, block_t bt, const char *name, const int *ip, size_t size) {
-  section * s = (section*)bt;
-  FILE * out = ((merian_context*)context)->out;
-  if (s) {
-    tag * t;
-    for (t=s->tags;t;t = t->next) {
-      if (!stricmp(name, t->name)) {
-        unsigned int i;
-        for (i=0;i!=size;++i) {
-          if (i!=0) fputc(' ', out);
-          fprintf(out, "%d", ip[i]);
-        }
-        fprintf(out, ";%s\n", name);
-        break;
-      }
-    }
-  }
+  const unsigned int * s = (const unsigned int *)bt;
+  merian_context * mc = (merian_context*)context;
+  unused(ip);
+  unused(size);
+  if (s && keep_tag(mc->tags, s, name)) copy_line(mc);
 }
 
 void
 block_set_string(context_t context, block_t bt, const char *name, const char *cp) {
-  section * s = (section*)bt;
-  FILE * out = ((merian_context*)context)->out;
-  if (s) {
-    tag * t;
-    for (t=s->tags;t;t = t->next) {
-      if (!stricmp(name, t->name)) {
-        fprintf(out, "\"%s\";%s\n", cp, name);
-        break;
-      }
-    }
-  }
+  const unsigned int * s = (const unsigned int *)bt;
+  merian_context * mc = (merian_context*)context;
+  if (s && keep_tag(mc->tags, s, name) && keep_content(mc->tags, s, cp)) copy_line(mc);
 }
 
 void
 block_set_entry(context_t context, block_t bt, const char *cp) {
-  section * s = (section*)bt;
-  FILE * out = ((merian_context*)context)->out;
-  if (s) {
-    fprintf(out, "\"%s\"\n", cp);
-  }
+  const unsigned int * s = (const unsigned int *)bt;
+  merian_context * mc = (merian_context*)context;
+  if (s && keep_content(mc->tags, s, cp)) copy_line(mc);
 }
 
 const block_interface merge_iblock = {
@@ -192,6 +269,8 @@ main(int argc, char** argv)
   parser->ireport = &merge_ireport;
   parser->iblock = &merge_iblock;
   parser->bcontext = &context;
+  parser->skip = 1;
+  context.parser = parser;
 
   for (i=1;i!=argc;++i) if (argv[i][0]=='-') {
     switch(argv[i][1]) {
@@ -233,6 +312,10 @@ main(int argc, char** argv)
   if (!filter) usage(argv[0], "cannot open filter definitions");
   if (!context.out) usage(argv[0], "cannot open output file");
   if (verbose) fprintf(stderr, "writing\n");
+  context.tags = compile_tags(context.sec);
+  if (!context.tags) return -1;
+  context.ob = ob_create(context.out);
   cr_parse(parser, in);
+  ob_destroy(context.ob);
   return 0;
 }
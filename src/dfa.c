@@ -0,0 +1,470 @@
+/*
+ *  dfa - matching many patterns at once for Eressea CR tools
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+#include "dfa.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DMAXHASH 1023
+
+/* the patterns are compiled into a Thompson NFA, and the DFA states
+ * are the sets of NFA states, built on demand while matching. */
+
+typedef struct nstate {
+  enum { N_SET, N_SPLIT, N_MATCH } type;
+  unsigned char set[32]; /* N_SET: the characters that lead to out */
+  struct nstate * out;
+  struct nstate * out1;  /* N_SPLIT: second branch, may be NULL */
+  int id;                /* N_MATCH: id of the pattern */
+  int index;
+  unsigned int mark;
+  struct nstate * nextall;
+} nstate;
+
+typedef struct ptrlist {
+  nstate ** slot;
+  struct ptrlist * next;
+} ptrlist;
+
+typedef struct frag {
+  nstate * start;
+  ptrlist * out;
+} frag;
+
+typedef struct dstate {
+  struct dstate * next[256];
+  struct dstate * nexthash;
+  unsigned int * mask;
+  unsigned int key;
+  int size;
+  nstate ** states;
+} dstate;
+
+typedef struct dfa {
+  nstate * nstates;   /* all NFA states, for cleanup and numbering */
+  int count;
+  nstate ** starts;   /* the start state of each pattern */
+  int nstarts;
+  int maxid;
+  int words;
+  unsigned int mark;
+  dstate * start;
+  dstate * dhash[DMAXHASH];
+  nstate ** work;     /* scratch list for building state sets */
+} dfa;
+
+static unsigned char fold[256];
+
+static nstate *
+nstate_new(dfa * d, int type)
+{
+  nstate * s = (nstate *)calloc(1, sizeof(nstate));
+  s->type = type;
+  s->index = d->count++;
+  s->nextall = d->nstates;
+  d->nstates = s;
+  return s;
+}
+
+static ptrlist *
+list1(nstate ** slot)
+{
+  ptrlist * l = (ptrlist *)malloc(sizeof(ptrlist));
+  l->slot = slot;
+  l->next = NULL;
+  return l;
+}
+
+static ptrlist *
+append(ptrlist * a, ptrlist * b)
+{
+  ptrlist * l = a;
+  if (!a) return b;
+  while (l->next) l = l->next;
+  l->next = b;
+  return a;
+}
+
+static void
+patch(ptrlist * l, nstate * s)
+{
+  while (l) {
+    ptrlist * next = l->next;
+    *l->slot = s;
+    free(l);
+    l = next;
+  }
+}
+
+static void
+set_add(unsigned char * set, int c)
+{
+  set[c>>3] |= (unsigned char)(1 << (c & 7));
+  /* input is folded to lower case before matching: */
+  c = fold[c];
+  set[c>>3] |= (unsigned char)(1 << (c & 7));
+}
+
+static frag
+frag_set(dfa * d, const unsigned char * set)
+{
+  frag f;
+  nstate * s = nstate_new(d, N_SET);
+  memcpy(s->set, set, sizeof(s->set));
+  f.start = s;
+  f.out = list1(&s->out);
+  return f;
+}
+
+static frag
+frag_empty(dfa * d)
+{
+  frag f;
+  nstate * s = nstate_new(d, N_SPLIT);
+  f.start = s;
+  f.out = list1(&s->out);
+  return f;
+}
+
+typedef struct reader {
+  const char * start;
+  const char * cp;
+  int error;
+} reader;
+
+static frag parse_alt(dfa * d, reader * r);
+
+static void
+parse_class(reader * r, unsigned char * set, int glob)
+{
+  unsigned char pos[32];
+  int negate = 0, first = 1, i;
+
+  memset(pos, 0, sizeof(pos));
+  if (*r->cp=='^' || (glob && *r->cp=='!')) {
+    negate = 1;
+    ++r->cp;
+  }
+  while (*r->cp && (first || *r->cp!=']')) {
+    int lo = *(const unsigned char *)r->cp++, hi;
+    if (lo=='\\' && *r->cp) lo = *(const unsigned char *)r->cp++;
+    hi = lo;
+    if (r->cp[0]=='-' && r->cp[1] && r->cp[1]!=']') {
+      hi = *(const unsigned char *)(r->cp+1);
+      r->cp += 2;
+      if (hi=='\\' && *r->cp) hi = *(const unsigned char *)r->cp++;
+    }
+    for (i=lo;i<=hi;++i) set_add(pos, i);
+    first = 0;
+  }
+  if (*r->cp!=']') r->error = 1;
+  else ++r->cp;
+  for (i=0;i!=32;++i) set[i] = (unsigned char)(negate?~pos[i]:pos[i]);
+}
+
+static frag
+parse_atom(dfa * d, reader * r)
+{
+  unsigned char set[32];
+  frag f;
+  int c = *(const unsigned char *)r->cp++;
+
+  memset(set, 0, sizeof(set));
+  switch (c) {
+  case '(':
+    f = parse_alt(d, r);
+    if (*r->cp!=')') r->error = 1;
+    else ++r->cp;
+    return f;
+  case '[':
+    parse_class(r, set, 0);
+    break;
+  case '.':
+    memset(set, 0xff, sizeof(set));
+    break;
+  case '^':
+    /* patterns always match the whole string, so anchors are only
+     * allowed where they would not change that */
+    if (r->cp-1!=r->start && r->cp[-2]!='(' && r->cp[-2]!='|') r->error = 1;
+    else if (*r->cp=='*' || *r->cp=='+' || *r->cp=='?') r->error = 1;
+    return frag_empty(d);
+  case '$':
+    if (*r->cp && *r->cp!=')' && *r->cp!='|') r->error = 1;
+    return frag_empty(d);
+  case '\\':
+    if (*r->cp) c = *(const unsigned char *)r->cp++;
+    set_add(set, c);
+    break;
+  default:
+    set_add(set, c);
+    break;
+  }
+  return frag_set(d, set);
+}
+
+static frag
+parse_repeat(dfa * d, reader * r)
+{
+  frag f = parse_atom(d, r);
+  while (*r->cp=='*' || *r->cp=='+' || *r->cp=='?') {
+    nstate * s = nstate_new(d, N_SPLIT);
+    s->out = f.start;
+    switch (*r->cp++) {
+    case '*':
+      patch(f.out, s);
+      f.start = s;
+      f.out = list1(&s->out1);
+      break;
+    case '+':
+      patch(f.out, s);
+      f.out = list1(&s->out1);
+      break;
+    case '?':
+      f.start = s;
+      f.out = append(f.out, list1(&s->out1));
+      break;
+    }
+  }
+  return f;
+}
+
+static frag
+parse_concat(dfa * d, reader * r)
+{
+  frag f = frag_empty(d);
+  while (!r->error && *r->cp && *r->cp!='|' && *r->cp!=')') {
+    frag g = parse_repeat(d, r);
+    patch(f.out, g.start);
+    f.out = g.out;
+  }
+  return f;
+}
+
+static frag
+parse_alt(dfa * d, reader * r)
+{
+  frag f = parse_concat(d, r);
+  while (!r->error && *r->cp=='|') {
+    nstate * s = nstate_new(d, N_SPLIT);
+    frag g;
+    ++r->cp;
+    g = parse_concat(d, r);
+    s->out = f.start;
+    s->out1 = g.start;
+    f.start = s;
+    f.out = append(f.out, g.out);
+  }
+  return f;
+}
+
+static frag
+parse_glob(dfa * d, reader * r)
+{
+  frag f = frag_empty(d);
+  while (*r->cp) {
+    unsigned char set[32];
+    frag g;
+    int c = *(const unsigned char *)r->cp++;
+    memset(set, 0, sizeof(set));
+    switch (c) {
+    case '*':
+    case '?':
+      memset(set, 0xff, sizeof(set));
+      break;
+    case '[':
+      parse_class(r, set, 1);
+      break;
+    case '\\':
+      if (*r->cp) c = *(const unsigned char *)r->cp++;
+      set_add(set, c);
+      break;
+    default:
+      set_add(set, c);
+      break;
+    }
+    g = frag_set(d, set);
+    if (c=='*') {
+      nstate * s = nstate_new(d, N_SPLIT);
+      s->out = g.start;
+      patch(g.out, s);
+      g.start = s;
+      g.out = list1(&s->out1);
+    }
+    patch(f.out, g.start);
+    f.out = g.out;
+  }
+  return f;
+}
+
+static frag
+parse_literal(dfa * d, reader * r)
+{
+  frag f = frag_empty(d);
+  while (*r->cp) {
+    unsigned char set[32];
+    frag g;
+    memset(set, 0, sizeof(set));
+    set_add(set, *(const unsigned char *)r->cp++);
+    g = frag_set(d, set);
+    patch(f.out, g.start);
+    f.out = g.out;
+  }
+  return f;
+}
+
+struct dfa *
+dfa_create(void)
+{
+  if (fold['A']==0) {
+    int c;
+    for (c=0;c!=256;++c) fold[c] = (unsigned char)tolower(c);
+  }
+  return (dfa *)calloc(1, sizeof(dfa));
+}
+
+int
+dfa_add(struct dfa * d, const char * pattern, int type, int id)
+{
+  reader r;
+  frag f;
+  nstate * match;
+
+  assert(d->start==NULL || !"patterns must be added before matching");
+  r.start = r.cp = pattern;
+  r.error = 0;
+  switch (type) {
+  case PATTERN_REGEX:
+    f = parse_alt(d, &r);
+    if (*r.cp) r.error = 1;
+    break;
+  case PATTERN_GLOB:
+    f = parse_glob(d, &r);
+    break;
+  default:
+    f = parse_literal(d, &r);
+    break;
+  }
+  match = nstate_new(d, N_MATCH);
+  match->id = id;
+  patch(f.out, match);
+  if (r.error) return -1;
+
+  d->starts = (nstate **)realloc(d->starts, (d->nstarts+1) * sizeof(nstate *));
+  d->starts[d->nstarts++] = f.start;
+  if (id>d->maxid) d->maxid = id;
+  return 0;
+}
+
+int
+dfa_words(const struct dfa * d)
+{
+  return d->maxid/32+1;
+}
+
+static int
+add_closure(dfa * d, nstate * s, int size)
+{
+  while (s && s->mark!=d->mark) {
+    s->mark = d->mark;
+    if (s->type==N_SPLIT) {
+      size = add_closure(d, s->out1, size);
+      s = s->out;
+    } else {
+      d->work[size++] = s;
+      break;
+    }
+  }
+  return size;
+}
+
+static int
+cmp_nstate(const void * a, const void * b)
+{
+  return (*(nstate * const *)a)->index - (*(nstate * const *)b)->index;
+}
+
+/** returns the DFA state for the set of NFA states in d->work */
+static dstate *
+dstate_get(dfa * d, int size)
+{
+  unsigned int key = (unsigned int)size;
+  dstate * ds;
+  int i;
+
+  qsort(d->work, size, sizeof(nstate *), cmp_nstate);
+  for (i=0;i!=size;++i) key = key * 31 + (unsigned int)d->work[i]->index;
+  for (ds=d->dhash[key % DMAXHASH];ds;ds=ds->nexthash) {
+    if (ds->key==key && ds->size==size && !memcmp(ds->states, d->work, size * sizeof(nstate *))) return ds;
+  }
+  ds = (dstate *)calloc(1, sizeof(dstate));
+  ds->key = key;
+  ds->size = size;
+  ds->states = (nstate **)malloc((size?size:1) * sizeof(nstate *));
+  memcpy(ds->states, d->work, size * sizeof(nstate *));
+  for (i=0;i!=size;++i) {
+    nstate * s = ds->states[i];
+    if (s->type==N_MATCH) {
+      if (!ds->mask) ds->mask = (unsigned int *)calloc(d->words, sizeof(unsigned int));
+      ds->mask[s->id/32] |= 1U << (s->id % 32);
+    }
+  }
+  ds->nexthash = d->dhash[key % DMAXHASH];
+  d->dhash[key % DMAXHASH] = ds;
+  return ds;
+}
+
+static dstate *
+dfa_step(dfa * d, dstate * ds, unsigned char c)
+{
+  int i, size = 0;
+  ++d->mark;
+  for (i=0;i!=ds->size;++i) {
+    nstate * s = ds->states[i];
+    if (s->type==N_SET && (s->set[c>>3] & (1 << (c & 7)))) {
+      size = add_closure(d, s->out, size);
+    }
+  }
+  return dstate_get(d, size);
+}
+
+const unsigned int *
+dfa_match(struct dfa * d, const char * str)
+{
+  const unsigned char * cp = (const unsigned char *)str;
+  dstate * ds = d->start;
+
+  if (!ds) {
+    int i, size = 0;
+    d->words = dfa_words(d);
+    d->work = (nstate **)malloc((d->count?d->count:1) * sizeof(nstate *));
+    ++d->mark;
+    for (i=0;i!=d->nstarts;++i) size = add_closure(d, d->starts[i], size);
+    ds = d->start = dstate_get(d, size);
+  }
+  while (*cp && ds->size) {
+    unsigned char c = fold[*cp++];
+    dstate * next = ds->next[c];
+    if (!next) next = ds->next[c] = dfa_step(d, ds, c);
+    ds = next;
+  }
+  return *cp?NULL:ds->mask;
+}
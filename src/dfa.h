@@ -0,0 +1,50 @@
+/*
+ *  dfa - matching many patterns at once for Eressea CR tools
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef CR_DFA_H
+#define CR_DFA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  PATTERN_LITERAL,
+  PATTERN_GLOB,  /* * ? [abc] [!abc] */
+  PATTERN_REGEX  /* . [] * + ? | ( ) and \ escapes, ^ and $ at the ends */
+};
+
+struct dfa;
+
+/** a set of patterns that are matched in one pass over the input.
+ * all patterns must match the whole string, and matching ignores case.
+ * every pattern has an id, and dfa_match returns the set of ids of all
+ * matching patterns as a bitmask of dfa_words() unsigned ints, or NULL
+ * if no pattern matched. the automaton is built lazily while matching,
+ * so patterns can only be added before the first call to dfa_match.
+ */
+extern struct dfa * dfa_create(void);
+extern int dfa_add(struct dfa * d, const char * pattern, int type, int id);
+extern const unsigned int * dfa_match(struct dfa * d, const char * str);
+extern int dfa_words(const struct dfa * d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,39 +17,259 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include <png.h>
+#include <zlib.h>
 #include "config.h"
 #include "image.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_SSE2
+# define HAVE_AVX2
+# define TARGET(x) __attribute__((target(x)))
+# include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+# define HAVE_SSE2
+# define TARGET(x)
+# include <emmintrin.h>
+#endif
+
+/* round(x/255) for 0 <= x <= 255*255, without a division */
+#define div255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+typedef void (*blit_row)(pixel * dest, const pixel * src, int n);
+
+static void
+copy_masked_c(pixel * dest, const pixel * src, int n)
+{
+  int x;
+  for (x=0;x!=n;++x) {
+    if (src[x].alpha!=0) dest[x] = src[x];
+  }
+}
+
+/* dest = src * a + dest * (1-a), and the same for the alpha channel, where
+ * src contributes a fully opaque value. the vector kernels below compute
+ * exactly this, so the result does not depend on the cpu we run on.
+ */
+static void
+blend_c(pixel * dest, const pixel * src, int n)
+{
+  int x;
+  for (x=0;x!=n;++x) {
+    unsigned int a = src[x].alpha;
+    if (a==255) dest[x] = src[x];
+    else if (a!=0) {
+      unsigned int ia = 255 - a;
+      pixel * d = dest + x;
+      d->r = (unsigned char)div255(src[x].r * a + d->r * ia);
+      d->g = (unsigned char)div255(src[x].g * a + d->g * ia);
+      d->b = (unsigned char)div255(src[x].b * a + d->b * ia);
+      d->alpha = (unsigned char)div255(255 * a + d->alpha * ia);
+    }
+  }
+}
+
+#ifdef HAVE_SSE2
+TARGET("sse2") static void
+copy_masked_sse2(pixel * dest, const pixel * src, int n)
+{
+  const __m128i amask = _mm_set1_epi32((int)0xFF000000);
+  const __m128i zero = _mm_setzero_si128();
+  int x;
+  for (x=0;x+4<=n;x+=4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src+x));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dest+x));
+    /* all ones where the source is transparent */
+    __m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, amask), zero);
+    d = _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s));
+    _mm_storeu_si128((__m128i*)(dest+x), d);
+  }
+  copy_masked_c(dest+x, src+x, n-x);
+}
+
+TARGET("sse2") static __m128i
+blend2_sse2(__m128i s, __m128i d)
+{
+  const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+  const __m128i color = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i half = _mm_set1_epi16(128);
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+  __m128i ia = _mm_sub_epi16(full, a);
+  __m128i t;
+  a = _mm_or_si128(_mm_and_si128(a, color), opaque);
+  t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+  t = _mm_add_epi16(t, half);
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+TARGET("sse2") static void
+blend_sse2(pixel * dest, const pixel * src, int n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int x;
+  for (x=0;x+4<=n;x+=4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src+x));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dest+x));
+    __m128i lo = blend2_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+    __m128i hi = blend2_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+    _mm_storeu_si128((__m128i*)(dest+x), _mm_packus_epi16(lo, hi));
+  }
+  blend_c(dest+x, src+x, n-x);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET("avx2") static void
+copy_masked_avx2(pixel * dest, const pixel * src, int n)
+{
+  const __m256i amask = _mm256_set1_epi32((int)0xFF000000);
+  const __m256i zero = _mm256_setzero_si256();
+  int x;
+  for (x=0;x+8<=n;x+=8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src+x));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dest+x));
+    __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(s, amask), zero);
+    _mm256_storeu_si256((__m256i*)(dest+x), _mm256_blendv_epi8(s, d, m));
+  }
+  copy_masked_c(dest+x, src+x, n-x);
+}
+
+TARGET("avx2") static __m256i
+blend2_avx2(__m256i s, __m256i d)
+{
+  const __m256i opaque = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+  const __m256i color = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+  const __m256i full = _mm256_set1_epi16(255);
+  const __m256i half = _mm256_set1_epi16(128);
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+  __m256i ia = _mm256_sub_epi16(full, a);
+  __m256i t;
+  a = _mm256_or_si256(_mm256_and_si256(a, color), opaque);
+  t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia));
+  t = _mm256_add_epi16(t, half);
+  return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET("avx2") static void
+blend_avx2(pixel * dest, const pixel * src, int n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  int x;
+  for (x=0;x+8<=n;x+=8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src+x));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dest+x));
+    __m256i lo = blend2_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+    __m256i hi = blend2_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+    _mm256_storeu_si256((__m256i*)(dest+x), _mm256_packus_epi16(lo, hi));
+  }
+  blend_c(dest+x, src+x, n-x);
+}
+#endif
+
+static blit_row copy_masked;
+static blit_row blend;
+static const char * simd_name = "none";
+
+/* pick the widest kernels this cpu supports. CRTOOLS_SIMD=none, sse2 or
+ * avx2 limits the choice, which is useful for comparing them. this runs
+ * when the first image is created, so nothing can be drawn before it,
+ * and threads that only draw never race to set the kernels.
+ */
+static void
+blit_init(void)
+{
+  const char * simd = getenv("CRTOOLS_SIMD");
+  copy_masked = copy_masked_c;
+  blend = blend_c;
+  if (simd && !strcmp(simd, "none")) return;
+#ifdef HAVE_SSE2
+# ifdef __GNUC__
+  if (!__builtin_cpu_supports("sse2")) return;
+# endif
+  copy_masked = copy_masked_sse2;
+  blend = blend_sse2;
+  simd_name = "sse2";
+  if (simd && !strcmp(simd, "sse2")) return;
+#endif
+#ifdef HAVE_AVX2
+  if (!__builtin_cpu_supports("avx2")) return;
+  copy_masked = copy_masked_avx2;
+  blend = blend_avx2;
+  simd_name = "avx2";
+#endif
+}
+
+static void
+image_blit(image * dest, const image * src, int xof, int yof, blit_row fun)
+{
+  int y;
+  int xmin = max(0, -xof);
+  int ymin = max(0, -yof);
+  int xmax = min(src->width, dest->width-xof);
+  int ymax = min(src->height, dest->height-yof);
+  if (xmin>=xmax) return;
+  for (y=ymin;y<ymax;++y) {
+    fun(image_row(dest, y+yof)+xmin+xof, image_row(src, y)+xmin, xmax-xmin);
+  }
+}
+
+void
+image_bitblt(image* dest, const image * src, int xof, int yof)
+{
+  image_blit(dest, src, xof, yof, copy_masked);
+}
+
+void
+image_blend(image* dest, const image * src, int xof, int yof)
+{
+  image_blit(dest, src, xof, yof, blend);
+}
+
+const char *
+image_simd(void)
+{
+  return simd_name;
+}
+
+
 void
-image_bitblt(image* dest, image * src, int xof, int yof)
+image_downsample(image * dest, const image * src, int xof, int yof)
 {
   int x, y;
   int xmin = max(0, -xof);
   int ymin = max(0, -yof);
-  int width = min(dest->width-xof, min(src->width, src->width+xof));
-  int height = min(min(src->height, dest->height-yof), min(src->height, src->height+yof));
-  for (y=ymin;y<ymin+height;++y) {
-    for (x=xmin;x<xmin+width;++x) {
-      if (src->data[y][x].alpha!=0) {
-        dest->data[y+yof][x+xof] = src->data[y][x];
-      }
+  int xmax = min(src->width/2, dest->width-xof);
+  int ymax = min(src->height/2, dest->height-yof);
+  for (y=ymin;y<ymax;++y) {
+    const pixel * a = image_row(src, y*2);
+    const pixel * b = image_row(src, y*2+1);
+    pixel * d = image_row(dest, y+yof) + xof;
+    for (x=xmin;x<xmax;++x) {
+      const pixel * p = a + x*2;
+      const pixel * q = b + x*2;
+      d[x].r = (unsigned char)((p[0].r + p[1].r + q[0].r + q[1].r + 2) / 4);
+      d[x].g = (unsigned char)((p[0].g + p[1].g + q[0].g + q[1].g + 2) / 4);
+      d[x].b = (unsigned char)((p[0].b + p[1].b + q[0].b + q[1].b + 2) / 4);
+      d[x].alpha = (unsigned char)((p[0].alpha + p[1].alpha + q[0].alpha + q[1].alpha + 2) / 4);
     }
   }
 }
 
-
 #if 1
 static void
 image_postprocess(image * src)
 {
   int x, y;
-  pixel p = src->data[0][0];
+  pixel p = src->data[0];
   for (y=0;y<src->height;++y) {
+    pixel * row = image_row(src, y);
     for (x=0;x<src->width;++x) {
-      if (!memcmp(&src->data[y][x], &p, sizeof(pixel))) {
-        memset(&src->data[y][x], 0, sizeof(pixel));
+      if (!memcmp(&row[x], &p, sizeof(pixel))) {
+        memset(&row[x], 0, sizeof(pixel));
       }
     }
   }
@@ -66,6 +286,7 @@ image_read(image * pic, FILE * fp)  /* We need to open the file */
    png_color_16 my_background, *image_background;
    int intent, number_passes;
   unsigned row;
+  png_bytep * row_pointers;
   char * gamma_str;
   double screen_gamma;
 
@@ -97,7 +318,7 @@ image_read(image * pic, FILE * fp)  /* We need to open the file */
     * the normal method of doing things with libpng).  REQUIRED unless you
     * set up your own error handlers in the png_create_read_struct() earlier.
     */
-   if (setjmp(png_ptr->jmpbuf))
+   if (setjmp(png_jmpbuf(png_ptr)))
    {
       /* Free all of the memory associated with the png_ptr and info_ptr */
       png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
@@ -272,18 +493,20 @@ image_read(image * pic, FILE * fp)  /* We need to open the file */
    /* Allocate the memory to hold the image using the fields of info_ptr. */
 
    /* The easiest way to read the image: */
-   pic->data = malloc(sizeof(png_bytep) * height);
-  pic->height = height;
-  pic->width = width;
-
-   for (row = 0; row < height; row++)
-   {
-    png_bytep * row_pointers = (png_bytep *)pic->data;
-      row_pointers[row] = malloc(png_get_rowbytes(png_ptr, info_ptr));
-   }
+  assert(png_get_rowbytes(png_ptr, info_ptr)==width*sizeof(pixel));
+  if (image_create(pic, width, height)!=0) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    fclose(fp);
+    return -1;
+  }
+  row_pointers = malloc(sizeof(png_bytep) * height);
+  for (row = 0; row < height; row++) {
+    row_pointers[row] = (png_bytep)image_row(pic, row);
+  }
 
    /* Now it's time to read the image.  One of these methods is REQUIRED */
-   png_read_image(png_ptr, (png_bytepp)pic->data);
+   png_read_image(png_ptr, row_pointers);
+  free(row_pointers);
 
    /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
    png_read_end(png_ptr, info_ptr);
@@ -311,6 +534,7 @@ image_read(image * pic, FILE * f)
   FILE     *fp = f;
   int     y;
   double     gamma;
+  png_bytep * row_pointers;
 
   pic->data = NULL;
 
@@ -326,7 +550,7 @@ image_read(image * pic, FILE * f)
 #ifdef USE_FAR_KEYWORD
    if (setjmp(jmpbuf))
 #else
-   if (setjmp(png_ptr->jmpbuf))
+   if (setjmp(png_jmpbuf(png_ptr)))
 #endif
   /*
    * Set error handling if you are using the setjmp/longjmp method (this is
@@ -361,12 +585,12 @@ image_read(image * pic, FILE * f)
 
   png_read_update_info(png_ptr, info_ptr);
 
-  pic->width = width;
-  pic->height = height;
-  pic->data = malloc(pic->height * sizeof(pixel*));
+  image_create(pic, width, height);
+  row_pointers = malloc(height * sizeof(png_bytep));
   for (y = 0; y < pic->height; y++)
-    pic->data[y] = malloc(pic->width * sizeof(pixel));
-  png_read_image(png_ptr, (png_bytep*)pic->data);
+    row_pointers[y] = (png_bytep)image_row(pic, y);
+  png_read_image(png_ptr, row_pointers);
+  free(row_pointers);
   /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
   png_read_end(png_ptr, end_info);
   /* clean up after the read, and free any memory allocated - REQUIRED */
@@ -375,84 +599,531 @@ image_read(image * pic, FILE * f)
   return 0;
  error_exit:
   fprintf(stderr, "error exit\n");
-  if (pic) {
-    if (pic->data) {
-      for (y = 0; y < pic->height; y++)
-        free(pic->data[y]);
-      free(pic->data);
-    }
-  }
+  if (pic) image_free(pic);
   png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
   return -1;
 }
 #endif
 
+/** png output does not go through libpng: rows are filtered and deflated
+ * here, in chunks of any number of rows. every chunk is a deflate stream
+ * of its own that ends on a byte boundary (Z_SYNC_FLUSH), and the first
+ * row of a chunk is only filtered against its left neighbour, so a chunk
+ * does not depend on anything before it. that makes it possible to
+ * compress chunks on several threads and write them in order, each one in
+ * an IDAT of its own, between a zlib header at the start and an empty
+ * final block and the combined adler32 at the end.
+ */
+#define PALHASH 1024
+
+struct image_writer {
+  FILE * out;
+  int width, height;
+  image_format format;
+  int bpp;             /* bytes per pixel in the file */
+  unsigned long adler;
+  int error;
+  struct extra {
+    char type[4];
+    unsigned char * data;
+    size_t size;
+    struct extra * next;
+  } * extra;           /* written by image_write_end, after the IDATs */
+  unsigned int palkey[PALHASH]; /* 0x1000000 | rgb, 0 if unused */
+  unsigned char palindex[PALHASH];
+};
+
+void
+image_format_init(image_format * fmt)
+{
+  fmt->level = Z_DEFAULT_COMPRESSION;
+  fmt->filter = FILTER_ADAPTIVE;
+  fmt->indexed = 0;
+  fmt->ncolors = 0;
+}
+
+static unsigned int
+rgbkey(pixel p)
+{
+  return 0x1000000 | (p.r << 16) | (p.g << 8) | p.b;
+}
+
+static int
+palette_find(const unsigned int * keys, unsigned int key)
+{
+  unsigned int i = (key * 2654435761u) >> 22;
+  while (keys[i] && keys[i]!=key) i = (i + 1) % PALHASH;
+  return (int)i;
+}
+
 int
-image_write(image * pic, FILE * f)
+image_palette_add(image_format * fmt, pixel color)
 {
-  png_structp   png_ptr;
-  png_infop  info_ptr;
-  png_color_8   sig_bit;
+  int i;
+  for (i=0;i!=fmt->ncolors;++i) {
+    if (fmt->colors[i].r==color.r && fmt->colors[i].g==color.g && fmt->colors[i].b==color.b) return 0;
+  }
+  if (fmt->ncolors==256) return -1;
+  fmt->colors[fmt->ncolors++] = color;
+  return 0;
+}
 
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-            NULL, NULL, NULL);
-  if (png_ptr == NULL) {
-    return -1;
+static void
+write_chunk(image_writer * w, const char * type, const void * data, size_t size)
+{
+  unsigned char head[8], tail[4];
+  unsigned long crc;
+  head[0] = (unsigned char)(size >> 24);
+  head[1] = (unsigned char)(size >> 16);
+  head[2] = (unsigned char)(size >> 8);
+  head[3] = (unsigned char)size;
+  memcpy(head+4, type, 4);
+  crc = crc32(0, head+4, 4);
+  if (size) crc = crc32(crc, (const Bytef*)data, (uInt)size);
+  tail[0] = (unsigned char)(crc >> 24);
+  tail[1] = (unsigned char)(crc >> 16);
+  tail[2] = (unsigned char)(crc >> 8);
+  tail[3] = (unsigned char)crc;
+  if (fwrite(head, 1, 8, w->out)!=8 || (size && fwrite(data, 1, size, w->out)!=size) || fwrite(tail, 1, 4, w->out)!=4) {
+    w->error = -1;
   }
+}
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if (info_ptr == NULL) {
-    png_destroy_write_struct(&png_ptr, NULL);
-    return -1;
+static void
+put32(unsigned char * p, unsigned long x)
+{
+  p[0] = (unsigned char)(x >> 24);
+  p[1] = (unsigned char)(x >> 16);
+  p[2] = (unsigned char)(x >> 8);
+  p[3] = (unsigned char)x;
+}
+
+image_writer *
+image_write_begin(FILE * f, int width, int height, const image_format * fmt)
+{
+  static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  unsigned char buffer[768];
+  image_writer * w = calloc(1, sizeof(image_writer));
+  int i;
+
+  w->out = f;
+  w->width = width;
+  w->height = height;
+  if (fmt) w->format = *fmt;
+  else image_format_init(&w->format);
+  if (!w->format.indexed) w->format.ncolors = 0;
+  w->bpp = w->format.ncolors ? 1 : 3;
+  w->adler = adler32(0, NULL, 0);
+
+  if (fwrite(signature, 1, 8, f)!=8) w->error = -1;
+  put32(buffer, width);
+  put32(buffer+4, height);
+  buffer[8] = 8; /* bit depth */
+  buffer[9] = w->format.ncolors ? 3 : 2; /* palette or rgb */
+  buffer[10] = buffer[11] = buffer[12] = 0;
+  write_chunk(w, "IHDR", buffer, 13);
+  /* the gamma that libpng used to write */
+  put32(buffer, 60000);
+  write_chunk(w, "gAMA", buffer, 4);
+  buffer[0] = buffer[1] = buffer[2] = 8;
+  write_chunk(w, "sBIT", buffer, 3);
+  if (w->format.ncolors) {
+    for (i=0;i!=w->format.ncolors;++i) {
+      pixel p = w->format.colors[i];
+      int k = palette_find(w->palkey, rgbkey(p));
+      buffer[i*3] = p.r;
+      buffer[i*3+1] = p.g;
+      buffer[i*3+2] = p.b;
+      w->palkey[k] = rgbkey(p);
+      w->palindex[k] = (unsigned char)i;
+    }
+    write_chunk(w, "PLTE", buffer, w->format.ncolors*3);
   }
-  /*
-   * Set error handling.  REQUIRED if you aren't supplying your own
-   * error hadnling functions in the png_create_write_struct() call.
-   */
-  if (setjmp(png_ptr->jmpbuf)) {
-    /* If we get here, we had a problem writing the file */
-    png_destroy_write_struct(&png_ptr,  (png_infopp)NULL);
+  /* zlib header: deflate, 32K window, and a check value */
+  buffer[0] = 0x78;
+  buffer[1] = 0x9C;
+  write_chunk(w, "IDAT", buffer, 2);
+  return w;
+}
+
+/* the palette entry for a color. colors that are not in the palette
+ * should not happen, but get the closest one.
+ */
+static unsigned char
+palette_index(const image_writer * w, pixel p)
+{
+  int i = palette_find(w->palkey, rgbkey(p));
+  int best = 0, bestdist = INT_MAX;
+  if (w->palkey[i]) return w->palindex[i];
+  for (i=0;i!=w->format.ncolors;++i) {
+    int dr = p.r - w->format.colors[i].r;
+    int dg = p.g - w->format.colors[i].g;
+    int db = p.b - w->format.colors[i].b;
+    if (dr*dr+dg*dg+db*db<bestdist) {
+      bestdist = dr*dr+dg*dg+db*db;
+      best = i;
+    }
+  }
+  return (unsigned char)best;
+}
+
+static int
+paeth(int a, int b, int c)
+{
+  int pa = b - c;
+  int pb = a - c;
+  int pc = abs(pa + pb);
+  pa = abs(pa);
+  pb = abs(pb);
+  return (pa<=pb && pa<=pc) ? a : (pb<=pc) ? b : c;
+}
+
+/* filter row cur into out[1..n], with out[0] the filter type. prev is
+ * NULL for the first row of a chunk, where only NONE and SUB are used.
+ */
+static void
+filter_row(unsigned char * out, const unsigned char * cur, const unsigned char * prev, size_t n, int bpp, int filter)
+{
+  size_t i;
+  if (!prev) {
+    if (filter==FILTER_UP) filter = FILTER_NONE;
+    else if (filter!=FILTER_NONE) filter = FILTER_SUB;
+  }
+  out[0] = (unsigned char)filter;
+  ++out;
+  switch (filter) {
+  case FILTER_NONE:
+    memcpy(out, cur, n);
+    break;
+  case FILTER_SUB:
+    memcpy(out, cur, bpp);
+    for (i=bpp;i<n;++i) out[i] = (unsigned char)(cur[i] - cur[i-bpp]);
+    break;
+  case FILTER_UP:
+    for (i=0;i<n;++i) out[i] = (unsigned char)(cur[i] - prev[i]);
+    break;
+  case FILTER_AVERAGE:
+    for (i=0;i<(size_t)bpp;++i) out[i] = (unsigned char)(cur[i] - prev[i] / 2);
+    for (;i<n;++i) out[i] = (unsigned char)(cur[i] - (cur[i-bpp] + prev[i]) / 2);
+    break;
+  case FILTER_PAETH:
+    for (i=0;i<(size_t)bpp;++i) out[i] = (unsigned char)(cur[i] - prev[i]);
+    for (;i<n;++i) out[i] = (unsigned char)(cur[i] - paeth(cur[i-bpp], prev[i], prev[i-bpp]));
+    break;
+  }
+}
+
+/* the sum of the bytes a filter would produce, as signed values. smaller
+ * is better, and counting stops as soon as the sum exceeds limit.
+ */
+#define COST(expr) { \
+    signed char v = (signed char)(expr); \
+    sum += abs(v); \
+  }
+
+static unsigned long
+filter_cost(const unsigned char * cur, const unsigned char * prev, size_t n, int bpp, int filter, unsigned long limit)
+{
+  unsigned long sum = 0;
+  size_t i = 0, next;
+  while (i<n && sum<=limit) {
+    /* check the limit every 256 bytes */
+    next = min(n, i+256);
+    switch (filter) {
+    case FILTER_NONE:
+      for (;i<next;++i) COST(cur[i]);
+      break;
+    case FILTER_SUB:
+      for (;i<next && i<(size_t)bpp;++i) COST(cur[i]);
+      for (;i<next;++i) COST(cur[i] - cur[i-bpp]);
+      break;
+    case FILTER_UP:
+      for (;i<next;++i) COST(cur[i] - prev[i]);
+      break;
+    case FILTER_AVERAGE:
+      for (;i<next && i<(size_t)bpp;++i) COST(cur[i] - prev[i] / 2);
+      for (;i<next;++i) COST(cur[i] - (cur[i-bpp] + prev[i]) / 2);
+      break;
+    case FILTER_PAETH:
+      for (;i<next && i<(size_t)bpp;++i) COST(cur[i] - prev[i]);
+      for (;i<next;++i) COST(cur[i] - paeth(cur[i-bpp], prev[i], prev[i-bpp]));
+      break;
+    }
+  }
+  return sum;
+}
+
+/* filter a row with the configured filter, or with the one that libpng
+ * would choose: the smallest sum of absolute values.
+ */
+static void
+filter_best(unsigned char * out, const unsigned char * cur, const unsigned char * prev, size_t n, int bpp, int filter)
+{
+  if (filter==FILTER_ADAPTIVE) {
+    unsigned long best = ULONG_MAX;
+    int f, last = prev ? FILTER_PAETH : FILTER_SUB;
+    for (f=FILTER_NONE;f<=last;++f) {
+      unsigned long cost = filter_cost(cur, prev, n, bpp, f, best);
+      if (cost<best) {
+        best = cost;
+        filter = f;
+      }
+    }
+  }
+  filter_row(out, cur, prev, n, bpp, filter);
+}
+
+int
+image_compress(const image_writer * w, const image * pic, int rows, image_chunk * chunk)
+{
+  size_t n = (size_t)w->width * w->bpp;
+  size_t rawsize = (n + 1) * rows;
+  unsigned char * raw = malloc(rawsize);
+  unsigned char * line[2];
+  z_stream zs;
+  int y, x, result;
+
+  line[0] = malloc(n);
+  line[1] = malloc(n);
+  for (y=0;y!=rows;++y) {
+    const pixel * src = image_row(pic, y);
+    unsigned char * cur = line[y%2];
+    if (w->bpp==1) {
+      for (x=0;x!=w->width;++x) cur[x] = palette_index(w, src[x]);
+    } else {
+      for (x=0;x!=w->width;++x) {
+        cur[x*3] = src[x].r;
+        cur[x*3+1] = src[x].g;
+        cur[x*3+2] = src[x].b;
+      }
+    }
+    filter_best(raw + (n+1)*y, cur, y ? line[(y+1)%2] : NULL, n, w->bpp, w->format.filter);
+  }
+  free(line[0]);
+  free(line[1]);
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, w->format.level, Z_DEFLATED, -15, 8,
+        w->format.filter==FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED)!=Z_OK) {
+    free(raw);
     return -1;
   }
-  png_init_io(png_ptr, f);
-  png_set_IHDR(png_ptr, info_ptr, pic->width, pic->height, 8,
-     PNG_COLOR_TYPE_RGB,
-     PNG_INTERLACE_NONE,
-     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-  sig_bit.red   = 8;
-  sig_bit.green = 8;
-  sig_bit.blue  = 8;
-  png_set_sBIT(png_ptr, info_ptr, &sig_bit);
-  png_set_gAMA(png_ptr, info_ptr, 0.6);
-  /*
-   * Hier knnte man Text-Chunks schreiben.
-   * Bild-Info in Datei schreiben.
-   */
-  png_write_info(png_ptr, info_ptr);
-  /*
-   * Jetzt wird das Bild geschrieben:
-   */
-  png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
-  png_write_image(png_ptr, (png_bytep*)pic->data);
+  chunk->size = deflateBound(&zs, (uLong)rawsize) + 16;
+  chunk->data = malloc(chunk->size);
+  zs.next_in = raw;
+  zs.avail_in = (uInt)rawsize;
+  zs.next_out = chunk->data;
+  zs.avail_out = (uInt)chunk->size;
+  result = deflate(&zs, Z_SYNC_FLUSH);
+  while (result==Z_OK && zs.avail_out==0) {
+    size_t done = chunk->size;
+    chunk->size *= 2;
+    chunk->data = realloc(chunk->data, chunk->size);
+    zs.next_out = chunk->data + done;
+    zs.avail_out = (uInt)(chunk->size - done);
+    result = deflate(&zs, Z_SYNC_FLUSH);
+  }
+  chunk->size -= zs.avail_out;
+  deflateEnd(&zs);
+  chunk->adler = adler32(adler32(0, NULL, 0), raw, (uInt)rawsize);
+  chunk->rawsize = rawsize;
+  free(raw);
+  return (result==Z_OK || result==Z_BUF_ERROR) ? 0 : -1;
+}
+
+void
+image_chunk_free(image_chunk * chunk)
+{
+  free(chunk->data);
+  chunk->data = NULL;
+}
 
-  png_write_end(png_ptr, info_ptr);
-  png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+int
+image_write_chunk(image_writer * w, const image_chunk * chunk)
+{
+  write_chunk(w, "IDAT", chunk->data, chunk->size);
+  w->adler = adler32_combine(w->adler, chunk->adler, (z_off_t)chunk->rawsize);
+  return w->error;
+}
 
-  return 0;
+int
+image_write_rows(image_writer * w, const image * pic, int rows)
+{
+  image_chunk chunk;
+  if (image_compress(w, pic, rows, &chunk)!=0) return -1;
+  image_write_chunk(w, &chunk);
+  image_chunk_free(&chunk);
+  return w->error;
+}
+
+int
+image_write_extra(image_writer * w, const char * type, const void * data, size_t size)
+{
+  struct extra ** ep = &w->extra;
+  while (*ep) ep = &(*ep)->next;
+  *ep = calloc(1, sizeof(struct extra));
+  memcpy((*ep)->type, type, 4);
+  (*ep)->data = malloc(size ? size : 1);
+  memcpy((*ep)->data, data, size);
+  (*ep)->size = size;
+  return w->error;
+}
+
+int
+image_write_end(image_writer * w)
+{
+  unsigned char buffer[6];
+  int result;
+  /* an empty final block, fixed huffman codes */
+  buffer[0] = 0x03;
+  buffer[1] = 0x00;
+  put32(buffer+2, w->adler);
+  write_chunk(w, "IDAT", buffer, 6);
+  while (w->extra) {
+    struct extra * e = w->extra;
+    write_chunk(w, e->type, e->data, e->size);
+    w->extra = e->next;
+    free(e->data);
+    free(e);
+  }
+  write_chunk(w, "IEND", NULL, 0);
+  result = w->error;
+  free(w);
+  return result;
+}
+
+int
+image_write(image * pic, FILE * f, const image_format * fmt)
+{
+  image_format format;
+  image_writer * w;
+  int x, y;
+
+  if (fmt) format = *fmt;
+  else image_format_init(&format);
+  if (format.indexed) {
+    unsigned int keys[PALHASH];
+    memset(keys, 0, sizeof(keys));
+    format.ncolors = 0;
+    for (y=0;y!=pic->height && format.indexed;++y) {
+      const pixel * row = image_row(pic, y);
+      for (x=0;x!=pic->width;++x) {
+        unsigned int key = rgbkey(row[x]);
+        int k = palette_find(keys, key);
+        if (keys[k]) continue;
+        if (format.ncolors==256) {
+          format.indexed = 0;
+          break;
+        }
+        keys[k] = key;
+        format.colors[format.ncolors++] = row[x];
+      }
+    }
+  }
+  w = image_write_begin(f, pic->width, pic->height, &format);
+  if (image_write_rows(w, pic, pic->height)!=0) {
+    image_write_end(w);
+    return -1;
+  }
+  return image_write_end(w);
 }
 
 int
 image_create(image * img, int width, int height)
 {
-  int y;
+  size_t size;
   assert(img);
+  if (!copy_masked) blit_init();
   img->width = width;
   img->height = height;
-  img->data = malloc(height * sizeof(pixel*));
+  img->stride = (width + IMAGE_ALIGN/sizeof(pixel) - 1) & ~(IMAGE_ALIGN/sizeof(pixel) - 1);
+  size = (size_t)img->stride * height * sizeof(pixel);
+#ifdef _MSC_VER
+  img->data = _aligned_malloc(size ? size : IMAGE_ALIGN, IMAGE_ALIGN);
+#else
+  if (posix_memalign((void**)&img->data, IMAGE_ALIGN, size ? size : IMAGE_ALIGN)!=0) img->data = NULL;
+#endif
   if (!img->data) return -1;
-  for (y = 0; y < height; y++) {
-    img->data[y] = calloc(width, sizeof(pixel));
-    if (!img->data[y]) return -1;
-  }
+  memset(img->data, 0, size);
   return 0;
 }
+
+void
+image_free(image * img)
+{
+#ifdef _MSC_VER
+  _aligned_free(img->data);
+#else
+  free(img->data);
+#endif
+  img->data = NULL;
+}
+
+static unsigned long
+get32(const unsigned char * p)
+{
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* the IDATs of a file from image_write_begin are the zlib header, one for
+ * every chunk, and the final block with the adler32.
+ */
+int
+image_read_chunks(FILE * f, const char * type, image_chunk ** chunks, int * nchunks,
+                  unsigned char ** extra, size_t * extrasize)
+{
+  static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  unsigned char head[8], tail[4];
+  int idats = 0, space = 0;
+
+  *chunks = NULL;
+  *nchunks = 0;
+  *extra = NULL;
+  *extrasize = 0;
+  if (fread(head, 1, 8, f)!=8 || memcmp(head, signature, 8)) return -1;
+  while (fread(head, 1, 8, f)==8) {
+    size_t size = get32(head);
+    unsigned char * data = malloc(size ? size : 1);
+    if (fread(data, 1, size, f)!=size || fread(tail, 1, 4, f)!=4
+        || get32(tail)!=(crc32(crc32(0, head+4, 4), data, (uInt)size) & 0xFFFFFFFFUL)) {
+      free(data);
+      break;
+    }
+    if (!memcmp(head+4, "IDAT", 4)) {
+      if (idats++==0 && (size!=2 || data[0]!=0x78)) {
+        free(data);
+        break;
+      }
+      if (*nchunks==space) {
+        space = space ? space*2 : 64;
+        *chunks = realloc(*chunks, space * sizeof(image_chunk));
+      }
+      (*chunks)[*nchunks].data = data;
+      (*chunks)[*nchunks].size = size;
+      (*chunks)[*nchunks].adler = 0;
+      (*chunks)[*nchunks].rawsize = 0;
+      ++*nchunks;
+    } else if (!*extra && !memcmp(head+4, type, 4)) {
+      *extra = data;
+      *extrasize = size;
+    } else {
+      free(data);
+      if (!memcmp(head+4, "IEND", 4)) {
+        /* drop the zlib header and the final block */
+        if (*nchunks<2) break;
+        image_chunk_free(*chunks);
+        image_chunk_free(*chunks + *nchunks - 1);
+        *nchunks -= 2;
+        memmove(*chunks, *chunks + 1, *nchunks * sizeof(image_chunk));
+        return 0;
+      }
+    }
+  }
+  while (*nchunks) image_chunk_free(*chunks + --*nchunks);
+  free(*chunks);
+  *chunks = NULL;
+  free(*extra);
+  *extra = NULL;
+  *extrasize = 0;
+  return -1;
+}
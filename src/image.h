@@ -1,3 +1,5 @@
+#ifndef CR_IMAGE_H
+#define CR_IMAGE_H
 
 typedef
 struct pixel {
@@ -5,14 +7,98 @@ struct pixel {
   unsigned char alpha;
 } pixel;
 
+/** all rows of an image live in one block of memory. rows are padded
+ * to a multiple of IMAGE_ALIGN bytes, and the block itself is aligned
+ * the same way, so every row can be processed with aligned vector loads.
+ */
+#define IMAGE_ALIGN 32
+
 typedef
 struct image {
   int width;
   int height;
-  pixel ** data;
+  int stride; /* distance between two rows, in pixels */
+  pixel * data;
 } image;
 
+#define image_row(img, y) ((img)->data + (size_t)(y) * (img)->stride)
+#define image_pixel(img, x, y) (image_row(img, y)[x])
+
 int image_create(image * img, int width, int height);
-int image_write(image * pic, FILE * f);
+void image_free(image * img);
 int image_read(image * pic, FILE * f);
-void image_bitblt(image* dest, image * src, int xof, int yof);
+
+/** how a png is written. indexed color is used if the image has no more
+ * than 256 colors. image_write finds them itself, image_write_begin has
+ * to be given the palette in colors.
+ */
+enum {
+  FILTER_NONE,
+  FILTER_SUB,
+  FILTER_UP,
+  FILTER_AVERAGE,
+  FILTER_PAETH,
+  FILTER_ADAPTIVE /* the best of the above for each row */
+};
+
+typedef
+struct image_format {
+  int level;  /* zlib compression level, 0 to 9, -1 for the default */
+  int filter;
+  int indexed;
+  int ncolors;
+  pixel colors[256];
+} image_format;
+
+void image_format_init(image_format * fmt);
+/* add a color to the palette, -1 if it is full */
+int image_palette_add(image_format * fmt, pixel color);
+
+int image_write(image * pic, FILE * f, const image_format * fmt);
+
+/** writing a png in pieces: image_write_rows appends the first rows rows
+ * of pic to the file, so an image can be produced a band at a time
+ * without ever holding all of it in memory. image_write_rows is
+ * image_compress followed by image_write_chunk, and image_compress may be
+ * called from several threads at once, as long as the chunks are written
+ * in the order of their rows.
+ */
+typedef struct image_writer image_writer;
+
+typedef
+struct image_chunk {
+  unsigned char * data;
+  size_t size;
+  unsigned long adler; /* of the uncompressed rows */
+  size_t rawsize;
+} image_chunk;
+
+image_writer * image_write_begin(FILE * f, int width, int height, const image_format * fmt);
+int image_compress(const image_writer * w, const image * pic, int rows, image_chunk * chunk);
+int image_write_chunk(image_writer * w, const image_chunk * chunk);
+void image_chunk_free(image_chunk * chunk);
+int image_write_rows(image_writer * w, const image * pic, int rows);
+/* an ancillary chunk of the caller's own, written after the image data */
+int image_write_extra(image_writer * w, const char * type, const void * data, size_t size);
+int image_write_end(image_writer * w);
+
+/** the other way round, for a png written by image_write_begin: the
+ * compressed data of every image_write_chunk in chunks (without adler and
+ * rawsize, which the file does not keep), and the data of the first
+ * chunk of the given type in extra. returns -1 if the file is not a png,
+ * or was not written in chunks.
+ */
+int image_read_chunks(FILE * f, const char * type, image_chunk ** chunks, int * nchunks,
+                      unsigned char ** extra, size_t * extrasize);
+
+/* copy all pixels of src that are not fully transparent */
+void image_bitblt(image* dest, const image * src, int xof, int yof);
+/* draw src over dest, mixing colors by the alpha value of src */
+void image_blend(image* dest, const image * src, int xof, int yof);
+/* the vector instructions image_bitblt and image_blend use: none, sse2
+ * or avx2. only known once the first image has been created */
+const char * image_simd(void);
+/* shrink src to half its size, averaging 2x2 pixels, and put it at (xof, yof) */
+void image_downsample(image * dest, const image * src, int xof, int yof);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ *  islands - finding groups of regions for Eressea CR tools
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+#include "islands.h"
+
+#include <stdlib.h>
+
+/* the regions are put into a hash table by their coordinates, and every
+ * region is joined with all regions within gap+1 steps of it, in a
+ * union-find forest.
+ */
+
+static unsigned int
+coor_hash(int x, int y)
+{
+  return ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u);
+}
+
+static int
+find_root(int * parent, int i)
+{
+  while (parent[i]!=i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+int
+find_islands(const int * x, const int * y, int n, int gap, int * island)
+{
+  unsigned int size = 16, mask;
+  int * table;
+  int * parent;
+  int i, dx, dy, islands = 0;
+  int reach = gap+1;
+
+  while (size < (unsigned int)n*2) size *= 2;
+  mask = size-1;
+  table = malloc(size * sizeof(int));
+  parent = malloc((n ? n : 1) * sizeof(int));
+  for (i=0;i!=(int)size;++i) table[i] = -1;
+  for (i=0;i!=n;++i) {
+    unsigned int k = coor_hash(x[i], y[i]) & mask;
+    while (table[k]>=0 && (x[table[k]]!=x[i] || y[table[k]]!=y[i])) k = (k+1) & mask;
+    if (table[k]<0) table[k] = i;
+    parent[i] = i;
+  }
+
+  for (i=0;i!=n;++i) {
+    /* the hexes within reach, |dx|+|dy|+|dx+dy| <= 2*reach, but only
+     * the half of them that come after i, the others find i */
+    for (dy=0;dy<=reach;++dy) {
+      for (dx=dy ? -reach : 1;dx<=reach-dy;++dx) {
+        int nx = x[i]+dx, ny = y[i]+dy;
+        unsigned int k = coor_hash(nx, ny) & mask;
+        while (table[k]>=0 && (x[table[k]]!=nx || y[table[k]]!=ny)) k = (k+1) & mask;
+        if (table[k]>=0) {
+          int a = find_root(parent, i), b = find_root(parent, table[k]);
+          /* the smaller index is the root, so roots are first regions */
+          if (a<b) parent[b] = a;
+          else if (b<a) parent[a] = b;
+        }
+      }
+    }
+  }
+
+  /* number the islands in the order of their first region */
+  for (i=0;i!=n;++i) {
+    int root = find_root(parent, i);
+    if (root==i) island[i] = islands++;
+    else island[i] = island[root];
+  }
+  free(parent);
+  free(table);
+  return islands;
+}
@@ -0,0 +1,40 @@
+/*
+ *  islands - finding groups of regions for Eressea CR tools
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef CR_ISLANDS_H
+#define CR_ISLANDS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** regions that are close to each other form an island, so that a map
+ * can be made of each island instead of one of the whole bounding box.
+ * two regions are on the same island if there are no more than gap
+ * regions between them, on the hex grid of the report. find_islands
+ * takes the coordinates of n regions, and puts the number of its island
+ * into island[i] for every region. islands are numbered from 0, in the
+ * order of their first region. returns the number of islands.
+ */
+extern int find_islands(const int * x, const int * y, int n, int gap, int * island);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
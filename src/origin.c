@@ -19,44 +19,100 @@
 #include "config.h"
 #include "origin.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* parent chains longer than this are considered to be cycles */
+#define MAXDEPTH 64
+
 origin *
-o_add(origin ** olist, int id)
+o_add(origins * table, int id)
 {
   origin * o = calloc(sizeof(origin), 1);
-  o->next = *olist;
+  unsigned int key = (unsigned int)id % OMAXHASH;
+  o->next = table->list;
+  o->nexthash = table->hash[key];
   o->id = id;
-  return *olist = o;
+  table->hash[key] = o;
+  ++table->generation;
+  return table->list = o;
+}
+
+origin *
+o_find(origins * table, int id)
+{
+  origin * root = table->hash[(unsigned int)id % OMAXHASH];
+  while (root && root->id!=id) root=root->nexthash;
+  return root;
 }
 
 origin *
-o_find(origin * root, int id)
+o_find_name(origins * table, const char * name)
 {
-  while (root && root->id!=id) root=root->next;
+  origin * root = table->list;
+  while (root && (!root->name || stricmp(root->name, name))) root=root->next;
   return root;
 }
 
+/** the absolute offset of a coordinate system is the sum of all
+ * offsets along its parent chain. it is computed once and then
+ * cached until the table changes.
+ * returns 0 on success, -1 if the parent chain has a cycle.
+ */
+int
+o_offset(origins * table, const origin * o, int * x, int * y)
+{
+  const origin * chain[MAXDEPTH];
+  int depth = 0;
+  int ax = 0, ay = 0;
+
+  while (o && o->generation!=table->generation) {
+    if (depth==MAXDEPTH) return -1;
+    chain[depth++] = o;
+    o = o->parent;
+  }
+  if (o) {
+    ax = o->absx;
+    ay = o->absy;
+  }
+  while (depth--) {
+    origin * c = (origin *)chain[depth];
+    ax += c->x;
+    ay += c->y;
+    c->absx = ax;
+    c->absy = ay;
+    c->generation = table->generation;
+  }
+  *x = ax;
+  *y = ay;
+  return 0;
+}
+
 block_t
 origin_create(context_t context, const char * name, const int * ids, size_t size)
 {
-  origin ** olist = (origin **)context;
+  origins * table = (origins *)context;
   origin * o;
   if (stricmp(name, "ORIGIN")) return NULL;
   if (size!=1) return NULL;
-  o = o_find(*olist, ids[0]);
-  if (!o) o = o_add(olist, ids[0]);
+  o = o_find(table, ids[0]);
+  if (!o) o = o_add(table, ids[0]);
   return (block_t)o;
 }
 
 void
 origin_destroy(context_t context, block_t block)
 {
-  origin ** olist = (origin **)context;
+  origins * table = (origins *)context;
   origin * o = (origin*)block;
+  origin ** olist = &table->list;
   while (*olist!=o) olist=&(*olist)->next;
   *olist = (*olist)->next;
+  olist = &table->hash[(unsigned int)o->id % OMAXHASH];
+  while (*olist!=o) olist=&(*olist)->nexthash;
+  *olist = (*olist)->nexthash;
+  ++table->generation;
   free(o);
 }
 
@@ -70,27 +126,29 @@ const report_interface ocollection = {
 void
 origin_set_int(context_t context, block_t b, const char * key, int i)
 {
-  origin ** olist = (origin **)context;
+  origins * table = (origins *)context;
   origin * o = (origin*)b;
   if (!o) return;
   if (!stricmp(key, "parent")) {
-    origin * p = o_find(*olist, i);
-    if (!p) p = o_add(olist, i);
+    origin * p = o_find(table, i);
+    if (!p) p = o_add(table, i);
     o->parent = p;
+    ++table->generation;
   }
 }
 
 void
 origin_set_ints(context_t context, block_t b, const char * key, const int * i, size_t size)
 {
+  origins * table = (origins *)context;
   origin * o = (origin*)b;
-  unused(context);
   unused(size);
   if (!o) return;
   if (!stricmp(key, "offset"))
   {
     o->x=i[0];
     o->y=i[1];
+    ++table->generation;
   }
 }
 
@@ -23,6 +23,8 @@
 extern "C" {
 #endif
 
+#define OMAXHASH 127
+
 typedef struct origin
 {
   int id;
@@ -31,13 +33,30 @@ typedef struct origin
   int y;
   struct origin * parent;
   struct origin * next;
+  struct origin * nexthash;
+
+  /* offset relative to the root of the parent chain, see o_offset: */
+  int absx, absy;
+  unsigned int generation;
 } origin;
 
+/** all known coordinate systems, hashed by id.
+ * this is the context for the ocollection and oblock interfaces.
+ */
+typedef struct origins
+{
+  struct origin * list;
+  struct origin * hash[OMAXHASH];
+  unsigned int generation; /* changes whenever an offset or parent changes */
+} origins;
+
 #include "crparse.h"
 
 extern const struct report_interface ocollection;
 extern const struct block_interface oblock;
-extern struct origin * o_find(struct origin * root, int id);
+extern struct origin * o_find(struct origins * table, int id);
+extern struct origin * o_find_name(struct origins * table, const char * name);
+extern int o_offset(struct origins * table, const struct origin * o, int * x, int * y);
 
 #ifdef __cplusplus
 }
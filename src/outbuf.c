@@ -0,0 +1,81 @@
+/*
+ *  outbuf - buffered output for Eressea CR tools
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+#include "outbuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+outbuf *
+ob_create(FILE * out)
+{
+  outbuf * ob = (outbuf *)malloc(sizeof(outbuf));
+  ob->out = out;
+  ob->size = 0;
+  return ob;
+}
+
+void
+ob_flush(outbuf * ob)
+{
+  if (ob->size) fwrite(ob->data, 1, ob->size, ob->out);
+  ob->size = 0;
+}
+
+void
+ob_destroy(outbuf * ob)
+{
+  ob_flush(ob);
+  fflush(ob->out);
+  free(ob);
+}
+
+void
+ob_write(outbuf * ob, const char * data, size_t size)
+{
+  if (ob->size+size>OUTBUFSIZE) {
+    ob_flush(ob);
+    if (size>OUTBUFSIZE) {
+      fwrite(data, 1, size, ob->out);
+      return;
+    }
+  }
+  memcpy(ob->data+ob->size, data, size);
+  ob->size += size;
+}
+
+void
+ob_puts(outbuf * ob, const char * str)
+{
+  ob_write(ob, str, strlen(str));
+}
+
+void
+ob_int(outbuf * ob, int i)
+{
+  char buffer[12];
+  char * cp = buffer+sizeof(buffer);
+  unsigned int u = (i<0)?0U-(unsigned int)i:(unsigned int)i;
+  do {
+    *--cp = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (i<0) *--cp = '-';
+  ob_write(ob, cp, buffer+sizeof(buffer)-cp);
+}
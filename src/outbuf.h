@@ -0,0 +1,53 @@
+/*
+ *  outbuf - buffered output for Eressea CR tools
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef CR_OUTBUF_H
+#define CR_OUTBUF_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OUTBUFSIZE (64 * 1024)
+
+/** an output buffer that is written to a FILE in large blocks.
+ * it is meant for tools that write a lot of small pieces and would
+ * otherwise spend their time in fprintf.
+ */
+typedef struct outbuf {
+  FILE * out;
+  size_t size;
+  char data[OUTBUFSIZE];
+} outbuf;
+
+extern outbuf * ob_create(FILE * out);
+extern void ob_destroy(outbuf * ob);
+extern void ob_flush(outbuf * ob);
+extern void ob_write(outbuf * ob, const char * data, size_t size);
+extern void ob_puts(outbuf * ob, const char * str);
+extern void ob_int(outbuf * ob, int i);
+
+#define ob_putc(ob, c) do { if ((ob)->size==OUTBUFSIZE) ob_flush(ob); (ob)->data[(ob)->size++] = (char)(c); } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
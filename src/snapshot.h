@@ -0,0 +1,86 @@
+/*
+ *  snapshot - a binary format for CR data
+ *  Copyright (C) 2006 Enno Rehling
+ *
+ * This file is part of crtools.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef CR_SNAPSHOT_H
+#define CR_SNAPSHOT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** a snapshot is the content of a crdata, written by crdata_save_snapshot.
+ * it starts with a header that gives the size and position of each of the
+ * sections below, all of them arrays of ints in the byte order of the
+ * machine that wrote it. a reference to another record is its index in
+ * its section, or -1. the blocks are in the order of a CR file, so every
+ * block comes after its parent.
+ */
+#define SNAPSHOT_MAGIC "\211CRSNAP\n"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTEORDER 0x01020304
+
+enum {
+  SNAP_TYPES,      /* snap_type, parents before their children */
+  SNAP_PROPERTIES, /* an int for each: the offset of its name in STRINGS */
+  SNAP_BLOCKS,     /* snap_block */
+  SNAP_ENTRIES,    /* snap_entry, those of a block are consecutive */
+  SNAP_INTS,       /* block ids, and int lists with their size first */
+  SNAP_STRINGS,    /* zero-terminated */
+  SNAP_SECTIONS
+};
+
+typedef struct snap_header {
+  char magic[8];
+  unsigned int byteorder;
+  unsigned int version;
+  unsigned int offset[SNAP_SECTIONS]; /* in bytes, from the start of the file */
+  unsigned int count[SNAP_SECTIONS];  /* records, or bytes for STRINGS */
+} snap_header;
+
+typedef struct snap_type {
+  int name;
+  int parent, unique;
+  unsigned int flags;
+} snap_type;
+
+typedef struct snap_block {
+  int type;
+  int parent, children, next;
+  int turn;
+  int ids, size; /* ids are in INTS */
+  int entries, nentries;
+} snap_block;
+
+enum { SNAP_INT, SNAP_INTLIST, SNAP_STRING, SNAP_MESSAGE };
+
+typedef struct snap_entry {
+  int tag;   /* property, -1 for messages */
+  int type;
+  int value; /* the int, or an offset into INTS or STRINGS */
+} snap_entry;
+
+/* the header of data, if it is a snapshot that can be read on this machine */
+extern const snap_header * snapshot_check(const void * data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif